@@ -0,0 +1,146 @@
+/*
+ * Parallel bounding box reduction, see bounds.h
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+#include "bounds.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// points a thread takes at a time, small enough to spread one large mesh
+static const size_t BlockPoints = 1 << 16;
+
+struct BoundsBlock {
+    const BoundsInput *input;
+    size_t first, count;
+};
+
+struct BoundsWork {
+    std::vector<BoundsBlock> blocks;
+    size_t next;    // the next block to take, shared by the threads
+};
+
+struct BoundsResult {
+    BoundsWork *work;
+    GLfloat min[3], max[3];
+    pthread_t thread;
+};
+
+static void
+reduce_block(const BoundsBlock &b, GLfloat min[3], GLfloat max[3])
+{
+    const GLfloat *m = b.input->world;
+    const GLfloat *p = b.input->points + 3 * b.first;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128 m0 = _mm_set1_ps(m[0]), m1 = _mm_set1_ps(m[1]), m2 = _mm_set1_ps(m[2]);
+    const __m128 m4 = _mm_set1_ps(m[4]), m5 = _mm_set1_ps(m[5]), m6 = _mm_set1_ps(m[6]);
+    const __m128 m8 = _mm_set1_ps(m[8]), m9 = _mm_set1_ps(m[9]), m10 = _mm_set1_ps(m[10]);
+    const __m128 m12 = _mm_set1_ps(m[12]), m13 = _mm_set1_ps(m[13]), m14 = _mm_set1_ps(m[14]);
+    const __m128 inf = _mm_set1_ps(HUGE_VALF), ninf = _mm_set1_ps(-HUGE_VALF);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 x0 = inf, y0 = inf, z0 = inf, x1 = ninf, y1 = ninf, z1 = ninf;
+
+    for (; i + 4 <= b.count; i += 4, p += 12) {
+        // four x y z triples, transposed to x, y and z of each
+        __m128 a = _mm_loadu_ps(p), c = _mm_loadu_ps(p + 4), d = _mm_loadu_ps(p + 8);
+        __m128 px = _mm_shuffle_ps(a, _mm_shuffle_ps(c, d, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+        __m128 py = _mm_shuffle_ps(_mm_shuffle_ps(a, c, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(c, d, _MM_SHUFFLE(2, 2, 3, 3)),
+                                   _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 pz = _mm_shuffle_ps(_mm_shuffle_ps(a, c, _MM_SHUFFLE(1, 1, 2, 2)), d, _MM_SHUFFLE(3, 0, 2, 0));
+
+        __m128 wx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, px), _mm_mul_ps(m4, py)), _mm_add_ps(_mm_mul_ps(m8, pz), m12));
+        __m128 wy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, px), _mm_mul_ps(m5, py)), _mm_add_ps(_mm_mul_ps(m9, pz), m13));
+        __m128 wz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, px), _mm_mul_ps(m6, py)), _mm_add_ps(_mm_mul_ps(m10, pz), m14));
+
+        // false for infinite and NaN coordinates, those points leave the bounds alone
+        __m128 finite = _mm_and_ps(_mm_and_ps(_mm_cmplt_ps(_mm_and_ps(wx, absMask), inf),
+                                              _mm_cmplt_ps(_mm_and_ps(wy, absMask), inf)),
+                                   _mm_cmplt_ps(_mm_and_ps(wz, absMask), inf));
+        x0 = _mm_min_ps(x0, _mm_or_ps(_mm_and_ps(finite, wx), _mm_andnot_ps(finite, inf)));
+        y0 = _mm_min_ps(y0, _mm_or_ps(_mm_and_ps(finite, wy), _mm_andnot_ps(finite, inf)));
+        z0 = _mm_min_ps(z0, _mm_or_ps(_mm_and_ps(finite, wz), _mm_andnot_ps(finite, inf)));
+        x1 = _mm_max_ps(x1, _mm_or_ps(_mm_and_ps(finite, wx), _mm_andnot_ps(finite, ninf)));
+        y1 = _mm_max_ps(y1, _mm_or_ps(_mm_and_ps(finite, wy), _mm_andnot_ps(finite, ninf)));
+        z1 = _mm_max_ps(z1, _mm_or_ps(_mm_and_ps(finite, wz), _mm_andnot_ps(finite, ninf)));
+    }
+
+    float lanes[6][4];
+    _mm_storeu_ps(lanes[0], x0); _mm_storeu_ps(lanes[1], y0); _mm_storeu_ps(lanes[2], z0);
+    _mm_storeu_ps(lanes[3], x1); _mm_storeu_ps(lanes[4], y1); _mm_storeu_ps(lanes[5], z1);
+    for (int l = 0; l < 4; l++) {
+        for (int k = 0; k < 3; k++) {
+            min[k] = std::min(min[k], lanes[k][l]);
+            max[k] = std::max(max[k], lanes[3+k][l]);
+        }
+    }
+#endif
+
+    for (; i < b.count; i++, p += 3) {
+        GLfloat w[3];
+        for (int k = 0; k < 3; k++)
+            w[k] = m[k] * p[0] + m[4+k] * p[1] + m[8+k] * p[2] + m[12+k];
+        if (!(fabsf(w[0]) < HUGE_VALF && fabsf(w[1]) < HUGE_VALF && fabsf(w[2]) < HUGE_VALF))
+            continue;
+        for (int k = 0; k < 3; k++) {
+            min[k] = std::min(min[k], w[k]);
+            max[k] = std::max(max[k], w[k]);
+        }
+    }
+}
+
+static void *
+bounds_worker(void *arg)
+{
+    BoundsResult *r = (BoundsResult*)arg;
+    BoundsWork *work = r->work;
+    for (;;) {
+        size_t i = __sync_fetch_and_add(&work->next, 1);
+        if (i >= work->blocks.size())
+            return NULL;
+        reduce_block(work->blocks[i], r->min, r->max);
+    }
+}
+
+void reduce_bounds(const BoundsInput *inputs, size_t n, int threads, GLfloat min[3], GLfloat max[3])
+{
+    BoundsWork work;
+    work.next = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (size_t first = 0; first < inputs[i].count; first += BlockPoints) {
+            BoundsBlock b = { &inputs[i], first, std::min(BlockPoints, inputs[i].count - first) };
+            work.blocks.push_back(b);
+        }
+    }
+
+    std::vector<BoundsResult> results(std::max<size_t>(1, std::min<size_t>(std::max(threads, 1), work.blocks.size())));
+    for (size_t t = 0; t < results.size(); t++) {
+        results[t].work = &work;
+        for (int k = 0; k < 3; k++) {
+            results[t].min[k] = HUGE_VALF;
+            results[t].max[k] = -HUGE_VALF;
+        }
+    }
+    // the caller reduces blocks too, so whatever threads could be started are enough
+    size_t started = 1;
+    while (started < results.size() && pthread_create(&results[started].thread, NULL, bounds_worker, &results[started]) == 0)
+        started++;
+    bounds_worker(&results[0]);
+
+    for (int k = 0; k < 3; k++) {
+        min[k] = results[0].min[k];
+        max[k] = results[0].max[k];
+    }
+    for (size_t t = 1; t < started; t++) {
+        pthread_join(results[t].thread, NULL);
+        for (int k = 0; k < 3; k++) {
+            min[k] = std::min(min[k], results[t].min[k]);
+            max[k] = std::max(max[k], results[t].max[k]);
+        }
+    }
+}
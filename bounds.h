@@ -0,0 +1,27 @@
+/*
+ * Bounding box of a scene, reduced over all of its transformed vertices
+ *
+ * The vertices of every mesh instance are transformed by the instance's world
+ * matrix and folded into a running minimum and maximum, four at a time with
+ * SSE. Instances are cut into blocks that a few threads take in turn, each
+ * keeping bounds of its own that are merged at the end.
+ */
+
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include <stddef.h>
+#include "gl_wrap.h"
+
+// points to reduce, count consecutive x y z triples moved by an affine matrix
+struct BoundsInput {
+    const GLfloat *points;
+    size_t count;
+    GLfloat world[16];    // column-major, the last row is ignored
+};
+
+/* bounds of all points of inputs[0..n) on up to threads threads; without any
+ * point min > max. Non-finite coordinates are skipped. */
+void reduce_bounds(const BoundsInput *inputs, size_t n, int threads, GLfloat min[3], GLfloat max[3]);
+
+#endif
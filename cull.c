@@ -0,0 +1,163 @@
+/*
+ * Culling on the CPU, see cull.h
+ */
+
+#include <math.h>
+#include "cull.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* The rasterizer snaps vertices to its subpixel grid, so a pixel center that
+ * is just outside a triangle's bounds here may be inside them there; centers
+ * this close to the bounds count as covered. */
+static const float SnapSlack = 1.0f / 8;
+
+/* Bounds as wide as this come from vertices at or near infinity, the
+ * triangle is kept and left to GL */
+static const float MaxExtent = 1e30f;
+
+BoxVisibility box_visibility(const GLfloat clip[16], const GLfloat min[3], const GLfloat max[3])
+{
+    if (!(min[0] <= max[0] && min[1] <= max[1] && min[2] <= max[2]))
+        return BOX_OUTSIDE;
+
+    bool inside = true;
+    for (int i = 0; i < 6; i++) {
+        // the planes are the last row of the matrix plus or minus one of the others
+        int row = i / 2;
+        float sign = i % 2 ? -1.0f : 1.0f;
+        float plane[4];
+        for (int k = 0; k < 4; k++)
+            plane[k] = clip[4*k + 3] + sign * clip[4*k + row];
+
+        // the corners farthest along and against the plane normal
+        float farthest = plane[3], nearest = plane[3];
+        for (int k = 0; k < 3; k++) {
+            farthest += plane[k] * (plane[k] > 0 ? max[k] : min[k]);
+            nearest += plane[k] * (plane[k] > 0 ? min[k] : max[k]);
+        }
+        if (farthest < 0)
+            return BOX_OUTSIDE;
+        if (nearest < 0)
+            inside = false;
+    }
+    return inside ? BOX_INSIDE : BOX_INTERSECTS;
+}
+
+bool box_beyond_near_plane(const GLfloat clip[16], const GLfloat min[3], const GLfloat max[3])
+{
+    if (!(min[0] <= max[0] && min[1] <= max[1] && min[2] <= max[2]))
+        return false;
+
+    // the near plane is the last row of the matrix plus the third
+    float nearest = clip[15] + clip[14];
+    for (int k = 0; k < 3; k++) {
+        float a = clip[4*k + 3] + clip[4*k + 2];
+        nearest += a * (a > 0 ? min[k] : max[k]);
+    }
+    return nearest > 0;
+}
+
+// one triangle, the reference for the SIMD path
+static bool
+may_cover_center(const GLfloat m[16], const GLfloat *p[3], int width, int height)
+{
+    float x0 = HUGE_VALF, x1 = -HUGE_VALF, y0 = HUGE_VALF, y1 = -HUGE_VALF;
+    for (int k = 0; k < 3; k++) {
+        float cx = m[0] * p[k][0] + m[4] * p[k][1] + m[8] * p[k][2] + m[12];
+        float cy = m[1] * p[k][0] + m[5] * p[k][1] + m[9] * p[k][2] + m[13];
+        float cw = m[3] * p[k][0] + m[7] * p[k][1] + m[11] * p[k][2] + m[15];
+        // a vertex at or behind the eye plane, the clipper has to deal with it
+        if (!(cw > 0.0f && cw < HUGE_VALF))
+            return true;
+        float sx = (cx / cw + 1.0f) * (0.5f * width);
+        float sy = (cy / cw + 1.0f) * (0.5f * height);
+        x0 = fminf(x0, sx); x1 = fmaxf(x1, sx);
+        y0 = fminf(y0, sy); y1 = fmaxf(y1, sy);
+    }
+    if (!(x1 - x0 < MaxExtent && y1 - y0 < MaxExtent))
+        return true;
+
+    // pixel centers are at i + 0.5, i in [0, width); is there an i in [lo, hi]?
+    float lox = fmaxf(x0 - SnapSlack - 0.5f, 0.0f), hix = fminf(x1 + SnapSlack - 0.5f, width - 1.0f);
+    float loy = fmaxf(y0 - SnapSlack - 0.5f, 0.0f), hiy = fminf(y1 + SnapSlack - 0.5f, height - 1.0f);
+    return hix >= lox && floorf(hix) >= lox && hiy >= loy && floorf(hiy) >= loy;
+}
+
+size_t cull_subpixel_triangles(const GLfloat clip[16], const GLfloat *positions, size_t stride, size_t triangles,
+                               int width, int height, GLuint first, GLuint *out)
+{
+    size_t kept = 0, t = 0;
+
+#ifdef __SSE2__
+    // four triangles at a time, vertex k of each in one register
+    const __m128 m0 = _mm_set1_ps(clip[0]), m1 = _mm_set1_ps(clip[1]), m3 = _mm_set1_ps(clip[3]);
+    const __m128 m4 = _mm_set1_ps(clip[4]), m5 = _mm_set1_ps(clip[5]), m7 = _mm_set1_ps(clip[7]);
+    const __m128 m8 = _mm_set1_ps(clip[8]), m9 = _mm_set1_ps(clip[9]), m11 = _mm_set1_ps(clip[11]);
+    const __m128 m12 = _mm_set1_ps(clip[12]), m13 = _mm_set1_ps(clip[13]), m15 = _mm_set1_ps(clip[15]);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), inf = _mm_set1_ps(HUGE_VALF);
+    const __m128 halfWidth = _mm_set1_ps(0.5f * width), halfHeight = _mm_set1_ps(0.5f * height);
+    const __m128 slack = _mm_set1_ps(SnapSlack + 0.5f), slackHi = _mm_set1_ps(SnapSlack - 0.5f);
+    const __m128 lastX = _mm_set1_ps(width - 1.0f), lastY = _mm_set1_ps(height - 1.0f);
+    const __m128 maxExtent = _mm_set1_ps(MaxExtent);
+
+    for (; t + 4 <= triangles; t += 4) {
+        __m128 x0 = _mm_set1_ps(HUGE_VALF), x1 = _mm_set1_ps(-HUGE_VALF);
+        __m128 y0 = x0, y1 = x1;
+        __m128 behind = zero;
+        for (int k = 0; k < 3; k++) {
+            const GLfloat *a = positions + (3 * t + k) * stride;
+            const GLfloat *b = a + 3 * stride, *c = b + 3 * stride, *d = c + 3 * stride;
+            __m128 px = _mm_set_ps(d[0], c[0], b[0], a[0]);
+            __m128 py = _mm_set_ps(d[1], c[1], b[1], a[1]);
+            __m128 pz = _mm_set_ps(d[2], c[2], b[2], a[2]);
+            __m128 cx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, px), _mm_mul_ps(m4, py)), _mm_add_ps(_mm_mul_ps(m8, pz), m12));
+            __m128 cy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, px), _mm_mul_ps(m5, py)), _mm_add_ps(_mm_mul_ps(m9, pz), m13));
+            __m128 cw = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m3, px), _mm_mul_ps(m7, py)), _mm_add_ps(_mm_mul_ps(m11, pz), m15));
+            // true for w <= 0, infinite w and NaN
+            behind = _mm_or_ps(behind, _mm_or_ps(_mm_cmpngt_ps(cw, zero), _mm_cmpnlt_ps(cw, inf)));
+            __m128 sx = _mm_mul_ps(_mm_add_ps(_mm_div_ps(cx, cw), one), halfWidth);
+            __m128 sy = _mm_mul_ps(_mm_add_ps(_mm_div_ps(cy, cw), one), halfHeight);
+            x0 = _mm_min_ps(x0, sx); x1 = _mm_max_ps(x1, sx);
+            y0 = _mm_min_ps(y0, sy); y1 = _mm_max_ps(y1, sy);
+        }
+        // NaN or huge bounds are kept like vertices behind the eye
+        __m128 keep = _mm_or_ps(behind, _mm_or_ps(_mm_cmpnlt_ps(_mm_sub_ps(x1, x0), maxExtent),
+                                                  _mm_cmpnlt_ps(_mm_sub_ps(y1, y0), maxExtent)));
+
+        __m128 lox = _mm_max_ps(_mm_sub_ps(x0, slack), zero), hix = _mm_min_ps(_mm_add_ps(x1, slackHi), lastX);
+        __m128 loy = _mm_max_ps(_mm_sub_ps(y0, slack), zero), hiy = _mm_min_ps(_mm_add_ps(y1, slackHi), lastY);
+        // hi >= lo >= 0 here, so truncation is floor and stays in int range
+        __m128 fx = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_max_ps(hix, zero)));
+        __m128 fy = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_max_ps(hiy, zero)));
+        __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(hix, lox), _mm_cmpge_ps(fx, lox)),
+                                _mm_and_ps(_mm_cmpge_ps(hiy, loy), _mm_cmpge_ps(fy, loy)));
+        int mask = _mm_movemask_ps(_mm_or_ps(keep, hit));
+
+        for (int i = 0; i < 4; i++) {
+            if (!(mask & (1 << i)))
+                continue;
+            GLuint v = first + 3 * (t + i);
+            out[3*kept] = v;
+            out[3*kept+1] = v + 1;
+            out[3*kept+2] = v + 2;
+            kept++;
+        }
+    }
+#endif
+
+    for (; t < triangles; t++) {
+        const GLfloat *p[3];
+        for (int k = 0; k < 3; k++)
+            p[k] = positions + (3 * t + k) * stride;
+        if (!may_cover_center(clip, p, width, height))
+            continue;
+        GLuint v = first + 3 * t;
+        out[3*kept] = v;
+        out[3*kept+1] = v + 1;
+        out[3*kept+2] = v + 2;
+        kept++;
+    }
+    return kept;
+}
@@ -0,0 +1,52 @@
+/*
+ * Culling on the CPU, before geometry is handed to GL
+ *
+ * Mesa transforms, clips and sets up every triangle it is given, even when it
+ * ends up covering no pixel at all. Bounding boxes are tested against the view
+ * frustum so that whole meshes and nodes outside of it are skipped, and
+ * triangles are projected with the same world to clip matrix so that those
+ * whose screen bounds contain no pixel center are dropped. Only geometry that
+ * can't produce a fragment is dropped, so the image doesn't change. Back faces
+ * are left to GL, the boxes only tell where culling them is safe.
+ */
+
+#ifndef CULL_H
+#define CULL_H
+
+#include <stddef.h>
+#include "gl_wrap.h"
+
+// culling steps, the -cull option
+enum {
+    CULL_FRUSTUM = 1,    // skip meshes whose bounds are outside the view
+    CULL_SUBPIXEL = 2,   // drop triangles that miss every pixel center
+    CULL_BACKFACE = 4    // cull back faces of closed meshes the eye is outside of
+};
+
+// where a box is relative to the view frustum
+enum BoxVisibility {
+    BOX_OUTSIDE,
+    BOX_INTERSECTS,
+    BOX_INSIDE
+};
+
+/* test a world space box against the frustum of the column-major world to
+ * clip matrix; boxes with min > max are empty and outside. Boxes near a
+ * corner of the frustum may be reported as intersecting although they are
+ * outside, never the other way round. */
+BoxVisibility box_visibility(const GLfloat clip[16], const GLfloat min[3], const GLfloat max[3]);
+
+/* true if the whole box is in front of the near plane of the column-major
+ * world to clip matrix, so that the eye is outside of it and the near plane
+ * doesn't cut into it */
+bool box_beyond_near_plane(const GLfloat clip[16], const GLfloat min[3], const GLfloat max[3]);
+
+/* Write the vertex indices of the triangles that may cover a pixel center of
+ * a width x height viewport to out, 3 per triangle, numbered from first. The
+ * triangles are consecutive vertices of positions, stride floats apart, clip
+ * is the column-major world to clip space matrix. Returns the number of
+ * triangles written. */
+size_t cull_subpixel_triangles(const GLfloat clip[16], const GLfloat *positions, size_t stride, size_t triangles,
+                               int width, int height, GLuint first, GLuint *out);
+
+#endif
@@ -0,0 +1,419 @@
+/*
+ * Quadric edge collapse simplification, see decimate.h
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+#include <assimp/scene.h>
+
+#include "decimate.h"
+
+// symmetric 4x4 error quadric of a set of planes
+struct Quadric {
+    double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+};
+
+static void
+add_plane(Quadric *q, double a, double b, double c, double d, double w)
+{
+    q->a2 += w*a*a; q->ab += w*a*b; q->ac += w*a*c; q->ad += w*a*d;
+    q->b2 += w*b*b; q->bc += w*b*c; q->bd += w*b*d;
+    q->c2 += w*c*c; q->cd += w*c*d;
+    q->d2 += w*d*d;
+}
+
+static void
+add_quadric(Quadric *q, const Quadric &o)
+{
+    q->a2 += o.a2; q->ab += o.ab; q->ac += o.ac; q->ad += o.ad;
+    q->b2 += o.b2; q->bc += o.bc; q->bd += o.bd;
+    q->c2 += o.c2; q->cd += o.cd;
+    q->d2 += o.d2;
+}
+
+// squared distance of p to the planes of q, weighted by area
+static double
+quadric_error(const Quadric &q, const aiVector3D &p)
+{
+    double x = p.x, y = p.y, z = p.z;
+    return q.a2*x*x + 2*q.ab*x*y + 2*q.ac*x*z + 2*q.ad*x
+         + q.b2*y*y + 2*q.bc*y*z + 2*q.bd*y
+         + q.c2*z*z + 2*q.cd*z
+         + q.d2;
+}
+
+// a collapse of vertex from onto vertex to, valid while neither has changed since
+struct Collapse {
+    double cost;
+    unsigned int from, to;
+    unsigned int fromVersion, toVersion;
+    bool operator<(const Collapse &o) const { return cost > o.cost; }    // cheapest on top
+};
+
+struct Decimation {
+    const aiMesh *mesh;
+    std::vector<unsigned int> rep;               // an original vertex of every welded vertex
+    std::vector<unsigned int> tri;               // 3 welded vertices per face
+    std::vector<bool> faceAlive;
+    std::vector<std::vector<unsigned int> > vertexFaces;    // faces of each welded vertex, may list dead faces
+    std::vector<Quadric> quadrics;
+    std::vector<unsigned int> version;
+    std::vector<bool> locked, alive;
+    std::priority_queue<Collapse> heap;
+    std::vector<unsigned int> scratch;
+};
+
+// orders vertices by the attributes drawing uses, position first
+struct VertexOrder {
+    const aiMesh *mesh;
+    bool positionOnly;
+    bool operator()(unsigned int i, unsigned int j) const {
+        int c = memcmp(&mesh->mVertices[i], &mesh->mVertices[j], sizeof(aiVector3D));
+        if (c || positionOnly)
+            return c < 0;
+        if (mesh->mTextureCoords[0]) {
+            c = memcmp(&mesh->mTextureCoords[0][i], &mesh->mTextureCoords[0][j], 2 * sizeof(float));
+            if (c)
+                return c < 0;
+        }
+        if (mesh->mColors[0])
+            return memcmp(&mesh->mColors[0][i], &mesh->mColors[0][j], sizeof(aiColor4D)) < 0;
+        return false;
+    }
+};
+
+/* Weld vertices that only differ by index and lock the vertices of seams,
+ * which are positions shared by welded vertices with different attributes */
+static void
+weld_vertices(Decimation *d, std::vector<unsigned int> *welded)
+{
+    const aiMesh *mesh = d->mesh;
+    std::vector<unsigned int> order(mesh->mNumVertices);
+    for (unsigned int i = 0; i < order.size(); i++)
+        order[i] = i;
+    VertexOrder full = { mesh, false }, position = { mesh, true };
+    std::sort(order.begin(), order.end(), full);
+
+    welded->resize(mesh->mNumVertices);
+    for (size_t i = 0; i < order.size(); i++) {
+        if (i == 0 || full(order[i-1], order[i]))
+            d->rep.push_back(order[i]);
+        (*welded)[order[i]] = d->rep.size() - 1;
+    }
+
+    // rep is sorted by position too, a seam is a run of equal positions
+    d->locked.assign(d->rep.size(), false);
+    for (size_t i = 1; i < d->rep.size(); i++)
+        if (!position(d->rep[i-1], d->rep[i]))
+            d->locked[i-1] = d->locked[i] = true;
+}
+
+/* Lock the vertices of edges that don't have exactly two faces, the open
+ * boundaries and non-manifold parts of the mesh */
+static void
+lock_boundaries(Decimation *d, std::vector<unsigned long long> *edges)
+{
+    for (size_t f = 0; f < d->faceAlive.size(); f++) {
+        if (!d->faceAlive[f])
+            continue;
+        for (int k = 0; k < 3; k++) {
+            unsigned long long a = d->tri[3*f + k], b = d->tri[3*f + (k+1) % 3];
+            edges->push_back(a < b ? a << 32 | b : b << 32 | a);
+        }
+    }
+    std::sort(edges->begin(), edges->end());
+
+    size_t i = 0, out = 0;
+    while (i < edges->size()) {
+        size_t j = i + 1;
+        while (j < edges->size() && (*edges)[j] == (*edges)[i])
+            j++;
+        if (j - i != 2) {
+            d->locked[(*edges)[i] >> 32] = true;
+            d->locked[(*edges)[i] & 0xffffffffu] = true;
+        }
+        else {
+            (*edges)[out++] = (*edges)[i];
+        }
+        i = j;
+    }
+    edges->resize(out);    // the manifold edges, each once
+}
+
+static const aiVector3D &
+position_of(const Decimation *d, unsigned int v)
+{
+    return d->mesh->mVertices[d->rep[v]];
+}
+
+static aiVector3D
+cross(const aiVector3D &a, const aiVector3D &b)
+{
+    return aiVector3D(a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x);
+}
+
+static double
+dot(const aiVector3D &a, const aiVector3D &b)
+{
+    return (double)a.x*b.x + (double)a.y*b.y + (double)a.z*b.z;
+}
+
+// the cheaper direction of collapsing edge (a, b), if a vertex of it may move
+static void
+push_edge(Decimation *d, unsigned int a, unsigned int b)
+{
+    Quadric q = d->quadrics[a];
+    add_quadric(&q, d->quadrics[b]);
+
+    Collapse c;
+    c.cost = HUGE_VAL;
+    if (!d->locked[a]) {
+        c.cost = quadric_error(q, position_of(d, b));
+        c.from = a;
+        c.to = b;
+    }
+    if (!d->locked[b]) {
+        double cost = quadric_error(q, position_of(d, a));
+        if (cost < c.cost) {
+            c.cost = cost;
+            c.from = b;
+            c.to = a;
+        }
+    }
+    if (c.cost == HUGE_VAL)
+        return;
+    c.fromVersion = d->version[c.from];
+    c.toVersion = d->version[c.to];
+    d->heap.push(c);
+}
+
+// the live neighbors of v, sorted, in out
+static void
+neighbors(const Decimation *d, unsigned int v, std::vector<unsigned int> *out)
+{
+    out->clear();
+    const std::vector<unsigned int> &faces = d->vertexFaces[v];
+    for (size_t i = 0; i < faces.size(); i++) {
+        unsigned int f = faces[i];
+        if (!d->faceAlive[f])
+            continue;
+        for (int k = 0; k < 3; k++)
+            if (d->tri[3*f + k] != v)
+                out->push_back(d->tri[3*f + k]);
+    }
+    std::sort(out->begin(), out->end());
+    out->erase(std::unique(out->begin(), out->end()), out->end());
+}
+
+/* A collapse must keep the surface a manifold: the edge's two faces are the
+ * only ones the two vertices share, so they must have exactly two common
+ * neighbors. It also must not turn any remaining face of from over. */
+static bool
+collapse_allowed(Decimation *d, unsigned int from, unsigned int to)
+{
+    std::vector<unsigned int> a, &b = d->scratch;
+    neighbors(d, from, &a);
+    neighbors(d, to, &b);
+    size_t common = 0;
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size(); ) {
+        if (a[i] < b[j])
+            i++;
+        else if (b[j] < a[i])
+            j++;
+        else {
+            common++;
+            i++;
+            j++;
+        }
+    }
+    if (common != 2)
+        return false;
+
+    const aiVector3D &target = position_of(d, to);
+    const std::vector<unsigned int> &faces = d->vertexFaces[from];
+    for (size_t i = 0; i < faces.size(); i++) {
+        unsigned int f = faces[i];
+        const unsigned int *t = &d->tri[3*f];
+        if (!d->faceAlive[f] || t[0] == to || t[1] == to || t[2] == to)
+            continue;
+
+        aiVector3D p[3], q[3];
+        for (int k = 0; k < 3; k++) {
+            p[k] = position_of(d, t[k]);
+            q[k] = t[k] == from ? target : p[k];
+        }
+        aiVector3D before = cross(p[1] - p[0], p[2] - p[0]);
+        aiVector3D after = cross(q[1] - q[0], q[2] - q[0]);
+        double lb = dot(before, before), la = dot(after, after);
+        if (la <= 0 || dot(before, after) < 0.2 * sqrt(lb * la))
+            return false;
+    }
+    return true;
+}
+
+static void
+collapse(Decimation *d, unsigned int from, unsigned int to, unsigned int *faces)
+{
+    std::vector<unsigned int> &fromFaces = d->vertexFaces[from];
+    std::vector<unsigned int> &toFaces = d->vertexFaces[to];
+    for (size_t i = 0; i < fromFaces.size(); i++) {
+        unsigned int f = fromFaces[i];
+        if (!d->faceAlive[f])
+            continue;
+        unsigned int *t = &d->tri[3*f];
+        if (t[0] == to || t[1] == to || t[2] == to) {
+            d->faceAlive[f] = false;
+            (*faces)--;
+            continue;
+        }
+        for (int k = 0; k < 3; k++)
+            if (t[k] == from)
+                t[k] = to;
+        toFaces.push_back(f);
+    }
+    std::vector<unsigned int>().swap(fromFaces);
+    d->alive[from] = false;
+
+    // drop the dead faces of to now and then, so its list doesn't keep growing
+    size_t live = 0;
+    for (size_t i = 0; i < toFaces.size(); i++)
+        if (d->faceAlive[toFaces[i]])
+            toFaces[live++] = toFaces[i];
+    toFaces.resize(live);
+
+    add_quadric(&d->quadrics[to], d->quadrics[from]);
+    d->version[to]++;
+
+    std::vector<unsigned int> n;
+    neighbors(d, to, &n);
+    for (size_t i = 0; i < n.size(); i++)
+        push_edge(d, to, n[i]);
+}
+
+unsigned int decimate_mesh(struct aiMesh *mesh, unsigned int target)
+{
+    if (mesh->mPrimitiveTypes != aiPrimitiveType_TRIANGLE || mesh->mNumFaces <= target)
+        return mesh->mNumFaces;
+
+    Decimation d;
+    d.mesh = mesh;
+    std::vector<unsigned int> welded;
+    weld_vertices(&d, &welded);
+
+    size_t numVertices = d.rep.size();
+    unsigned int faces = 0;
+    d.tri.resize(3 * mesh->mNumFaces);
+    d.faceAlive.assign(mesh->mNumFaces, false);
+    d.vertexFaces.resize(numVertices);
+    d.quadrics.resize(numVertices);
+    memset(&d.quadrics[0], 0, numVertices * sizeof(Quadric));
+    for (unsigned int f = 0; f < mesh->mNumFaces; f++) {
+        const aiFace &face = mesh->mFaces[f];
+        unsigned int *t = &d.tri[3*f];
+        for (int k = 0; k < 3; k++)
+            t[k] = welded[face.mIndices[k]];
+        if (t[0] == t[1] || t[1] == t[2] || t[0] == t[2])
+            continue;    // nothing to draw, dropped
+        d.faceAlive[f] = true;
+        faces++;
+
+        // the plane of the face, weighted by its area
+        const aiVector3D &p0 = position_of(&d, t[0]);
+        aiVector3D n = cross(position_of(&d, t[1]) - p0, position_of(&d, t[2]) - p0);
+        double len = sqrt(dot(n, n));
+        if (len > 0) {
+            double a = n.x / len, b = n.y / len, c = n.z / len;
+            double dist = -(a*p0.x + b*p0.y + c*p0.z);
+            for (int k = 0; k < 3; k++)
+                add_plane(&d.quadrics[t[k]], a, b, c, dist, len / 2);
+        }
+        for (int k = 0; k < 3; k++)
+            d.vertexFaces[t[k]].push_back(f);
+    }
+
+    std::vector<unsigned long long> edges;
+    lock_boundaries(&d, &edges);
+    d.version.assign(numVertices, 0);
+    d.alive.assign(numVertices, true);
+    for (size_t i = 0; i < edges.size(); i++)
+        push_edge(&d, edges[i] >> 32, edges[i] & 0xffffffffu);
+    std::vector<unsigned long long>().swap(edges);
+
+    while (faces > target && !d.heap.empty()) {
+        Collapse c = d.heap.top();
+        d.heap.pop();
+        if (!d.alive[c.from] || !d.alive[c.to] || d.version[c.from] != c.fromVersion || d.version[c.to] != c.toVersion)
+            continue;
+        if (collapse_allowed(&d, c.from, c.to))
+            collapse(&d, c.from, c.to, &faces);
+    }
+
+    // the faces keep their index arrays, the ones past the end are freed with the mesh
+    unsigned int out = 0;
+    for (unsigned int f = 0; f < mesh->mNumFaces; f++) {
+        if (!d.faceAlive[f])
+            continue;
+        for (int k = 0; k < 3; k++)
+            mesh->mFaces[out].mIndices[k] = d.rep[d.tri[3*f + k]];
+        out++;
+    }
+    mesh->mNumFaces = out;
+    return out;
+}
+
+struct DecimateQueue {
+    struct aiMesh **meshes;
+    const unsigned int *targets;
+    std::vector<unsigned int> order;
+    unsigned int next;
+    pthread_mutex_t lock;
+};
+
+static void *
+decimate_worker(void *arg)
+{
+    DecimateQueue *q = (DecimateQueue*)arg;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        unsigned int i = q->next < q->order.size() ? q->order[q->next++] : ~0u;
+        pthread_mutex_unlock(&q->lock);
+        if (i == ~0u)
+            return NULL;
+        decimate_mesh(q->meshes[i], q->targets[i]);
+    }
+}
+
+struct LargerMesh {
+    struct aiMesh **meshes;
+    bool operator()(unsigned int i, unsigned int j) const { return meshes[i]->mNumFaces > meshes[j]->mNumFaces; }
+};
+
+void decimate_meshes(struct aiMesh **meshes, const unsigned int *targets, unsigned int count, int threads)
+{
+    DecimateQueue q;
+    q.meshes = meshes;
+    q.targets = targets;
+    q.next = 0;
+    for (unsigned int i = 0; i < count; i++)
+        if (meshes[i]->mNumFaces > targets[i])
+            q.order.push_back(i);
+    LargerMesh larger = { meshes };
+    std::sort(q.order.begin(), q.order.end(), larger);
+    pthread_mutex_init(&q.lock, NULL);
+
+    // the caller takes meshes too, so whatever workers could be started are enough
+    std::vector<pthread_t> workers(std::max(0, std::min<int>(threads, q.order.size()) - 1));
+    size_t started = 0;
+    while (started < workers.size() && pthread_create(&workers[started], NULL, decimate_worker, &q) == 0)
+        started++;
+    decimate_worker(&q);
+    for (size_t t = 0; t < started; t++)
+        pthread_join(workers[t], NULL);
+
+    pthread_mutex_destroy(&q.lock);
+}
@@ -0,0 +1,26 @@
+/*
+ * Quadric edge collapse simplification of imported meshes
+ *
+ * Edges are collapsed onto one of their two vertices, cheapest first by the
+ * summed plane quadrics of both (Garland and Heckbert), so the remaining
+ * vertices keep their own texture coordinates and colors. Vertices on a UV or
+ * color seam, on an open boundary or on a non-manifold edge never move; seams
+ * between materials are mesh boundaries, so they stay as well. Collapses that
+ * would fold a face over or pinch the surface are skipped.
+ */
+
+#ifndef DECIMATE_H
+#define DECIMATE_H
+
+struct aiMesh;
+
+/* reduce a mesh of triangles to about target faces in place, by rewriting its
+ * faces; vertices are left alone. Returns the faces left, meshes with other
+ * primitives are not changed. */
+unsigned int decimate_mesh(struct aiMesh *mesh, unsigned int target);
+
+/* decimate meshes[i] to targets[i] on up to threads threads, each mesh is
+ * simplified by one thread, the largest first */
+void decimate_meshes(struct aiMesh **meshes, const unsigned int *targets, unsigned int count, int threads);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Baked fixed-function lighting, see lighting.h
+ */
+
+#include <math.h>
+#include <algorithm>
+#include "lighting.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static GLubyte
+to_byte(float c)
+{
+    return (GLubyte)(std::min(std::max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+// GL's specular factor: nothing on the unlit side, pow(0, 0) is 1 as in Mesa
+static float
+specular_factor(float nl, float nh, float shininess)
+{
+    return nl > 0 ? powf(std::max(nh, 0.0f), shininess) : 0.0f;
+}
+
+static bool
+has_specular(const LightRig *rig, int l, const LitMaterial *m)
+{
+    return (rig->specular[l][0] != 0 || rig->specular[l][1] != 0 || rig->specular[l][2] != 0)
+        && (m->specular[0] != 0 || m->specular[1] != 0 || m->specular[2] != 0);
+}
+
+// one vertex, the reference for the SIMD path
+static void
+light_vertex(const LightRig *rig, const LitMaterial *m, const GLfloat *p, const GLfloat *normal, const GLfloat *color,
+             GLubyte *front, GLubyte *back)
+{
+    const GLfloat *ambient = color ? color : m->ambient;
+    const GLfloat *diffuse = color ? color : m->diffuse;
+    float n[3] = { normal[0], normal[1], normal[2] };
+    float len2 = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+    float scale = len2 > 0 ? 1.0f / sqrtf(len2) : 0.0f;
+    for (int k = 0; k < 3; k++)
+        n[k] *= scale;
+
+    float f[3], b[3];
+    for (int c = 0; c < 3; c++)
+        f[c] = b[c] = m->emission[c] + rig->modelAmbient[c] * ambient[c];
+
+    for (int l = 0; l < rig->count; l++) {
+        float L[3], h[3];
+        for (int k = 0; k < 3; k++)
+            L[k] = rig->position[l][k] - p[k];
+        float d2 = L[0] * L[0] + L[1] * L[1] + L[2] * L[2];
+        float inv = d2 > 0 ? 1.0f / sqrtf(d2) : 0.0f;
+        for (int k = 0; k < 3; k++)
+            L[k] *= inv;
+        float nl = n[0] * L[0] + n[1] * L[1] + n[2] * L[2];
+
+        // the viewer is at infinity on +z
+        float sf = 0, sb = 0;
+        if (has_specular(rig, l, m)) {
+            h[0] = L[0]; h[1] = L[1]; h[2] = L[2] + 1.0f;
+            float h2 = h[0] * h[0] + h[1] * h[1] + h[2] * h[2];
+            float hinv = h2 > 0 ? 1.0f / sqrtf(h2) : 0.0f;
+            float nh = (n[0] * h[0] + n[1] * h[1] + n[2] * h[2]) * hinv;
+            sf = specular_factor(nl, nh, m->shininess);
+            sb = specular_factor(-nl, -nh, m->shininess);
+        }
+
+        for (int c = 0; c < 3; c++) {
+            float a = rig->ambient[l][c] * ambient[c];
+            float d = rig->diffuse[l][c] * diffuse[c];
+            float s = rig->specular[l][c] * m->specular[c];
+            f[c] += a + std::max(nl, 0.0f) * d + sf * s;
+            b[c] += a + std::max(-nl, 0.0f) * d + sb * s;
+        }
+    }
+
+    for (int c = 0; c < 3; c++) {
+        front[c] = to_byte(f[c]);
+        back[c] = to_byte(b[c]);
+    }
+    front[3] = back[3] = to_byte(diffuse[3]);
+}
+
+#ifdef __SSE2__
+// RGBA bytes of four vertices from their channels, one vertex per 32 bit lane
+static void
+store_colors(__m128 r, __m128 g, __m128 b, __m128 a, GLubyte *out)
+{
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), scale = _mm_set1_ps(255.0f);
+    __m128i ri = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(r, zero), one), scale));
+    __m128i gi = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(g, zero), one), scale));
+    __m128i bi = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(b, zero), one), scale));
+    __m128i ai = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(a, zero), one), scale));
+    __m128i rgba = _mm_or_si128(_mm_or_si128(ri, _mm_slli_epi32(gi, 8)), _mm_or_si128(_mm_slli_epi32(bi, 16), _mm_slli_epi32(ai, 24)));
+    _mm_storeu_si128((__m128i*)out, rgba);
+}
+#endif
+
+void bake_lighting(const LightRig *rig, const LitMaterial *m, const GLfloat *positions, const GLfloat *normals,
+                   const GLfloat *colors, size_t count, GLubyte *front, GLubyte *back)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    bool specular[MAX_RIG_LIGHTS];
+    for (int l = 0; l < rig->count; l++)
+        specular[l] = has_specular(rig, l, m);
+
+    for (; i + 4 <= count; i += 4) {
+        const GLfloat *p = positions + 3 * i, *q = normals + 3 * i;
+        __m128 px = _mm_set_ps(p[9], p[6], p[3], p[0]);
+        __m128 py = _mm_set_ps(p[10], p[7], p[4], p[1]);
+        __m128 pz = _mm_set_ps(p[11], p[8], p[5], p[2]);
+        __m128 nx = _mm_set_ps(q[9], q[6], q[3], q[0]);
+        __m128 ny = _mm_set_ps(q[10], q[7], q[4], q[1]);
+        __m128 nz = _mm_set_ps(q[11], q[8], q[5], q[2]);
+        __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+        __m128 scale = _mm_and_ps(_mm_cmpgt_ps(len2, zero), _mm_div_ps(one, _mm_sqrt_ps(len2)));
+        nx = _mm_mul_ps(nx, scale);
+        ny = _mm_mul_ps(ny, scale);
+        nz = _mm_mul_ps(nz, scale);
+
+        // ambient and diffuse color per channel, of the material or the vertices
+        __m128 amb[4], dif[4];
+        for (int c = 0; c < 4; c++) {
+            if (colors) {
+                const GLfloat *v = colors + 4 * i;
+                amb[c] = dif[c] = _mm_set_ps(v[12+c], v[8+c], v[4+c], v[c]);
+            }
+            else {
+                amb[c] = _mm_set1_ps(m->ambient[c]);
+                dif[c] = _mm_set1_ps(m->diffuse[c]);
+            }
+        }
+
+        __m128 f[3], b[3];
+        for (int c = 0; c < 3; c++)
+            f[c] = b[c] = _mm_add_ps(_mm_set1_ps(m->emission[c]), _mm_mul_ps(_mm_set1_ps(rig->modelAmbient[c]), amb[c]));
+
+        for (int l = 0; l < rig->count; l++) {
+            __m128 lx = _mm_sub_ps(_mm_set1_ps(rig->position[l][0]), px);
+            __m128 ly = _mm_sub_ps(_mm_set1_ps(rig->position[l][1]), py);
+            __m128 lz = _mm_sub_ps(_mm_set1_ps(rig->position[l][2]), pz);
+            __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz));
+            __m128 inv = _mm_and_ps(_mm_cmpgt_ps(d2, zero), _mm_div_ps(one, _mm_sqrt_ps(d2)));
+            lx = _mm_mul_ps(lx, inv);
+            ly = _mm_mul_ps(ly, inv);
+            lz = _mm_mul_ps(lz, inv);
+            __m128 nl = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, lx), _mm_mul_ps(ny, ly)), _mm_mul_ps(nz, lz));
+            __m128 fd = _mm_max_ps(nl, zero), bd = _mm_max_ps(_mm_sub_ps(zero, nl), zero);
+
+            // pow() has no SSE form, the specular factors are taken lane by lane
+            __m128 sf = zero, sb = zero;
+            if (specular[l]) {
+                __m128 hz = _mm_add_ps(lz, one);
+                __m128 h2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(hz, hz));
+                __m128 hinv = _mm_and_ps(_mm_cmpgt_ps(h2, zero), _mm_div_ps(one, _mm_sqrt_ps(h2)));
+                __m128 nh = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, lx), _mm_mul_ps(ny, ly)), _mm_mul_ps(nz, hz)), hinv);
+                float nls[4], nhs[4], sfs[4], sbs[4];
+                _mm_storeu_ps(nls, nl);
+                _mm_storeu_ps(nhs, nh);
+                for (int k = 0; k < 4; k++) {
+                    sfs[k] = specular_factor(nls[k], nhs[k], m->shininess);
+                    sbs[k] = specular_factor(-nls[k], -nhs[k], m->shininess);
+                }
+                sf = _mm_loadu_ps(sfs);
+                sb = _mm_loadu_ps(sbs);
+            }
+
+            for (int c = 0; c < 3; c++) {
+                __m128 a = _mm_mul_ps(_mm_set1_ps(rig->ambient[l][c]), amb[c]);
+                __m128 d = _mm_mul_ps(_mm_set1_ps(rig->diffuse[l][c]), dif[c]);
+                __m128 s = _mm_set1_ps(rig->specular[l][c] * m->specular[c]);
+                f[c] = _mm_add_ps(f[c], _mm_add_ps(a, _mm_add_ps(_mm_mul_ps(fd, d), _mm_mul_ps(sf, s))));
+                b[c] = _mm_add_ps(b[c], _mm_add_ps(a, _mm_add_ps(_mm_mul_ps(bd, d), _mm_mul_ps(sb, s))));
+            }
+        }
+
+        store_colors(f[0], f[1], f[2], dif[3], front + 4 * i);
+        store_colors(b[0], b[1], b[2], dif[3], back + 4 * i);
+    }
+#endif
+
+    for (; i < count; i++)
+        light_vertex(rig, m, positions + 3 * i, normals + 3 * i, colors ? colors + 4 * i : NULL, front + 4 * i, back + 4 * i);
+}
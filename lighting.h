@@ -0,0 +1,45 @@
+/*
+ * Fixed-function lighting evaluated on the CPU
+ *
+ * The renderer's lights are positional and its modelview matrix is the
+ * identity, the camera being part of the projection, so GL lights every
+ * vertex in world space and the result doesn't depend on the view. It can be
+ * computed once per scene, four vertices at a time with SSE, and drawn as
+ * vertex colors with GL_LIGHTING off. The colors follow the OpenGL 1.x
+ * lighting equation with an infinite viewer and no attenuation or spot
+ * lights, for both sides of two-sided lighting.
+ */
+
+#ifndef LIGHTING_H
+#define LIGHTING_H
+
+#include <stddef.h>
+#include "gl_wrap.h"
+
+enum { MAX_RIG_LIGHTS = 8 };
+
+// the lights of InitGLState(), positional, in world space
+struct LightRig {
+    int count;
+    GLfloat position[MAX_RIG_LIGHTS][3];
+    GLfloat ambient[MAX_RIG_LIGHTS][4];
+    GLfloat diffuse[MAX_RIG_LIGHTS][4];
+    GLfloat specular[MAX_RIG_LIGHTS][4];
+    GLfloat modelAmbient[4];    // GL_LIGHT_MODEL_AMBIENT
+};
+
+// what a MaterialRecord contributes to lighting
+struct LitMaterial {
+    GLfloat ambient[4], diffuse[4], specular[4], emission[4];
+    GLfloat shininess;
+};
+
+/* Colors of count vertices lit by rig, RGBA bytes per vertex: front as GL
+ * lights front faces, back as it lights back faces with the normal negated.
+ * positions and normals have 3 floats per vertex, normals are normalized here
+ * like with GL_NORMALIZE. colors, 4 floats per vertex, replace the material's
+ * ambient and diffuse color like GL_COLOR_MATERIAL does, NULL for none. */
+void bake_lighting(const LightRig *rig, const LitMaterial *material, const GLfloat *positions, const GLfloat *normals,
+                   const GLfloat *colors, size_t count, GLubyte *front, GLubyte *back);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * Closedness and winding analysis, see orient.h
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include <assimp/scene.h>
+
+#include "orient.h"
+
+/* A piece whose signed volume is smaller than this share of the summed
+ * magnitudes of its tetrahedra is too flat to have an inside, a sheet made of
+ * two faces back to back for example */
+static const double FlatRatio = 1e-3;
+
+// orders vertices by position, bit for bit like the welding in decimate.c
+struct PositionOrder {
+    const aiMesh *mesh;
+    bool operator()(unsigned int i, unsigned int j) const {
+        return memcmp(&mesh->mVertices[i], &mesh->mVertices[j], sizeof(aiVector3D)) < 0;
+    }
+};
+
+// an edge of a face between two welded vertices, lower vertex first
+struct FaceEdge {
+    uint64_t key;
+    unsigned int face;
+    bool forward;    // the face runs from the lower to the higher vertex
+    bool operator<(const FaceEdge &o) const { return key < o.key; }
+};
+
+static unsigned int
+find_piece(std::vector<unsigned int> &parent, unsigned int f)
+{
+    while (parent[f] != f) {
+        parent[f] = parent[parent[f]];
+        f = parent[f];
+    }
+    return f;
+}
+
+bool orient_closed_mesh(const struct aiMesh *mesh, unsigned char *flip)
+{
+    unsigned int numFaces = mesh->mNumFaces, numVertices = mesh->mNumVertices;
+    if (numFaces == 0)
+        return false;
+    for (unsigned int f = 0; f < numFaces; f++)
+        if (mesh->mFaces[f].mNumIndices < 3)
+            return false;
+    for (unsigned int v = 0; v < numVertices; v++) {
+        const aiVector3D &p = mesh->mVertices[v];
+        if (!(fabsf(p.x) < HUGE_VALF && fabsf(p.y) < HUGE_VALF && fabsf(p.z) < HUGE_VALF))
+            return false;
+    }
+
+    // weld by position
+    std::vector<unsigned int> order(numVertices), welded(numVertices);
+    for (unsigned int v = 0; v < numVertices; v++)
+        order[v] = v;
+    PositionOrder cmp = { mesh };
+    std::sort(order.begin(), order.end(), cmp);
+    unsigned int ids = 0;
+    for (unsigned int v = 0; v < numVertices; v++) {
+        if (v > 0 && cmp(order[v-1], order[v]))
+            ids++;
+        welded[order[v]] = ids;
+    }
+
+    std::vector<FaceEdge> edges;
+    for (unsigned int f = 0; f < numFaces; f++) {
+        const aiFace &face = mesh->mFaces[f];
+        for (unsigned int i = 0; i < face.mNumIndices; i++) {
+            unsigned int a = welded[face.mIndices[i]], b = welded[face.mIndices[(i + 1) % face.mNumIndices]];
+            if (a == b)
+                continue;
+            FaceEdge e = { (uint64_t)std::min(a, b) << 32 | std::max(a, b), f, a < b };
+            edges.push_back(e);
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+
+    // every edge has exactly two faces running along it in opposite directions
+    std::vector<unsigned int> parent(numFaces);
+    for (unsigned int f = 0; f < numFaces; f++)
+        parent[f] = f;
+    for (size_t i = 0; i < edges.size(); i += 2) {
+        if (i + 1 >= edges.size() || edges[i+1].key != edges[i].key || edges[i+1].forward == edges[i].forward
+            || (i + 2 < edges.size() && edges[i+2].key == edges[i].key))
+            return false;
+        unsigned int p = find_piece(parent, edges[i].face), q = find_piece(parent, edges[i+1].face);
+        parent[std::max(p, q)] = std::min(p, q);
+    }
+
+    // signed volume of every piece, around its own centroid to keep the sums small
+    std::vector<double> center(3 * numFaces, 0.0), corners(numFaces, 0.0);
+    for (unsigned int f = 0; f < numFaces; f++) {
+        const aiFace &face = mesh->mFaces[f];
+        unsigned int p = find_piece(parent, f);
+        for (unsigned int i = 0; i < face.mNumIndices; i++) {
+            const aiVector3D &v = mesh->mVertices[face.mIndices[i]];
+            center[3*p] += v.x;
+            center[3*p+1] += v.y;
+            center[3*p+2] += v.z;
+        }
+        corners[p] += face.mNumIndices;
+    }
+
+    std::vector<double> volume(numFaces, 0.0), magnitude(numFaces, 0.0);
+    for (unsigned int f = 0; f < numFaces; f++) {
+        const aiFace &face = mesh->mFaces[f];
+        unsigned int p = find_piece(parent, f);
+        double c[3] = { center[3*p] / corners[p], center[3*p+1] / corners[p], center[3*p+2] / corners[p] };
+        const aiVector3D &v0 = mesh->mVertices[face.mIndices[0]];
+        double a[3] = { v0.x - c[0], v0.y - c[1], v0.z - c[2] };
+        // polygons are drawn as fans around their first vertex
+        for (unsigned int i = 2; i < face.mNumIndices; i++) {
+            const aiVector3D &v1 = mesh->mVertices[face.mIndices[i-1]], &v2 = mesh->mVertices[face.mIndices[i]];
+            double b[3] = { v1.x - c[0], v1.y - c[1], v1.z - c[2] };
+            double d[3] = { v2.x - c[0], v2.y - c[1], v2.z - c[2] };
+            double t = a[0] * (b[1] * d[2] - b[2] * d[1]) + a[1] * (b[2] * d[0] - b[0] * d[2]) + a[2] * (b[0] * d[1] - b[1] * d[0]);
+            volume[p] += t;
+            magnitude[p] += fabs(t);
+        }
+    }
+
+    for (unsigned int f = 0; f < numFaces; f++) {
+        unsigned int p = find_piece(parent, f);
+        if (!(fabs(volume[p]) > FlatRatio * magnitude[p]))
+            return false;
+        flip[f] = volume[p] < 0;
+    }
+    return true;
+}
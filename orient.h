@@ -0,0 +1,23 @@
+/*
+ * Closedness and winding analysis of imported meshes, for back-face culling
+ *
+ * Vertices are welded by position, so that seams in texture coordinates or
+ * colors don't open a mesh up. A mesh is closed when every edge of its faces
+ * is used exactly twice, once in each direction: then every surface is
+ * consistently wound and separates an inside from an outside. The sign of the
+ * volume a connected piece encloses tells which way round it is wound.
+ */
+
+#ifndef ORIENT_H
+#define ORIENT_H
+
+struct aiMesh;
+
+/* true if the mesh is closed and consistently wound, then flip[f] is set for
+ * the faces of pieces wound clockwise seen from outside, the others are
+ * cleared. flip has room for mesh->mNumFaces entries. Meshes with lines or
+ * points, with a piece too flat to tell in from out or with non-finite
+ * positions are not closed. */
+bool orient_closed_mesh(const struct aiMesh *mesh, unsigned char *flip);
+
+#endif
@@ -0,0 +1,560 @@
+/*
+ * Image output for the renderer, see output.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <algorithm>
+#include <fstream>
+#include <vector>
+#include <png++/png.hpp>
+
+#include "output.h"
+
+void
+default_output_options(OutputOptions *opt)
+{
+    opt->format = FORMAT_AUTO;
+    opt->pngLevel = -1;
+    opt->pngFilter = -1;
+    opt->threads = 1;
+}
+
+static const struct {
+    const char *name;
+    ImageFormat format;
+} FormatNames[] = {
+    { "auto", FORMAT_AUTO },
+    { "png",  FORMAT_PNG },
+    { "qoi",  FORMAT_QOI },
+    { "ppm",  FORMAT_PPM },
+    { "pgm",  FORMAT_PGM },
+    { "rgba", FORMAT_RGBA },
+    { "raw",  FORMAT_RGBA },
+};
+
+bool
+parse_image_format(const char *name, ImageFormat *format)
+{
+    for (size_t i = 0; i < sizeof(FormatNames) / sizeof(FormatNames[0]); i++) {
+        if (!strcasecmp(name, FormatNames[i].name)) {
+            *format = FormatNames[i].format;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+parse_png_filter(const char *name, int *filter)
+{
+    static const struct {
+        const char *name;
+        int filter;
+    } filters[] = {
+        { "none",     PNG_FILTER_NONE },
+        { "sub",      PNG_FILTER_SUB },
+        { "up",       PNG_FILTER_UP },
+        { "avg",      PNG_FILTER_AVG },
+        { "paeth",    PNG_FILTER_PAETH },
+        { "adaptive", -1 },
+    };
+    for (size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); i++) {
+        if (!strcasecmp(name, filters[i].name)) {
+            *filter = filters[i].filter;
+            return true;
+        }
+    }
+    return false;
+}
+
+ImageFormat
+image_format_for(const char *filename)
+{
+    const char *slash = strrchr(filename, '/');
+    const char *ext = strrchr(slash ? slash : filename, '.');
+    ImageFormat format;
+    if (ext && parse_image_format(ext + 1, &format) && format != FORMAT_AUTO)
+        return format;
+    return FORMAT_PNG;
+}
+
+// row y of the image counted from the top
+static inline const unsigned char *
+framebuffer_row(const void *buffer, int width, int height, int y)
+{
+    return (const unsigned char*)buffer + (size_t)(height - 1 - y) * width * 4;
+}
+
+static inline void
+put_be32(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static bool
+write_png(const char *filename, const void *buffer, int width, int height, const OutputOptions *opt)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "Couldn't open %s\n", filename);
+        return false;
+    }
+
+    try {
+        png::image_info info = png::make_image_info< png::rgba_pixel >();
+        info.set_width(width);
+        info.set_height(height);
+
+        png::writer< std::ofstream > wr(file);
+        wr.set_image_info(info);
+        if (opt->pngLevel >= 0)
+            png_set_compression_level(wr.get_png_struct(), opt->pngLevel);
+        if (opt->pngFilter >= 0)
+            png_set_filter(wr.get_png_struct(), PNG_FILTER_TYPE_BASE, opt->pngFilter);
+        wr.write_info();
+
+        // libpng only reads the rows, the interface just isn't const
+        for (int y = 0; y < height; y++)
+            wr.write_row(const_cast< png::byte* >(framebuffer_row(buffer, width, height, y)));
+        wr.write_end_info();
+    }
+    catch (const std::exception &e) {
+        fprintf(stderr, "Couldn't write %s: %s\n", filename, e.what());
+        return false;
+    }
+    // the end of the image is still buffered, writing it may fail as well
+    file.close();
+    if (!file) {
+        fprintf(stderr, "Couldn't write %s\n", filename);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Parallel PNG encoder
+ *
+ * The image data of a PNG is one zlib stream over the filtered rows. As in
+ * pigz, the rows are split into chunks that are filtered and deflated
+ * independently: every chunk is a raw deflate stream primed with the 32K of
+ * filtered data before it as dictionary and ended with a sync flush (the last
+ * one with Z_FINISH), so the concatenation is a single valid stream. The Adler-32
+ * of the whole stream comes from adler32_combine() over the chunks, and every
+ * chunk is written as an IDAT of its own with its own CRC.
+ */
+
+// images with fewer pixels are written with libpng on one thread
+#define PARALLEL_PNG_PIXELS (1 << 20)
+
+// uncompressed bytes per chunk, pigz uses 128K
+#define PNG_CHUNK_BYTES (256 << 10)
+
+#define DEFLATE_WINDOW 32768
+
+struct PngChunk {
+    int first, rows;               // image rows of the chunk
+    std::vector<unsigned char> out;
+    uLong adler;
+    uLong length;                  // filtered bytes of the chunk
+    bool ok;
+};
+
+struct PngEncoder {
+    const void *buffer;
+    int width, height;
+    int level;
+    int filters;                   // PNG_FILTER_* mask
+    std::vector<PngChunk> chunks;
+
+    pthread_mutex_t lock;
+    size_t next;                   // next chunk to encode
+};
+
+static inline int
+paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+/* filter one row of len bytes with filter type 0-4, prev is the row above
+ * (zeros for the first row), 4 bytes per pixel */
+static void
+filter_row(int type, const unsigned char *row, const unsigned char *prev, unsigned char *out, int len)
+{
+    int i;
+    switch (type) {
+    case 0:
+        memcpy(out, row, len);
+        break;
+    case 1:
+        for (i = 0; i < 4; i++)
+            out[i] = row[i];
+        for (; i < len; i++)
+            out[i] = row[i] - row[i-4];
+        break;
+    case 2:
+        for (i = 0; i < len; i++)
+            out[i] = row[i] - prev[i];
+        break;
+    case 3:
+        for (i = 0; i < 4; i++)
+            out[i] = row[i] - (prev[i] >> 1);
+        for (; i < len; i++)
+            out[i] = row[i] - ((row[i-4] + prev[i]) >> 1);
+        break;
+    case 4:
+        for (i = 0; i < 4; i++)
+            out[i] = row[i] - prev[i];
+        for (; i < len; i++)
+            out[i] = row[i] - paeth(row[i-4], prev[i], prev[i-4]);
+        break;
+    }
+}
+
+/* filter image row y into out (filter type byte plus the row), with more than
+ * one allowed filter the one with the smallest sum of absolute values wins,
+ * the heuristic libpng uses */
+static void
+filter_image_row(const PngEncoder *enc, int y, const unsigned char *zeros, unsigned char *scratch, unsigned char *out)
+{
+    int len = enc->width * 4;
+    const unsigned char *row = framebuffer_row(enc->buffer, enc->width, enc->height, y);
+    const unsigned char *prev = y > 0 ? framebuffer_row(enc->buffer, enc->width, enc->height, y - 1) : zeros;
+
+    unsigned long best = ~0ul;
+    for (int type = 0; type < 5; type++) {
+        if (!(enc->filters & (PNG_FILTER_NONE << type)))
+            continue;
+        filter_row(type, row, prev, scratch, len);
+
+        unsigned long sum = 0;
+        if (enc->filters != (PNG_FILTER_NONE << type)) {
+            for (int i = 0; i < len; i++)
+                sum += abs((signed char)scratch[i]);
+        }
+        if (sum < best) {
+            best = sum;
+            out[0] = type;
+            memcpy(out + 1, scratch, len);
+        }
+    }
+}
+
+static void
+encode_png_chunk(const PngEncoder *enc, PngChunk *chunk, bool last)
+{
+    size_t rowBytes = 1 + (size_t)enc->width * 4;
+    std::vector<unsigned char> zeros(rowBytes), scratch(rowBytes);
+
+    // the rows before the chunk that make up its dictionary are filtered again
+    int dictRows = chunk->first > 0 ? std::min<int>(chunk->first, (DEFLATE_WINDOW + rowBytes - 1) / rowBytes) : 0;
+    int firstRow = chunk->first - dictRows;
+    std::vector<unsigned char> data((size_t)(dictRows + chunk->rows) * rowBytes);
+    for (int y = firstRow; y < chunk->first + chunk->rows; y++)
+        filter_image_row(enc, y, &zeros[0], &scratch[0], &data[(size_t)(y - firstRow) * rowBytes]);
+
+    size_t dictLen = std::min<size_t>((size_t)dictRows * rowBytes, DEFLATE_WINDOW);
+    const unsigned char *in = &data[(size_t)dictRows * rowBytes];
+    chunk->length = (uLong)chunk->rows * rowBytes;
+    chunk->adler = adler32(adler32(0, NULL, 0), in, chunk->length);
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    chunk->ok = deflateInit2(&zs, enc->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    if (!chunk->ok)
+        return;
+    if (dictLen)
+        deflateSetDictionary(&zs, in - dictLen, dictLen);
+
+    // room for the sync flush marker on top of the bound for a finished stream
+    chunk->out.resize(deflateBound(&zs, chunk->length) + 16);
+    zs.next_in = (Bytef*)in;
+    zs.avail_in = chunk->length;
+    zs.next_out = &chunk->out[0];
+    zs.avail_out = chunk->out.size();
+    int ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    chunk->ok = last ? ret == Z_STREAM_END : (ret == Z_OK && zs.avail_in == 0 && zs.avail_out > 0);
+    chunk->out.resize(zs.total_out);
+    deflateEnd(&zs);
+}
+
+static void *
+png_encode_worker(void *arg)
+{
+    PngEncoder *enc = (PngEncoder*)arg;
+    for (;;) {
+        pthread_mutex_lock(&enc->lock);
+        size_t i = enc->next++;
+        pthread_mutex_unlock(&enc->lock);
+        if (i >= enc->chunks.size())
+            return NULL;
+        encode_png_chunk(enc, &enc->chunks[i], i + 1 == enc->chunks.size());
+    }
+}
+
+static bool
+write_png_chunk(FILE *fp, const char *type, const unsigned char *data, size_t len)
+{
+    unsigned char head[8];
+    put_be32(head, len);
+    memcpy(head + 4, type, 4);
+    uLong crc = crc32(crc32(0, NULL, 0), head + 4, 4);
+    if (len)
+        crc = crc32(crc, data, len);
+    unsigned char tail[4];
+    put_be32(tail, crc);
+    return fwrite(head, 8, 1, fp) == 1 && (len == 0 || fwrite(data, len, 1, fp) == 1) && fwrite(tail, 4, 1, fp) == 1;
+}
+
+static bool
+write_png_parallel(const char *filename, const void *buffer, int width, int height, const OutputOptions *opt)
+{
+    PngEncoder enc;
+    enc.buffer = buffer;
+    enc.width = width;
+    enc.height = height;
+    enc.level = opt->pngLevel >= 0 ? opt->pngLevel : Z_DEFAULT_COMPRESSION;
+    enc.filters = opt->pngFilter >= 0 ? opt->pngFilter : PNG_ALL_FILTERS;
+    if (!(enc.filters & PNG_ALL_FILTERS))
+        enc.filters = PNG_FILTER_NONE;
+    enc.next = 0;
+    pthread_mutex_init(&enc.lock, NULL);
+
+    int rowsPerChunk = std::max<int>(1, PNG_CHUNK_BYTES / (1 + width * 4));
+    for (int y = 0; y < height; y += rowsPerChunk) {
+        PngChunk chunk;
+        chunk.first = y;
+        chunk.rows = std::min(rowsPerChunk, height - y);
+        chunk.adler = 1;
+        chunk.length = 0;
+        chunk.ok = false;
+        enc.chunks.push_back(chunk);
+    }
+
+    int threads = std::min<int>(opt->threads, enc.chunks.size());
+    std::vector<pthread_t> workers(threads);
+    // this thread deflates too, so whatever workers could be started are enough
+    int started = 1;
+    while (started < threads && pthread_create(&workers[started], NULL, png_encode_worker, &enc) == 0)
+        started++;
+    png_encode_worker(&enc);
+    for (int i = 1; i < started; i++)
+        pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&enc.lock);
+
+    // zlib header in the first chunk, the combined Adler-32 after the last
+    int level = enc.level < 0 ? 6 : enc.level;
+    unsigned char cmf = 0x78, flg = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+    flg += 31 - (cmf * 256 + flg) % 31;
+    unsigned char zhead[2] = { cmf, flg };
+    enc.chunks[0].out.insert(enc.chunks[0].out.begin(), zhead, zhead + 2);
+
+    uLong adler = adler32(0, NULL, 0);
+    for (size_t i = 0; i < enc.chunks.size(); i++)
+        adler = adler32_combine(adler, enc.chunks[i].adler, enc.chunks[i].length);
+    unsigned char ztail[4];
+    put_be32(ztail, adler);
+    enc.chunks.back().out.insert(enc.chunks.back().out.end(), ztail, ztail + 4);
+
+    bool ok = true;
+    for (size_t i = 0; i < enc.chunks.size(); i++)
+        ok = ok && enc.chunks[i].ok;
+    if (!ok) {
+        fprintf(stderr, "Couldn't compress %s\n", filename);
+        return false;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Couldn't open %s\n", filename);
+        return false;
+    }
+
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    unsigned char ihdr[13];
+    put_be32(ihdr, width);
+    put_be32(ihdr + 4, height);
+    ihdr[8] = 8;     // bit depth
+    ihdr[9] = 6;     // RGBA
+    ihdr[10] = 0;    // deflate
+    ihdr[11] = 0;    // adaptive filtering
+    ihdr[12] = 0;    // not interlaced
+
+    ok = fwrite(signature, 8, 1, fp) == 1 && write_png_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+    for (size_t i = 0; ok && i < enc.chunks.size(); i++)
+        ok = write_png_chunk(fp, "IDAT", &enc.chunks[i].out[0], enc.chunks[i].out.size());
+    ok = ok && write_png_chunk(fp, "IEND", NULL, 0);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok)
+        fprintf(stderr, "Couldn't write %s\n", filename);
+    return ok;
+}
+
+/* PPM, PGM and raw RGBA: rows are converted into one row buffer and written
+ * with stdio */
+static bool
+write_pnm(const char *filename, const void *buffer, int width, int height, ImageFormat format)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Couldn't open %s\n", filename);
+        return false;
+    }
+
+    if (format == FORMAT_PPM)
+        fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    else if (format == FORMAT_PGM)
+        fprintf(fp, "P5\n%d %d\n255\n", width, height);
+
+    std::vector<unsigned char> row(width * 3);
+    bool ok = true;
+    for (int y = 0; ok && y < height; y++) {
+        const unsigned char *src = framebuffer_row(buffer, width, height, y);
+        if (format == FORMAT_RGBA) {
+            ok = fwrite(src, 4, width, fp) == (size_t)width;
+            continue;
+        }
+
+        unsigned char *dst = &row[0];
+        if (format == FORMAT_PPM) {
+            for (int x = 0; x < width; x++, src += 4, dst += 3) {
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst[2] = src[2];
+            }
+        }
+        else {
+            // Rec. 601 luma in 8 bit fixed point
+            for (int x = 0; x < width; x++, src += 4)
+                *dst++ = (77 * src[0] + 150 * src[1] + 29 * src[2] + 128) >> 8;
+        }
+        ok = fwrite(&row[0], 1, dst - &row[0], fp) == (size_t)(dst - &row[0]);
+    }
+
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok)
+        fprintf(stderr, "Couldn't write %s\n", filename);
+    return ok;
+}
+
+/* QOI encoder following the specification at qoiformat.org: runs of the
+ * previous pixel, an index of 64 recently seen pixels and small differences
+ * to the previous pixel, falling back to literal RGB or RGBA. One row is
+ * encoded at a time into a buffer large enough for its worst case. */
+static bool
+write_qoi(const char *filename, const void *buffer, int width, int height)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Couldn't open %s\n", filename);
+        return false;
+    }
+
+    unsigned char header[14] = { 'q', 'o', 'i', 'f' };
+    put_be32(header + 4, width);
+    put_be32(header + 8, height);
+    header[12] = 4;    // RGBA
+    header[13] = 0;    // sRGB with linear alpha
+    bool ok = fwrite(header, sizeof(header), 1, fp) == 1;
+
+    unsigned char index[64][4];
+    memset(index, 0, sizeof(index));
+    unsigned char prev[4] = { 0, 0, 0, 255 };
+    int run = 0;
+    std::vector<unsigned char> out(width * 5 + 1);
+
+    for (int y = 0; ok && y < height; y++) {
+        const unsigned char *px = framebuffer_row(buffer, width, height, y);
+        unsigned char *o = &out[0];
+        bool last_row = y == height - 1;
+
+        for (int x = 0; x < width; x++, px += 4) {
+            if (!memcmp(px, prev, 4)) {
+                run++;
+                if (run == 62 || (last_row && x == width - 1)) {
+                    *o++ = 0xc0 | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run > 0) {
+                *o++ = 0xc0 | (run - 1);
+                run = 0;
+            }
+
+            int h = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+            if (!memcmp(index[h], px, 4)) {
+                *o++ = h;
+            }
+            else {
+                memcpy(index[h], px, 4);
+                if (px[3] == prev[3]) {
+                    signed char vr = px[0] - prev[0];
+                    signed char vg = px[1] - prev[1];
+                    signed char vb = px[2] - prev[2];
+                    signed char vg_r = vr - vg;
+                    signed char vg_b = vb - vg;
+                    if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                        *o++ = 0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                    }
+                    else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                        *o++ = 0x80 | (vg + 32);
+                        *o++ = (vg_r + 8) << 4 | (vg_b + 8);
+                    }
+                    else {
+                        *o++ = 0xfe;
+                        *o++ = px[0];
+                        *o++ = px[1];
+                        *o++ = px[2];
+                    }
+                }
+                else {
+                    *o++ = 0xff;
+                    memcpy(o, px, 4);
+                    o += 4;
+                }
+            }
+            memcpy(prev, px, 4);
+        }
+
+        ok = fwrite(&out[0], 1, o - &out[0], fp) == (size_t)(o - &out[0]);
+    }
+
+    static const unsigned char end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    ok = ok && fwrite(end, sizeof(end), 1, fp) == 1;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok)
+        fprintf(stderr, "Couldn't write %s\n", filename);
+    return ok;
+}
+
+bool
+write_image(const char *filename, const void *buffer, int width, int height, const OutputOptions *opt)
+{
+    ImageFormat format = opt->format == FORMAT_AUTO ? image_format_for(filename) : opt->format;
+    switch (format) {
+    case FORMAT_QOI:
+        return write_qoi(filename, buffer, width, height);
+    case FORMAT_PPM:
+    case FORMAT_PGM:
+    case FORMAT_RGBA:
+        return write_pnm(filename, buffer, width, height, format);
+    default:
+        if (opt->threads > 1 && (long)width * height >= PARALLEL_PNG_PIXELS)
+            return write_png_parallel(filename, buffer, width, height, opt);
+        return write_png(filename, buffer, width, height, opt);
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * Image output for the renderer
+ *
+ * The OSMesa framebuffer holds 8 bit RGBA pixels with the bottom row first.
+ * Writers take it as it is and emit the rows top-down, without copying the
+ * image. Besides PNG there are formats that cost next to nothing to encode,
+ * for runs where deflate would take longer than rendering.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+enum ImageFormat {
+    FORMAT_AUTO,    // from the file extension, PNG for unknown extensions
+    FORMAT_PNG,
+    FORMAT_QOI,     // "Quite OK Image" format, RGBA
+    FORMAT_PPM,     // binary P6, the alpha channel is dropped
+    FORMAT_PGM,     // binary P5, luma of the RGB channels
+    FORMAT_RGBA     // the bare pixels, rows top-down, no header
+};
+
+struct OutputOptions {
+    ImageFormat format;
+    int pngLevel;     // zlib level, 0 stores the data uncompressed, -1 for libpng's default
+    int pngFilter;    // a PNG_FILTER_* mask, -1 for libpng's adaptive choice
+    int threads;      // large PNGs are deflated on this many threads
+};
+
+// PNG as libpng writes it by default, on one thread
+void default_output_options(OutputOptions *opt);
+
+// parse a format name (png, qoi, ppm, pgm, rgba or auto), false if unknown
+bool parse_image_format(const char *name, ImageFormat *format);
+
+// parse a PNG filter name (none, sub, up, avg, paeth or adaptive), false if unknown
+bool parse_png_filter(const char *name, int *filter);
+
+// the format of FORMAT_AUTO for filename
+ImageFormat image_format_for(const char *filename);
+
+/* write the framebuffer to a file, rows are streamed to the encoder straight
+ * from the buffer, false if the file can't be written */
+bool write_image(const char *filename, const void *buffer, int width, int height, const OutputOptions *opt);
+
+#endif
@@ -0,0 +1,835 @@
+/*
+ * Tile based software rasterizer, see raster.h
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "raster.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const int TileShift = 6, TileSize = 1 << TileShift;
+
+// window coordinates of triangle corners are snapped to 1/16 pixel
+static const int SubpixelBits = 4, Subpixel = 1 << SubpixelBits;
+
+/* Triangles are only clipped where they reach this many pixels beyond the
+ * image, which keeps the snapped coordinates and edge functions in range */
+static const float GuardBand = 8192;
+
+/* Primitives set up in one go by a thread, and at most in one round of setup
+ * and rasterization, which bounds the memory of a flush */
+static const GLsizei ChunkPrimitives = 2048;
+static const size_t RoundPrimitives = 1 << 17;
+
+// interpolated per fragment: depth, 1/w and the colors and texture coordinates over w
+enum { ATTRIBS = 8 };
+
+// a vertex in clip space with everything that is interpolated along when clipping
+enum { CLIP_POS = 0, CLIP_FRONT = 4, CLIP_BACK = 8, CLIP_UV = 12, CLIP_FLOATS = 14 };
+
+struct ClipVertex {
+    float v[CLIP_FLOATS];
+};
+
+// near plane and the four guard band planes
+static const int ClipPlanes = 5;
+
+// room for a triangle clipped by every plane
+enum { MAX_CLIPPED = 3 + ClipPlanes };
+
+struct WinVertex {
+    float x, y, z, invw;
+    int X, Y;              // snapped
+};
+
+// a primitive ready to be rasterized, in window coordinates
+struct Prim {
+    int kind;                      // RASTER_*
+    const RasterTexture *texture;
+    int X[3], Y[3];                // triangles: snapped corners, counter-clockwise
+    int minX, minY, maxX, maxY;    // pixels it may cover
+    float x0, y0;                  // triangles: origin of the planes, lines and points: first end
+    float dx, dy;                  // lines: second end relative to the first
+    float a[ATTRIBS][3];           // triangles: value at the origin and steps in x and y, lines: values at the ends
+};
+
+// primitives of a draw set up by one thread, and sorted into tiles
+struct Unit {
+    size_t draw;
+    GLsizei first, count;
+    std::vector<Prim> prims;
+    std::vector<unsigned int> tileStart, cursor, order;
+};
+
+struct RasterFrame {
+    int threads;
+    int width, height, pitch;      // rows are padded to whole blocks of four pixels
+    int tilesX, tilesY;
+    GLfloat clip[16];
+    float guardX, guardY;          // the guard band in normalized device coordinates
+    uint32_t *color;               // RGBA bytes per pixel, rows from the bottom up
+    float *depth;
+    size_t capacity;               // pixels of color and depth
+    std::vector<RasterDraw> draws;
+    std::vector<Unit> units;
+    size_t round;                  // units of the current round
+};
+
+static int
+floor_div(int a, int b)
+{
+    return a >= 0 ? a / b : -((b - 1 - a) / b);
+}
+
+static int
+ceil_div(int a, int b)
+{
+    return -floor_div(-a, b);
+}
+
+static float
+clamp01(float c)
+{
+    return std::min(std::max(c, 0.0f), 1.0f);
+}
+
+static uint32_t
+pack_color(const float *c)
+{
+    unsigned char b[4];
+    for (int k = 0; k < 4; k++)
+        b[k] = (unsigned char)(clamp01(c[k]) * 255.0f + 0.5f);
+    uint32_t v;
+    memcpy(&v, b, sizeof v);
+    return v;
+}
+
+// GL_LINEAR with GL_REPEAT
+static void
+sample_texture(const RasterTexture *tex, float s, float t, float *rgb)
+{
+    float u = s * tex->width - 0.5f, v = t * tex->height - 0.5f;
+    if (!(fabsf(u) < 1e9f && fabsf(v) < 1e9f)) {
+        rgb[0] = rgb[1] = rgb[2] = 0;
+        return;
+    }
+    float fu = floorf(u), fv = floorf(v), a = u - fu, b = v - fv;
+    int i0 = (int)fu % tex->width, j0 = (int)fv % tex->height;
+    if (i0 < 0)
+        i0 += tex->width;
+    if (j0 < 0)
+        j0 += tex->height;
+    int i1 = i0 + 1 < tex->width ? i0 + 1 : 0, j1 = j0 + 1 < tex->height ? j0 + 1 : 0;
+    const unsigned char *p00 = tex->rgb + 3 * ((size_t)j0 * tex->width + i0);
+    const unsigned char *p10 = tex->rgb + 3 * ((size_t)j0 * tex->width + i1);
+    const unsigned char *p01 = tex->rgb + 3 * ((size_t)j1 * tex->width + i0);
+    const unsigned char *p11 = tex->rgb + 3 * ((size_t)j1 * tex->width + i1);
+    for (int c = 0; c < 3; c++)
+        rgb[c] = ((1 - a) * (1 - b) * p00[c] + a * (1 - b) * p10[c] + (1 - a) * b * p01[c] + a * b * p11[c]) * (1.0f / 255);
+}
+
+// one fragment with interpolated attributes, through the depth test
+static void
+fragment(RasterFrame *f, int x, int y, const float *v, const RasterTexture *texture)
+{
+    size_t i = (size_t)y * f->pitch + x;
+    if (!(v[0] <= 1 && v[0] <= f->depth[i]))
+        return;
+    float w = 1.0f / v[1], c[4];
+    for (int k = 0; k < 4; k++)
+        c[k] = v[2+k] * w;
+    if (texture) {
+        float rgb[3];
+        sample_texture(texture, v[6] * w, v[7] * w, rgb);
+        for (int k = 0; k < 3; k++)
+            c[k] *= rgb[k];
+    }
+    f->color[i] = pack_color(c);
+    f->depth[i] = v[0];
+}
+
+// Geometry
+
+static void
+fetch_vertex(const RasterFrame *f, const RasterDraw *d, GLint i, ClipVertex *out)
+{
+    const GLfloat *p = d->positions + d->stride * i, *m = f->clip;
+    for (int r = 0; r < 4; r++)
+        out->v[CLIP_POS+r] = m[r] * p[0] + m[4+r] * p[1] + m[8+r] * p[2] + m[12+r];
+    if (d->front) {
+        const GLubyte *front = d->front + 4 * i, *back = (d->back ? d->back : d->front) + 4 * i;
+        for (int c = 0; c < 4; c++) {
+            out->v[CLIP_FRONT+c] = front[c] * (1.0f / 255);
+            out->v[CLIP_BACK+c] = back[c] * (1.0f / 255);
+        }
+    }
+    else {
+        const GLfloat *color = d->colors ? d->colors + 4 * i : d->color;
+        for (int c = 0; c < 4; c++)
+            out->v[CLIP_FRONT+c] = out->v[CLIP_BACK+c] = color[c];
+    }
+    out->v[CLIP_UV] = d->texcoords ? d->texcoords[2*i] : 0.0f;
+    out->v[CLIP_UV+1] = d->texcoords ? d->texcoords[2*i+1] : 0.0f;
+}
+
+// the planes of the view volume a vertex is outside of
+static int
+outcode(const ClipVertex &v)
+{
+    const float *c = v.v + CLIP_POS;
+    return (c[0] < -c[3]) | (c[0] > c[3]) << 1 | (c[1] < -c[3]) << 2 | (c[1] > c[3]) << 3
+        | (c[2] < -c[3]) << 4 | (c[2] > c[3]) << 5;
+}
+
+static float
+clip_distance(const RasterFrame *f, const ClipVertex &v, int plane)
+{
+    const float *c = v.v + CLIP_POS;
+    switch (plane) {
+    case 0: return c[2] + c[3];
+    case 1: return f->guardX * c[3] - c[0];
+    case 2: return f->guardX * c[3] + c[0];
+    case 3: return f->guardY * c[3] - c[1];
+    default: return f->guardY * c[3] + c[1];
+    }
+}
+
+static void
+lerp_vertex(const ClipVertex &a, const ClipVertex &b, float t, ClipVertex *out)
+{
+    for (int k = 0; k < CLIP_FLOATS; k++)
+        out->v[k] = a.v[k] + t * (b.v[k] - a.v[k]);
+}
+
+// Sutherland-Hodgman against the near plane and the guard band, the vertices left
+static int
+clip_polygon(const RasterFrame *f, ClipVertex *poly, int n)
+{
+    ClipVertex scratch[MAX_CLIPPED];
+    ClipVertex *in = poly, *out = scratch;
+    for (int plane = 0; plane < ClipPlanes; plane++) {
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            const ClipVertex &a = in[i], &b = in[(i + 1) % n];
+            float da = clip_distance(f, a, plane), db = clip_distance(f, b, plane);
+            if (da >= 0)
+                out[m++] = a;
+            // from the inside out, so that triangles sharing the edge get the same vertex
+            if (da >= 0 && db < 0)
+                lerp_vertex(a, b, da / (da - db), &out[m++]);
+            else if (da < 0 && db >= 0)
+                lerp_vertex(b, a, db / (db - da), &out[m++]);
+        }
+        std::swap(in, out);
+        n = m;
+        if (n < 3)
+            return 0;
+    }
+    if (in != poly)
+        std::copy(in, in + n, poly);
+    return n;
+}
+
+static bool
+to_window(const RasterFrame *f, const ClipVertex &v, WinVertex *w)
+{
+    const float *c = v.v + CLIP_POS;
+    if (!(c[3] > 0))
+        return false;
+    w->invw = 1.0f / c[3];
+    w->x = (c[0] * w->invw + 1) * 0.5f * f->width;
+    w->y = (c[1] * w->invw + 1) * 0.5f * f->height;
+    w->z = (c[2] * w->invw + 1) * 0.5f;
+    // clipping leaves rounding errors, and NaN
+    if (!(w->x >= -GuardBand - 1 && w->x <= f->width + GuardBand + 1 && w->y >= -GuardBand - 1
+          && w->y <= f->height + GuardBand + 1))
+        return false;
+    w->X = (int)floorf(w->x * Subpixel + 0.5f);
+    w->Y = (int)floorf(w->y * Subpixel + 0.5f);
+    return true;
+}
+
+// what is interpolated, with the colors of one side
+static void
+attributes(const WinVertex &w, const ClipVertex &v, int side, float *a)
+{
+    a[0] = w.z;
+    a[1] = w.invw;
+    for (int c = 0; c < 4; c++)
+        a[2+c] = v.v[side+c] * w.invw;
+    a[6] = v.v[CLIP_UV] * w.invw;
+    a[7] = v.v[CLIP_UV+1] * w.invw;
+}
+
+static void
+setup_triangle(const RasterFrame *f, Unit &u, const RasterDraw *d, const WinVertex *w[3], const ClipVertex *v[3])
+{
+    int64_t area = (int64_t)(w[1]->X - w[0]->X) * (w[2]->Y - w[0]->Y) - (int64_t)(w[2]->X - w[0]->X) * (w[1]->Y - w[0]->Y);
+    if (area == 0)
+        return;
+    // counter-clockwise in window coordinates is the front, like glFrontFace(GL_CCW)
+    bool front = area > 0;
+    if (!front && d->cullBack)
+        return;
+    int order[3] = { 0, front ? 1 : 2, front ? 2 : 1 };
+
+    Prim p;
+    p.kind = RASTER_TRIANGLES;
+    p.texture = d->texture;
+    int minX = INT_MAX, minY = INT_MAX, maxX = INT_MIN, maxY = INT_MIN;
+    for (int i = 0; i < 3; i++) {
+        p.X[i] = w[order[i]]->X;
+        p.Y[i] = w[order[i]]->Y;
+        minX = std::min(minX, p.X[i]);
+        maxX = std::max(maxX, p.X[i]);
+        minY = std::min(minY, p.Y[i]);
+        maxY = std::max(maxY, p.Y[i]);
+    }
+    // pixels whose centers the corners span
+    p.minX = std::max(0, ceil_div(minX - Subpixel / 2, Subpixel));
+    p.maxX = std::min(f->width - 1, floor_div(maxX - Subpixel / 2, Subpixel));
+    p.minY = std::max(0, ceil_div(minY - Subpixel / 2, Subpixel));
+    p.maxY = std::min(f->height - 1, floor_div(maxY - Subpixel / 2, Subpixel));
+    if (p.minX > p.maxX || p.minY > p.maxY)
+        return;
+
+    float values[3][ATTRIBS];
+    for (int i = 0; i < 3; i++)
+        attributes(*w[order[i]], *v[order[i]], front ? CLIP_FRONT : CLIP_BACK, values[i]);
+    double x0 = (double)p.X[0] / Subpixel, y0 = (double)p.Y[0] / Subpixel;
+    double dx1 = (double)p.X[1] / Subpixel - x0, dy1 = (double)p.Y[1] / Subpixel - y0;
+    double dx2 = (double)p.X[2] / Subpixel - x0, dy2 = (double)p.Y[2] / Subpixel - y0;
+    double det = dx1 * dy2 - dx2 * dy1;
+    p.x0 = (float)x0;
+    p.y0 = (float)y0;
+    for (int k = 0; k < ATTRIBS; k++) {
+        double d1 = values[1][k] - values[0][k], d2 = values[2][k] - values[0][k];
+        p.a[k][0] = values[0][k];
+        p.a[k][1] = (float)((d1 * dy2 - d2 * dy1) / det);
+        p.a[k][2] = (float)((d2 * dx1 - d1 * dx2) / det);
+    }
+    u.prims.push_back(p);
+}
+
+static void
+setup_line(const RasterFrame *f, Unit &u, const RasterDraw *d, const ClipVertex &a, const ClipVertex &b, int side)
+{
+    if (outcode(a) & outcode(b))
+        return;
+    float t0 = 0, t1 = 1;
+    for (int plane = 0; plane < ClipPlanes; plane++) {
+        float da = clip_distance(f, a, plane), db = clip_distance(f, b, plane);
+        if (da < 0 && db < 0)
+            return;
+        if (da < 0)
+            t0 = std::max(t0, da / (da - db));
+        else if (db < 0)
+            t1 = std::min(t1, da / (da - db));
+    }
+    if (!(t0 <= t1))
+        return;
+    ClipVertex ca, cb;
+    lerp_vertex(a, b, t0, &ca);
+    lerp_vertex(a, b, t1, &cb);
+    WinVertex wa, wb;
+    if (!to_window(f, ca, &wa) || !to_window(f, cb, &wb))
+        return;
+
+    Prim p;
+    p.kind = RASTER_LINES;
+    p.texture = d->texture;
+    p.x0 = wa.x;
+    p.y0 = wa.y;
+    p.dx = wb.x - wa.x;
+    p.dy = wb.y - wa.y;
+    p.minX = std::max(0, (int)floorf(std::min(wa.x, wb.x)));
+    p.maxX = std::min(f->width - 1, (int)floorf(std::max(wa.x, wb.x)));
+    p.minY = std::max(0, (int)floorf(std::min(wa.y, wb.y)));
+    p.maxY = std::min(f->height - 1, (int)floorf(std::max(wa.y, wb.y)));
+    if (p.minX > p.maxX || p.minY > p.maxY)
+        return;
+    float va[ATTRIBS], vb[ATTRIBS];
+    attributes(wa, ca, side, va);
+    attributes(wb, cb, side, vb);
+    for (int k = 0; k < ATTRIBS; k++) {
+        p.a[k][0] = va[k];
+        p.a[k][1] = vb[k];
+    }
+    u.prims.push_back(p);
+}
+
+static void
+setup_point(const RasterFrame *f, Unit &u, const RasterDraw *d, const ClipVertex &v)
+{
+    WinVertex w;
+    if (outcode(v) || !to_window(f, v, &w))
+        return;
+    Prim p;
+    p.kind = RASTER_POINTS;
+    p.texture = d->texture;
+    p.minX = p.maxX = (int)floorf(w.x);
+    p.minY = p.maxY = (int)floorf(w.y);
+    if (p.minX < 0 || p.minX >= f->width || p.minY < 0 || p.minY >= f->height)
+        return;
+    float a[ATTRIBS];
+    attributes(w, v, CLIP_FRONT, a);
+    for (int k = 0; k < ATTRIBS; k++)
+        p.a[k][0] = a[k];
+    u.prims.push_back(p);
+}
+
+static void
+setup_polygon(const RasterFrame *f, Unit &u, const RasterDraw *d, GLint first)
+{
+    ClipVertex poly[MAX_CLIPPED];
+    for (int i = 0; i < 3; i++)
+        fetch_vertex(f, d, first + i, &poly[i]);
+    if (outcode(poly[0]) & outcode(poly[1]) & outcode(poly[2]))
+        return;
+    int n = 3;
+    for (int i = 0; i < 3; i++)
+        for (int plane = 0; plane < ClipPlanes; plane++)
+            if (clip_distance(f, poly[i], plane) < 0)
+                n = -1;
+    if (n < 0)
+        n = clip_polygon(f, poly, 3);
+    if (n < 3)
+        return;
+
+    WinVertex w[MAX_CLIPPED];
+    for (int i = 0; i < n; i++)
+        if (!to_window(f, poly[i], &w[i]))
+            return;
+
+    if (d->wireframe) {
+        // GL_LINE outlines the polygon with the colors of the side it shows
+        double area = 0;
+        for (int i = 0; i < n; i++) {
+            const WinVertex &a = w[i], &b = w[(i + 1) % n];
+            area += (double)a.x * b.y - (double)b.x * a.y;
+        }
+        if (area == 0 || (area < 0 && d->cullBack))
+            return;
+        for (int i = 0; i < n; i++)
+            setup_line(f, u, d, poly[i], poly[(i + 1) % n], area > 0 ? CLIP_FRONT : CLIP_BACK);
+        return;
+    }
+
+    for (int i = 1; i + 1 < n; i++) {
+        const WinVertex *wv[3] = { &w[0], &w[i], &w[i+1] };
+        const ClipVertex *cv[3] = { &poly[0], &poly[i], &poly[i+1] };
+        setup_triangle(f, u, d, wv, cv);
+    }
+}
+
+// counting sort of the primitives into the tiles their bounds touch, in order
+static void
+bin_prims(const RasterFrame *f, Unit &u)
+{
+    size_t tiles = (size_t)f->tilesX * f->tilesY;
+    u.tileStart.assign(tiles + 1, 0);
+    for (size_t i = 0; i < u.prims.size(); i++) {
+        const Prim &p = u.prims[i];
+        for (int ty = p.minY >> TileShift; ty <= p.maxY >> TileShift; ty++)
+            for (int tx = p.minX >> TileShift; tx <= p.maxX >> TileShift; tx++)
+                u.tileStart[(size_t)ty * f->tilesX + tx + 1]++;
+    }
+    for (size_t t = 0; t < tiles; t++)
+        u.tileStart[t+1] += u.tileStart[t];
+    u.cursor.assign(u.tileStart.begin(), u.tileStart.end() - 1);
+    u.order.resize(u.tileStart[tiles]);
+    for (size_t i = 0; i < u.prims.size(); i++) {
+        const Prim &p = u.prims[i];
+        for (int ty = p.minY >> TileShift; ty <= p.maxY >> TileShift; ty++)
+            for (int tx = p.minX >> TileShift; tx <= p.maxX >> TileShift; tx++)
+                u.order[u.cursor[(size_t)ty * f->tilesX + tx]++] = (unsigned int)i;
+    }
+}
+
+static GLsizei
+primitive_count(const RasterDraw &d)
+{
+    return d.mode == RASTER_TRIANGLES ? d.count / 3 : d.mode == RASTER_LINES ? d.count / 2 : d.count;
+}
+
+static void
+setup_unit(RasterFrame *f, size_t i)
+{
+    Unit &u = f->units[i];
+    const RasterDraw *d = &f->draws[u.draw];
+    u.prims.clear();
+    for (GLsizei k = u.first; k < u.first + u.count; k++) {
+        ClipVertex a, b;
+        switch (d->mode) {
+        case RASTER_TRIANGLES:
+            setup_polygon(f, u, d, d->first + 3 * k);
+            break;
+        case RASTER_LINES:
+            fetch_vertex(f, d, d->first + 2 * k, &a);
+            fetch_vertex(f, d, d->first + 2 * k + 1, &b);
+            setup_line(f, u, d, a, b, CLIP_FRONT);
+            break;
+        default:
+            fetch_vertex(f, d, d->first + k, &a);
+            setup_point(f, u, d, a);
+            break;
+        }
+    }
+    bin_prims(f, u);
+}
+
+// Rasterization
+
+// pixels of a tile
+struct TileRect {
+    int x0, y0, x1, y1;    // inclusive
+};
+
+// attribute values of a triangle at the center of pixel x, y
+static void
+plane_values(const Prim &p, int x, int y, double *v)
+{
+    double dx = x + 0.5 - p.x0, dy = y + 0.5 - p.y0;
+    for (int k = 0; k < ATTRIBS; k++)
+        v[k] = p.a[k][0] + p.a[k][1] * dx + p.a[k][2] * dy;
+}
+
+static void
+draw_triangle(RasterFrame *f, const TileRect &r, const Prim &p)
+{
+    int x0 = std::max(p.minX, r.x0), x1 = std::min(p.maxX, r.x1);
+    int y0 = std::max(p.minY, r.y0), y1 = std::min(p.maxY, r.y1);
+    if (x0 > x1 || y0 > y1)
+        return;
+
+    /* Edge functions at the snapped pixel centers, positive inside. Pixels on
+     * an edge belong to the triangle on its left or top side, so that
+     * triangles sharing an edge neither leave gaps nor overlap */
+    int64_t A[3], B[3], C[3];
+    int partial[3], edges = 0;
+    for (int k = 0; k < 3; k++) {
+        int j = (k + 1) % 3, l = (k + 2) % 3;
+        A[k] = p.Y[j] - p.Y[l];
+        B[k] = p.X[l] - p.X[j];
+        C[k] = -A[k] * p.X[j] - B[k] * p.Y[j] - (A[k] > 0 || (A[k] == 0 && B[k] < 0) ? 0 : 1);
+        int64_t lo = 0, hi = 0;
+        for (int c = 0; c < 4; c++) {
+            int64_t px = (int64_t)((c & 1 ? x1 : x0) * Subpixel + Subpixel / 2);
+            int64_t py = (int64_t)((c & 2 ? y1 : y0) * Subpixel + Subpixel / 2);
+            int64_t e = A[k] * px + B[k] * py + C[k];
+            lo = c ? std::min(lo, e) : e;
+            hi = c ? std::max(hi, e) : e;
+        }
+        if (hi < 0)
+            return;
+        // edges the whole block is inside of need no testing
+        if (lo < 0)
+            partial[edges++] = k;
+    }
+
+#ifdef __SSE2__
+    /* Blocks of four pixels, aligned so that they stay inside the tile: the
+     * edge functions in 32 bit lanes, which is enough within a tile of an edge
+     * crossing it, and the planes in float, stepped from their value in double
+     * at the start of each row */
+    int xs = x0 & ~3;
+    const __m128 lane = _mm_set_ps(3, 2, 1, 0), one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+    const __m128 scale = _mm_set1_ps(255.0f);
+    const __m128i laneX = _mm_add_epi32(_mm_set1_epi32(xs), _mm_set_epi32(3, 2, 1, 0));
+    const __m128i first = _mm_set1_epi32(x0 - 1), last = _mm_set1_epi32(x1 + 1);
+    __m128 ramp[ATTRIBS], step[ATTRIBS];
+    for (int k = 0; k < ATTRIBS; k++) {
+        ramp[k] = _mm_mul_ps(_mm_set1_ps(p.a[k][1]), lane);
+        step[k] = _mm_set1_ps(4 * p.a[k][1]);
+    }
+    __m128i edgeRamp[3], edgeStep[3];
+    for (int e = 0; e < edges; e++) {
+        int a = (int)A[partial[e]] * Subpixel;
+        edgeRamp[e] = _mm_set_epi32(3 * a, 2 * a, a, 0);
+        edgeStep[e] = _mm_set1_epi32(4 * a);
+    }
+
+    for (int y = y0; y <= y1; y++) {
+        double base[ATTRIBS];
+        plane_values(p, xs, y, base);
+        __m128 v[ATTRIBS];
+        for (int k = 0; k < ATTRIBS; k++)
+            v[k] = _mm_add_ps(_mm_set1_ps((float)base[k]), ramp[k]);
+        __m128i ev[3];
+        for (int e = 0; e < edges; e++) {
+            int k = partial[e];
+            int64_t row = A[k] * (xs * Subpixel + Subpixel / 2) + B[k] * (y * Subpixel + Subpixel / 2) + C[k];
+            ev[e] = _mm_add_epi32(_mm_set1_epi32((int)row), edgeRamp[e]);
+        }
+        __m128i xv = laneX;
+        uint32_t *colorRow = f->color + (size_t)y * f->pitch;
+        float *depthRow = f->depth + (size_t)y * f->pitch;
+
+        for (int x = xs; x <= x1; x += 4) {
+            __m128i cover = _mm_and_si128(_mm_cmpgt_epi32(xv, first), _mm_cmplt_epi32(xv, last));
+            for (int e = 0; e < edges; e++)
+                cover = _mm_and_si128(cover, _mm_cmpgt_epi32(ev[e], _mm_set1_epi32(-1)));
+            __m128 depth = _mm_loadu_ps(depthRow + x);
+            __m128 pass = _mm_and_ps(_mm_castsi128_ps(cover), _mm_and_ps(_mm_cmple_ps(v[0], depth), _mm_cmple_ps(v[0], one)));
+            int mask = _mm_movemask_ps(pass);
+
+            if (mask) {
+                __m128 w = _mm_div_ps(one, v[1]);
+                __m128 c[4];
+                for (int k = 0; k < 4; k++)
+                    c[k] = _mm_mul_ps(v[2+k], w);
+                if (p.texture) {
+                    float s[4], t[4], rgb[3][4];
+                    _mm_storeu_ps(s, _mm_mul_ps(v[6], w));
+                    _mm_storeu_ps(t, _mm_mul_ps(v[7], w));
+                    for (int i = 0; i < 4; i++) {
+                        float texel[3] = { 0, 0, 0 };
+                        if (mask & 1 << i)
+                            sample_texture(p.texture, s[i], t[i], texel);
+                        for (int k = 0; k < 3; k++)
+                            rgb[k][i] = texel[k];
+                    }
+                    for (int k = 0; k < 3; k++)
+                        c[k] = _mm_mul_ps(c[k], _mm_loadu_ps(rgb[k]));
+                }
+                __m128i b[4];
+                for (int k = 0; k < 4; k++)
+                    b[k] = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(c[k], zero), one), scale));
+                __m128i rgba = _mm_or_si128(_mm_or_si128(b[0], _mm_slli_epi32(b[1], 8)),
+                                            _mm_or_si128(_mm_slli_epi32(b[2], 16), _mm_slli_epi32(b[3], 24)));
+                __m128i keep = _mm_castps_si128(pass);
+                __m128i old = _mm_loadu_si128((const __m128i*)(colorRow + x));
+                _mm_storeu_si128((__m128i*)(colorRow + x), _mm_or_si128(_mm_and_si128(keep, rgba), _mm_andnot_si128(keep, old)));
+                _mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(pass, v[0]), _mm_andnot_ps(pass, depth)));
+            }
+
+            for (int k = 0; k < ATTRIBS; k++)
+                v[k] = _mm_add_ps(v[k], step[k]);
+            for (int e = 0; e < edges; e++)
+                ev[e] = _mm_add_epi32(ev[e], edgeStep[e]);
+            xv = _mm_add_epi32(xv, _mm_set1_epi32(4));
+        }
+    }
+#else
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            bool inside = true;
+            for (int e = 0; e < edges && inside; e++) {
+                int k = partial[e];
+                inside = A[k] * (x * Subpixel + Subpixel / 2) + B[k] * (y * Subpixel + Subpixel / 2) + C[k] >= 0;
+            }
+            if (!inside)
+                continue;
+            double d[ATTRIBS];
+            float v[ATTRIBS];
+            plane_values(p, x, y, d);
+            for (int k = 0; k < ATTRIBS; k++)
+                v[k] = (float)d[k];
+            fragment(f, x, y, v, p.texture);
+        }
+    }
+#endif
+}
+
+// one fragment per pixel along the major axis, at the pixel centers the line passes
+static void
+draw_line(RasterFrame *f, const TileRect &r, const Prim &p)
+{
+    bool major = fabsf(p.dx) >= fabsf(p.dy);
+    float length = major ? p.dx : p.dy;
+    if (length == 0)
+        return;
+    float start = major ? p.x0 : p.y0, lo = std::min(start, start + length), hi = std::max(start, start + length);
+    int from = major ? std::max(p.minX, r.x0) : std::max(p.minY, r.y0);
+    int to = major ? std::min(p.maxX, r.x1) : std::min(p.maxY, r.y1);
+    for (int i = from; i <= to; i++) {
+        float center = i + 0.5f;
+        if (center < lo || center >= hi)
+            continue;
+        float t = (center - start) / length;
+        int j = (int)floorf(major ? p.y0 + t * p.dy : p.x0 + t * p.dx);
+        int x = major ? i : j, y = major ? j : i;
+        if (x < r.x0 || x > r.x1 || y < r.y0 || y > r.y1 || x >= f->width || y >= f->height)
+            continue;
+        float v[ATTRIBS];
+        for (int k = 0; k < ATTRIBS; k++)
+            v[k] = p.a[k][0] + t * (p.a[k][1] - p.a[k][0]);
+        fragment(f, x, y, v, p.texture);
+    }
+}
+
+static void
+draw_tile(RasterFrame *f, size_t t)
+{
+    int tx = (int)(t % f->tilesX), ty = (int)(t / f->tilesX);
+    TileRect r = { tx << TileShift, ty << TileShift,
+                   std::min((tx + 1) << TileShift, f->width) - 1, std::min((ty + 1) << TileShift, f->height) - 1 };
+    for (size_t i = 0; i < f->round; i++) {
+        const Unit &u = f->units[i];
+        for (unsigned int j = u.tileStart[t]; j < u.tileStart[t+1]; j++) {
+            const Prim &p = u.prims[u.order[j]];
+            if (p.kind == RASTER_TRIANGLES)
+                draw_triangle(f, r, p);
+            else if (p.kind == RASTER_LINES)
+                draw_line(f, r, p);
+            else {
+                float v[ATTRIBS];
+                for (int k = 0; k < ATTRIBS; k++)
+                    v[k] = p.a[k][0];
+                fragment(f, p.minX, p.minY, v, p.texture);
+            }
+        }
+    }
+}
+
+// Threads
+
+struct RasterWork {
+    RasterFrame *frame;
+    void (*run)(RasterFrame*, size_t);
+    size_t count;
+    size_t next;
+};
+
+static void *
+raster_worker(void *arg)
+{
+    RasterWork *work = (RasterWork*)arg;
+    for (;;) {
+        size_t i = __sync_fetch_and_add(&work->next, 1);
+        if (i >= work->count)
+            return NULL;
+        work->run(work->frame, i);
+    }
+}
+
+// run(f, i) for i up to count, spread over the frame's threads
+static void
+run_parallel(RasterFrame *f, size_t count, void (*run)(RasterFrame*, size_t))
+{
+    RasterWork work = { f, run, count, 0 };
+    std::vector<pthread_t> threads(std::min<size_t>(std::max(f->threads, 1), std::max<size_t>(count, 1)) - 1);
+    // the caller works too, so whatever threads could be started are enough
+    size_t started = 0;
+    while (started < threads.size() && pthread_create(&threads[started], NULL, raster_worker, &work) == 0)
+        started++;
+    raster_worker(&work);
+    for (size_t t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+}
+
+RasterFrame *raster_create(int threads)
+{
+    RasterFrame *f = new RasterFrame;
+    f->threads = threads;
+    f->width = f->height = f->pitch = 0;
+    f->tilesX = f->tilesY = 0;
+    f->color = NULL;
+    f->depth = NULL;
+    f->capacity = 0;
+    f->round = 0;
+    return f;
+}
+
+void raster_destroy(RasterFrame *f)
+{
+    if (!f)
+        return;
+    free(f->color);
+    free(f->depth);
+    delete f;
+}
+
+bool raster_begin(RasterFrame *f, int width, int height, const GLfloat clip[16], const GLfloat clear[4])
+{
+    if (width <= 0 || height <= 0 || width > RASTER_MAX_SIZE || height > RASTER_MAX_SIZE)
+        return false;
+    int pitch = (width + 3) & ~3;
+    size_t pixels = (size_t)pitch * height;
+    if (pixels > f->capacity) {
+        uint32_t *color = (uint32_t*)realloc(f->color, pixels * sizeof *color);
+        if (!color)
+            return false;
+        f->color = color;
+        float *depth = (float*)realloc(f->depth, pixels * sizeof *depth);
+        if (!depth)
+            return false;
+        f->depth = depth;
+        f->capacity = pixels;
+    }
+
+    f->width = width;
+    f->height = height;
+    f->pitch = pitch;
+    f->tilesX = (width + TileSize - 1) >> TileShift;
+    f->tilesY = (height + TileSize - 1) >> TileShift;
+    memcpy(f->clip, clip, sizeof f->clip);
+    f->guardX = 1 + 2 * GuardBand / width;
+    f->guardY = 1 + 2 * GuardBand / height;
+    std::fill(f->color, f->color + pixels, pack_color(clear));
+    std::fill(f->depth, f->depth + pixels, 1.0f);
+    f->draws.clear();
+    return true;
+}
+
+void raster_draw(RasterFrame *f, const RasterDraw *d)
+{
+    if (primitive_count(*d) > 0)
+        f->draws.push_back(*d);
+}
+
+size_t raster_primitive_bytes(void)
+{
+    // the set up primitive and its entry in a tile, most touch one
+    return sizeof(Prim) + sizeof(unsigned int);
+}
+
+void raster_flush(RasterFrame *f)
+{
+    size_t d = 0;
+    GLsizei first = 0;
+    while (d < f->draws.size()) {
+        // cut the next round of draws into units
+        size_t n = 0, prims = 0;
+        while (d < f->draws.size() && prims < RoundPrimitives) {
+            GLsizei total = primitive_count(f->draws[d]);
+            if (first >= total) {
+                d++;
+                first = 0;
+                continue;
+            }
+            if (n == f->units.size())
+                f->units.resize(n + 1);
+            Unit &u = f->units[n++];
+            u.draw = d;
+            u.first = first;
+            u.count = std::min(total - first, ChunkPrimitives);
+            first += u.count;
+            prims += u.count;
+        }
+        if (n == 0)
+            break;
+
+        f->round = n;
+        run_parallel(f, n, setup_unit);
+        run_parallel(f, (size_t)f->tilesX * f->tilesY, draw_tile);
+    }
+    f->round = 0;
+    f->draws.clear();
+}
+
+void raster_end(RasterFrame *f, void *pixels)
+{
+    raster_flush(f);
+    for (int y = 0; y < f->height; y++)
+        memcpy((unsigned char*)pixels + (size_t)y * f->width * 4, f->color + (size_t)y * f->pitch, (size_t)f->width * 4);
+}
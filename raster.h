@@ -0,0 +1,81 @@
+/*
+ * Tile based software rasterizer, the -backend soft alternative to OSMesa
+ *
+ * It draws what drawAiScene() asks of GL and nothing more: opaque triangles,
+ * lines and points with smooth colors, optionally modulated by one RGB texture
+ * (GL_LINEAR, GL_REPEAT), into a color buffer and a GL_LEQUAL depth buffer.
+ * Lighting is baked into the colors beforehand, two-sided lighting being a
+ * front and a back color per vertex, picked by the side a triangle shows.
+ *
+ * Recorded draws are cut into chunks that threads transform, clip, set up and
+ * sort into 64x64 pixel tiles; then threads take tiles and rasterize them with
+ * SSE2 edge functions four pixels at a time. Within a tile primitives are drawn
+ * in the order they were recorded, so the image doesn't depend on the number
+ * of threads.
+ */
+
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <stddef.h>
+#include "gl_wrap.h"
+
+// an RGB 8 bit texture, the first row at t = 0, as glTexImage2D() takes it
+struct RasterTexture {
+    int width, height;
+    const unsigned char *rgb;
+};
+
+// what to draw, the indices match BatchModes
+enum {
+    RASTER_TRIANGLES,
+    RASTER_LINES,
+    RASTER_POINTS
+};
+
+/* One glDrawArrays() worth of primitives. The arrays are read when the frame
+ * is flushed, they have to stay valid until then. */
+struct RasterDraw {
+    int mode;
+    GLint first;                    // vertex of the arrays
+    GLsizei count;
+    const GLfloat *positions;       // world space, 3 floats per vertex, stride floats apart
+    size_t stride;
+    const GLubyte *front, *back;    // RGBA per vertex of either side of the triangles, NULL for colors
+    const GLfloat *colors;          // RGBA per vertex of both sides, NULL for color
+    GLfloat color[4];
+    const GLfloat *texcoords;       // 2 per vertex, NULL for (0, 0)
+    const RasterTexture *texture;   // modulates the colors, NULL for none
+    bool cullBack;                  // drop triangles that show their back
+    bool wireframe;                 // triangles are drawn as their outlines, like GL_LINE
+};
+
+struct RasterFrame;
+
+// frames keep their buffers from one image to the next, they run on up to threads threads
+RasterFrame *raster_create(int threads);
+void raster_destroy(RasterFrame *f);
+
+// largest image width and height
+enum { RASTER_MAX_SIZE = 8192 };
+
+/* start an image of width x height, cleared to color and depth 1, seen through
+ * the column-major world to clip matrix; false for images that are too large or
+ * out of memory */
+bool raster_begin(RasterFrame *f, int width, int height, const GLfloat clip[16], const GLfloat clear[4]);
+
+// record a draw, it is drawn when the frame is flushed
+void raster_draw(RasterFrame *f, const RasterDraw *d);
+
+/* about the bytes a frame holds per primitive of the draws it flushes, for
+ * sizing what is drawn at once against a memory budget */
+size_t raster_primitive_bytes(void);
+
+// draw everything recorded so far
+void raster_flush(RasterFrame *f);
+
+/* flush and copy the image to pixels, RGBA rows from the bottom up like the
+ * buffer of an OSMesa context */
+void raster_end(RasterFrame *f, void *pixels);
+
+#endif
@@ -24,14 +24,26 @@
 #include "gl_wrap.h"
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
-#include <png++/png.hpp>
+#include "glm/gtc/matrix_inverse.hpp"
+#include "glm/gtc/type_ptr.hpp"
 #include <fstream>
 #include <IL/il.h>
 #include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 #include <GL/glu.h>   
 
 //to map image filenames to textureIds
 #include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
 
 #include <assimp/cimport.h>
 #include "assimp/Importer.hpp"
@@ -39,18 +51,43 @@
 #include <assimp/postprocess.h>
 #include <assimp/DefaultLogger.hpp>
 #include <assimp/LogStream.hpp>
-
-static int Width = 400;
-static int Height = 400;
-
-//////////////////////////////////////////
-char *modelname;
-char *pngname;
-
-GLfloat        camx = 0.0, camy = 1.0, camz = -4.0;
-GLfloat        centerx = 0.0, centery = 0.0, centerz = 0.0;
-GLfloat        upx = 0.0, upy = 1.0, upz = 0.0;
-GLfloat        fovy = 45.0;
+#include <assimp/IOSystem.hpp>
+
+#include "output.h"
+#include "bounds.h"
+#include "cull.h"
+#include "decimate.h"
+#include "lighting.h"
+#include "orient.h"
+#include "raster.h"
+#include "render.h"
+#include "scenecache.h"
+#include "scheduler.h"
+#include "service.h"
+#include "streaming.h"
+#include "texture.h"
+
+// one camera pose of a multi-view run, rendered against the same loaded scene
+struct View {
+    GLfloat camx, camy, camz;
+    GLfloat centerx, centery, centerz;
+    GLfloat upx, upy, upz;
+    GLfloat fovy;
+    GLfloat znear, zfar;    // clip planes, framed views fit them to the scene
+    char *output;    // output filename, NULL to derive it from pngname
+};
+
+// image size and camera of a job that doesn't give its own
+static const int DefaultWidth = 400;
+static const int DefaultHeight = 400;
+static const View DefaultCamera = {
+    0.0f, 1.0f, -4.0f,    // cam
+    0.0f, 0.0f, 0.0f,     // center
+    0.0f, 1.0f, 0.0f,     // up
+    45.0f,                // fovy
+    0.1f, 100.0f,         // znear, zfar
+    NULL
+};
 
 GLfloat LightAmbient[]= { 0.1f, 0.1f, 0.1f, 1.0f };
 GLfloat LightDiffuse[]= { 1.0f, 1.0f, 1.0f, 1.0f };
@@ -64,36 +101,163 @@ GLfloat Light6Position[]= { 15.0f, -15.0f, -15.0f, 1.0f };
 GLfloat Light7Position[]= { -15.0f, -15.0f, 15.0f, 1.0f };
 GLfloat Light8Position[]= { -15.0f, -15.0f, -15.0f, 1.0f };
 
-// the global Assimp scene object
-const aiScene* scene = NULL;
-GLuint scene_list = 0;
-aiVector3D scene_min, scene_max, scene_center;
-
-// images / texture
-std::map<uint32_t, GLuint*> textureIdMap;    // map image filenames to textureIds
-std::map<uint32_t, char*> textureName;    // map image filenames to textureIds
-
-GLuint*        textureIds;                            // pointer to texture Array
+// positions of GL_LIGHT0, GL_LIGHT1, ... all of them with LightAmbient and LightDiffuse
+static const GLfloat *const LightPositions[] = {
+    Light8Position, Light1Position, Light2Position, Light3Position,
+    // Light4Position, Light5Position, Light6Position, Light7Position
+};
+static const int NumLights = sizeof(LightPositions) / sizeof(LightPositions[0]);
 
-// Create an instance of the Importer class
-Assimp::Importer importer;
-
-uint32_t hash(char * s) {
-    uint32_t hash = 0;
+GLuint scene_list = 0;
 
-    for(; *s; ++s)
+// settings of the whole run, set in main() before any job starts
+int renderThreads = 1;     // manifest jobs rendered at the same time, each with its own session
+int coreBudget = -1;       // cores shared by scheduled worker processes, 0 for all, -1 to run jobs in this process
+int viewThreads = 1;       // threads rendering the views of one job
+int textureThreads = 1;    // threads decoding textures, set to the number of CPUs in main()
+int encodeThreads = 1;     // threads deflating large PNGs, set to the number of CPUs in main()
+int maxTextureSize = -1;   // larger textures are scaled down, 0 for no limit, -1 for twice the image size
+int decimateThreads = 1;   // threads simplifying meshes, set to the number of CPUs in main()
+float decimateRatio = 0;   // triangles per pixel meshes are simplified to, 0 to keep every triangle
+int boundsThreads = 1;     // threads reducing the scene bounds, set to the number of CPUs in main()
+unsigned int cullFlags = CULL_FRUSTUM;    // CULL_ steps run on the CPU before drawing
+bool bakeLighting = false;    // light lit batches once per scene on the CPU instead of per vertex in GL
+bool softRaster = false;      // -backend soft: draw with the built-in rasterizer instead of OSMesa
+int rasterThreads = 1;     // threads of the built-in rasterizer, set to the number of CPUs in main()
+
+// flat copy of one aiMesh for glDrawArrays, laid out like a DrawBatch
+struct MeshArrays {
+    std::vector<GLfloat> positions;    // 3 per vertex
+    std::vector<GLfloat> normals;      // 3 per vertex
+    std::vector<GLfloat> texcoords;    // 2 per vertex, empty if the mesh has none
+    std::vector<GLfloat> colors;       // 4 per vertex, empty if the mesh has none
+    GLint first[3];
+    GLsizei count[3];
+    bool closed;                       // the triangles enclose the mesh's volume and face out
+};
+
+const char *cacheDir = NULL;    // compiled scenes are cached here, no caching if NULL
+size_t memoryBudget = 0;        // larger OBJ, OFF, PLY and STL models are streamed, 0 to load every model whole
+
+// plain stdio file, as Assimp's default IO system opens them
+class StdioStream : public Assimp::IOStream {
+public:
+    StdioStream(FILE *fp) : fp(fp) {}
+    ~StdioStream() { fclose(fp); }
+    size_t Read(void *buf, size_t size, size_t count) { return fread(buf, size, count, fp); }
+    size_t Write(const void *buf, size_t size, size_t count) { return fwrite(buf, size, count, fp); }
+    aiReturn Seek(size_t offset, aiOrigin origin)
+    {
+        int whence = origin == aiOrigin_SET ? SEEK_SET : origin == aiOrigin_CUR ? SEEK_CUR : SEEK_END;
+        return fseek(fp, offset, whence) ? aiReturn_FAILURE : aiReturn_SUCCESS;
+    }
+    size_t Tell() const { return ftell(fp); }
+    size_t FileSize() const
     {
-        hash += *s;
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
+        long pos = ftell(fp);
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        fseek(fp, pos, SEEK_SET);
+        return size;
     }
+    void Flush() { fflush(fp); }
+private:
+    FILE *fp;
+};
+
+/* Remembers every file the importer reads besides the model itself (.mtl files
+ * and the like), a cached scene is only valid as long as they are unchanged */
+class RecordingIOSystem : public Assimp::IOSystem {
+public:
+    std::string model;                     // realpath of the model being imported
+    std::vector<std::string> opened;       // realpaths of the other files read
+
+    bool Exists(const char *file) const { return access(file, F_OK) == 0; }
+    char getOsSeparator() const { return '/'; }
+    Assimp::IOStream *Open(const char *file, const char *mode)
+    {
+        FILE *fp = fopen(file, mode);
+        if (!fp)
+            return NULL;
+        char path[PATH_MAX];
+        if (realpath(file, path) && model != path
+            && std::find(opened.begin(), opened.end(), path) == opened.end())
+            opened.push_back(path);
+        return new StdioStream(fp);
+    }
+    void Close(Assimp::IOStream *stream) { delete stream; }
+};
+
+// drawAiScene() state of lit batches drawn in baked colors, next to the BATCH_ flags
+static const unsigned int STATE_BAKED = 1u << 31;
+
+// vertices of one primitive class of a batch drawn with one call
+struct DrawSpan {
+    int mode;    // index into BatchModes
+    GLint first;
+    GLsizei count;
+    bool cull;    // back faces can't be seen, they are culled and lighting is one-sided
+};
+
+// buffers a thread draws from, kept across the views it renders
+struct DrawScratch {
+    float *chunk;                   // a chunk of a streamed model
+    std::vector<GLuint> indices;    // the triangles left after sub-pixel culling
+    std::vector<unsigned char> nodeState;    // BoxVisibility of every node in the current view
+    std::vector<DrawSpan> spans;    // the parts of the current batch in view
+    GLfloat clip[16];               // world to clip space of the current view
+    GLint viewport[4];
+    std::vector<GLfloat> unpacked;  // positions then normals of a streamed chunk, for baking its colors
+    std::vector<GLubyte> colors;    // front then back colors of the chunk
+};
+
+// a context with its own image buffer, sharing the textures of a session's context
+struct ViewContext {
+    OSMesaContext ctx;
+    void *buffer;
+    size_t bufferSize;
+};
+
+/* Everything one job needs, so that several jobs can render at the same time
+ * on their own threads. Each session has its own importer and OSMesa context;
+ * run-wide settings stay global and are only read once jobs run. */
+struct RenderSession {
+    // the job, set by parse_job()
+    int width, height;
+    char *modelname;
+    char *pngname;
+    View camera;                  // the pose given on the command line, the default for listed views
+    std::vector<View> views;
+    OutputOptions output;
+    bool framed;                  // -frame: the camera is placed from the scene bounds once they are known
+    GLfloat frame[3];             // azimuth and elevation in degrees, distance as a multiple of the fitting one
+
+    // the model of the job
+    Assimp::Importer importer;
+    RecordingIOSystem *recordingIO;    // the importer's IO handler while caching, owned by the importer
+    const aiScene *scene;              // NULL when the scene came from the cache
+    CompiledScene compiled;
+    GLuint *textureIds;                // parallel to compiled.textureNames
+    std::vector<Image> images;         // the same textures decoded for the built-in rasterizer, data NULL if missing
+    std::vector<RasterTexture> rasterTextures;    // parallel to images
+    bool streaming;                    // the model is too large to load, it is drawn from streamed instead
+    StreamedModel streamed;
+    aiVector3D scene_min, scene_max, scene_center;    // world space bounds, min > max for an empty scene
+
+    // the context and the image buffer it renders into, grown as needed
+    OSMesaContext ctx;                 // NULL with the built-in rasterizer
+    void *buffer;
+    size_t bufferSize;
+    RasterFrame *raster;               // the built-in rasterizer's buffers, created when first needed
 
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
+    // contexts rendering views of the job next to ctx, created when first needed
+    std::vector<ViewContext> viewContexts;
 
-    return hash;
-}
+    JobStats stats;    // of the last job
+};
+
+// DevIL keeps the bound image in global state
+static pthread_mutex_t devilLock = PTHREAD_MUTEX_INITIALIZER;
 
 /* return a new string with every instance of ch replaced by repl */
 char *replace(const char *s, char ch, const char *repl) {
@@ -117,7 +281,158 @@ char *replace(const char *s, char ch, const char *repl) {
     return res;
 }
 
-bool Import3DFromFile( const char * pFile)
+// Assimp post-processing steps by name, in the order Assimp runs them
+struct ImportStep {
+    const char *name;
+    unsigned int flag;
+};
+
+static const ImportStep ImportSteps[] = {
+    { "ValidateDataStructure",    aiProcess_ValidateDataStructure },
+    { "RemoveComponent",          aiProcess_RemoveComponent },
+    { "RemoveRedundantMaterials", aiProcess_RemoveRedundantMaterials },
+    { "FindInstances",            aiProcess_FindInstances },
+    { "OptimizeGraph",            aiProcess_OptimizeGraph },
+    { "OptimizeMeshes",           aiProcess_OptimizeMeshes },
+    { "FindDegenerates",          aiProcess_FindDegenerates },
+    { "GenUVCoords",              aiProcess_GenUVCoords },
+    { "TransformUVCoords",        aiProcess_TransformUVCoords },
+    { "PreTransformVertices",     aiProcess_PreTransformVertices },
+    { "Triangulate",              aiProcess_Triangulate },
+    { "SortByPType",              aiProcess_SortByPType },
+    { "FindInvalidData",          aiProcess_FindInvalidData },
+    { "FixInfacingNormals",       aiProcess_FixInfacingNormals },
+    { "SplitByBoneCount",         aiProcess_SplitByBoneCount },
+    { "SplitLargeMeshes",         aiProcess_SplitLargeMeshes },
+    { "GenNormals",               aiProcess_GenNormals },
+    { "GenSmoothNormals",         aiProcess_GenSmoothNormals },
+    { "CalcTangentSpace",         aiProcess_CalcTangentSpace },
+    { "JoinIdenticalVertices",    aiProcess_JoinIdenticalVertices },
+    { "MakeLeftHanded",           aiProcess_MakeLeftHanded },
+    { "FlipUVs",                  aiProcess_FlipUVs },
+    { "FlipWindingOrder",         aiProcess_FlipWindingOrder },
+    { "Debone",                   aiProcess_Debone },
+    { "LimitBoneWeights",         aiProcess_LimitBoneWeights },
+    { "ImproveCacheLocality",     aiProcess_ImproveCacheLocality },
+};
+
+/* The renderer computes its own flat normals and flattens the node tree, so a
+ * preview only needs polygons split into triangles and non-UV texture mappings
+ * turned into texture coordinates */
+#define IMPORT_FAST (aiProcess_Triangulate | aiProcess_GenUVCoords)
+#define IMPORT_QUALITY aiProcessPreset_TargetRealtime_Quality
+
+// post-processing applied on import, part of the scene cache key
+unsigned int importFlags = IMPORT_QUALITY;
+bool importTiming = false;    // run and time the post-processing steps one by one
+
+/* parse an import profile: "fast", "quality" or a comma separated list of
+ * step names, false for an unknown name */
+static bool
+parse_import_profile(const char *profile, unsigned int *flags)
+{
+    if (!strcmp(profile, "fast")) {
+        *flags = IMPORT_FAST;
+        return true;
+    }
+    if (!strcmp(profile, "quality")) {
+        *flags = IMPORT_QUALITY;
+        return true;
+    }
+
+    *flags = 0;
+    const char *name = profile;
+    while (*name) {
+        size_t len = strcspn(name, ",");
+        size_t i;
+        for (i = 0; i < sizeof(ImportSteps) / sizeof(ImportSteps[0]); i++)
+            if (strlen(ImportSteps[i].name) == len && !strncasecmp(ImportSteps[i].name, name, len))
+                break;
+        if (i == sizeof(ImportSteps) / sizeof(ImportSteps[0])) {
+            fprintf(stderr, "Unknown import step: %.*s\n", (int)len, name);
+            return false;
+        }
+        *flags |= ImportSteps[i].flag;
+        name += len + (name[len] == ',');
+    }
+    return true;
+}
+
+// the -cull steps
+static const struct {
+    const char *name;
+    unsigned int flag;
+} CullSteps[] = {
+    { "frustum", CULL_FRUSTUM },
+    { "subpixel", CULL_SUBPIXEL },
+    { "backface", CULL_BACKFACE },
+    { "none", 0 }
+};
+
+/* parse a comma separated list of culling steps, false for an unknown name */
+static bool
+parse_cull_steps(const char *steps, unsigned int *flags)
+{
+    *flags = 0;
+    const char *name = steps;
+    while (*name) {
+        size_t len = strcspn(name, ",");
+        size_t i;
+        for (i = 0; i < sizeof(CullSteps) / sizeof(CullSteps[0]); i++)
+            if (strlen(CullSteps[i].name) == len && !strncmp(CullSteps[i].name, name, len))
+                break;
+        if (i == sizeof(CullSteps) / sizeof(CullSteps[0])) {
+            fprintf(stderr, "Unknown culling step: %.*s\n", (int)len, name);
+            return false;
+        }
+        *flags |= CullSteps[i].flag;
+        name += len + (name[len] == ',');
+    }
+    return true;
+}
+
+static double
+seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Read the file without post-processing, then apply the steps of importFlags one
+ * at a time and print what each of them cost. Steps that share data in a single
+ * ReadFile() call (the spatial sort for normals and vertex joining) rebuild it
+ * here, so the sum can be slightly above a plain import. */
+static const aiScene *
+read_file_timed(Assimp::Importer *importer, const char *pFile)
+{
+    // the report is printed at once, so jobs on other threads don't cut into it
+    std::string report;
+    char line[1200];
+
+    double start = seconds();
+    const aiScene *sc = importer->ReadFile(pFile, 0);
+    double t = seconds();
+    snprintf(line, sizeof(line), "import %s\n  read %0.3fs\n", pFile, t - start);
+    report += line;
+
+    for (size_t i = 0; sc && i < sizeof(ImportSteps) / sizeof(ImportSteps[0]); i++) {
+        if (!(importFlags & ImportSteps[i].flag))
+            continue;
+        double t0 = seconds();
+        sc = importer->ApplyPostProcessing(ImportSteps[i].flag);
+        t = seconds();
+        snprintf(line, sizeof(line), "  %s %0.3fs\n", ImportSteps[i].name, t - t0);
+        report += line;
+    }
+
+    snprintf(line, sizeof(line), "  total %0.3fs\n", t - start);
+    report += line;
+    fputs(report.c_str(), stdout);
+    return sc;
+}
+
+bool Import3DFromFile(RenderSession *s, const char * pFile)
 {
     // Check if file exists
     std::ifstream fin(pFile);
@@ -131,10 +446,13 @@ bool Import3DFromFile( const char * pFile)
         return false;
     }
 
-    scene = importer.ReadFile( pFile, aiProcessPreset_TargetRealtime_Quality);
+    if (importTiming)
+        s->scene = read_file_timed(&s->importer, pFile);
+    else
+        s->scene = s->importer.ReadFile( pFile, importFlags);
 
     // If the import failed, report it
-    if( !scene)
+    if( !s->scene)
     {
         return false;
     }
@@ -147,125 +465,175 @@ bool Import3DFromFile( const char * pFile)
     return true;
 }
 
-int LoadGLTextures(const aiScene * scene)
+// DevIL is initialized once per process, not once per model
+bool InitDevIL()
 {
-    ILboolean success;
-
     /* Before calling ilInit() version should be checked. */
     if (ilGetInteger(IL_VERSION_NUM) < IL_VERSION)
     {
         /// wrong DevIL version ///
-        char err_msg[] = "Wrong DevIL version. Old devil.dll in system32/SysWow64?";
-        return -1;
+        fprintf(stderr, "Wrong DevIL version.\n");
+        return false;
     }
 
     ilInit(); /* Initialization of DevIL */
+    return true;
+}
 
-    // if (scene->HasTextures()) abortGLInit("Support for meshes with embedded textures is not implemented");
+static void
+upload_texture(GLuint texId, GLint components, int width, int height, GLenum format, const void *data)
+{
+    // Binding of texture name
+    glBindTexture(GL_TEXTURE_2D, texId); 
+    // redefine standard texture values
+    // We will use linear interpolation for magnification filter
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+    // We will use linear interpolation for minifying filter
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+    // Texture specification
+    glTexImage2D(GL_TEXTURE_2D, 0, components, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+}
 
-    /* getTexture Filenames and Numb of Textures */
-    for (unsigned int m=0; m<scene->mNumMaterials; m++)
-    {
-        int texIndex = 0;
-        aiReturn texFound = AI_SUCCESS;
+// formats the threaded decoders don't handle go through DevIL on this thread
+static bool
+load_devil_image(const char *fileloc, int maxSize, Image *img)
+{
+    ILuint imageId;
+    ILboolean success;
 
-        aiString path;    // filename
+    pthread_mutex_lock(&devilLock);
+    ilGenImages(1, &imageId);
+    ilBindImage(imageId); /* Binding of DevIL image name */
+    success = ilLoadImage(fileloc);
 
-        while (true)
+    if (success) /* If no error occured: */
+    {
+        // Convert every colour component into unsigned byte.If your image contains 
+        // alpha channel you can replace IL_RGB with IL_RGBA
+        success = ilConvertImage(IL_RGB, IL_UNSIGNED_BYTE);
+        int width = ilGetInteger(IL_IMAGE_WIDTH), height = ilGetInteger(IL_IMAGE_HEIGHT);
+        if (success && !downscale_image(ilGetData(), width, height, maxSize, img))
         {
-            texFound = scene->mMaterials[m]->GetTexture(aiTextureType_DIFFUSE, texIndex, &path);
-            if (texFound != AI_SUCCESS)
-                break;
-            
-            char * filename_unix = replace(path.data, '\\', "/");
-            textureIdMap[hash(filename_unix)] = NULL; //fill map with textures, pointers still NULL yet
-            textureName[hash(filename_unix)] = filename_unix; //fill map with textures, pointers still NULL yet
-            texIndex++;
+            size_t size = (size_t)width * height * 3;
+            img->width = width;
+            img->height = height;
+            img->data = (unsigned char*)malloc(size);
+            if (img->data)
+                memcpy(img->data, ilGetData(), size);
+            success = img->data != NULL;
         }
     }
 
+    // the image is copied out, DevIL's copy can go
+    ilDeleteImages(1, &imageId); 
+    pthread_mutex_unlock(&devilLock);
+    return success;
+}
 
-    int numTextures = textureIdMap.size();
-
-    /* array with DevIL image IDs */
-    ILuint* imageIds = NULL;
-    imageIds = new ILuint[numTextures];
-
-    /* generate DevIL Image IDs */
-    ilGenImages(numTextures, imageIds); /* Generation of numTextures image names */
+/* Textures are decoded on textureThreads threads while this thread uploads the
+ * ones that are done, so decoding overlaps with glTexImage2D. The built-in
+ * rasterizer samples the decoded images instead, they are kept in the session. */
+int LoadGLTextures(RenderSession *s)
+{
+    // if (scene->HasTextures()) abortGLInit("Support for meshes with embedded textures is not implemented");
 
-    /* create and fill array with GL texture ids */
-    textureIds = new GLuint[numTextures];
-    glGenTextures(numTextures, textureIds); /* Texture name generation */
+    int numTextures = s->compiled.textureNames.size();
 
-    /* get iterator */
-    std::map<uint32_t, GLuint*>::iterator itr = textureIdMap.begin();
+    if (softRaster) {
+        Image none = { 0, 0, NULL };
+        s->images.assign(numTextures, none);
+    }
+    else {
+        // we also want to be able to deal with odd texture dimensions
+        glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+        glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+        glPixelStorei( GL_UNPACK_SKIP_PIXELS, 0 );
+        glPixelStorei( GL_UNPACK_SKIP_ROWS, 0 );
+
+        /* create and fill array with GL texture ids */
+        s->textureIds = new GLuint[numTextures];
+        glGenTextures(numTextures, s->textureIds); /* Texture name generation */
+    }
 
     char basepath[1000];
-    strcpy(basepath, modelname);
+    strcpy(basepath, s->modelname);
     dirname(basepath);
+
+    std::vector<std::string> fileloc(numTextures);
+    std::vector<const char*> filenames(numTextures);
     for (int i=0; i<numTextures; i++)
     {
+        fileloc[i] = std::string(basepath) + "/" + s->compiled.textureNames[i];
+        filenames[i] = fileloc[i].c_str();
+    }
 
-        //save IL image ID
-        char filename[1000];
-        char * filename_unix = textureName[(*itr).first];
-        (*itr).second =  &textureIds[i];      // save texture id for filename in map
-        itr++;                                  // next texture
+    // a texture can't show more detail than the image has pixels, so unless a
+    // size is given textures are limited to twice the output size
+    int maxSize = maxTextureSize >= 0 ? maxTextureSize : 2 * std::max(s->width, s->height);
 
-        ilBindImage(imageIds[i]); /* Binding of DevIL image name */
-        char fileloc[1000];
-        sprintf(fileloc, "%s/%s", basepath, filename_unix);    /* Loading of image */
-        success = ilLoadImage(fileloc);
+    TextureDecodeQueue *queue = start_texture_decoding(numTextures ? &filenames[0] : NULL, numTextures, textureThreads, maxSize);
 
-        if (success) /* If no error occured: */
+    Image img;
+    int i;
+    while ((i = next_decoded_texture(queue, &img)) >= 0)
+    {
+        if (!img.data && !load_devil_image(filenames[i], maxSize, &img))
         {
-            // Convert every colour component into unsigned byte.If your image contains 
-            // alpha channel you can replace IL_RGB with IL_RGBA
-            success = ilConvertImage(IL_RGB, IL_UNSIGNED_BYTE);
-            if (!success)
-            {
-                /* Error occured */
-                // abortGLInit("Couldn't convert image");
-                return -1;
-            }
-            // Binding of texture name
-            glBindTexture(GL_TEXTURE_2D, textureIds[i]); 
-            // redefine standard texture values
-            // We will use linear interpolation for magnification filter
-            glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-            // We will use linear interpolation for minifying filter
-            glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
-            // Texture specification
-            glTexImage2D(GL_TEXTURE_2D, 0, ilGetInteger(IL_IMAGE_BPP), ilGetInteger(IL_IMAGE_WIDTH),
-                    ilGetInteger(IL_IMAGE_HEIGHT), 0, ilGetInteger(IL_IMAGE_FORMAT), GL_UNSIGNED_BYTE,
-                    ilGetData()); 
-            // we also want to be able to deal with odd texture dimensions
-            glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
-            glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
-            glPixelStorei( GL_UNPACK_SKIP_PIXELS, 0 );
-            glPixelStorei( GL_UNPACK_SKIP_ROWS, 0 );
+            /* Error occured */
+            printf("Couldn't load Image: %s\n", filenames[i]);
         }
+        else if (softRaster)
+            s->images[i] = img;
         else
         {
-            /* Error occured */
-            printf("Couldn't load Image: %s\n", fileloc);
+            upload_texture(s->textureIds[i], 3, img.width, img.height, GL_RGB, img.data);
+            free_image(&img);
         }
     }
-    // Because we have already copied image data into texture data  we can release memory used by image.
-    ilDeleteImages(numTextures, imageIds); 
 
-    // Cleanup
-    delete [] imageIds;
-    imageIds = NULL;
+    finish_texture_decoding(queue);
 
+    s->rasterTextures.resize(s->images.size());
+    for (size_t t = 0; t < s->images.size(); t++) {
+        RasterTexture tex = { s->images[t].width, s->images[t].height, s->images[t].data };
+        s->rasterTextures[t] = tex;
+    }
     return true;
 }
 
-// Can't send color down as a pointer to aiColor4D because AI colors are ABGR.
-void Color4f(const aiColor4D *color)
+// Drop the textures and the scene of the current model, so the next model can be
+// loaded into the same context and importer
+void ReleaseScene(RenderSession *s)
 {
-    glColor4f(color->r, color->g, color->b, color->a);
+    CompiledScene &compiled = s->compiled;
+
+    if (s->textureIds)
+    {
+        glDeleteTextures(compiled.textureNames.size(), s->textureIds);
+        delete[] s->textureIds;
+        s->textureIds = NULL;
+    }
+    for (size_t i = 0; i < s->images.size(); i++)
+        free_image(&s->images[i]);
+    s->images.clear();
+    s->rasterTextures.clear();
+
+    for (size_t i = 0; i < compiled.textureNames.size(); i++)
+        free(compiled.textureNames[i]);
+    compiled.textureNames.clear();
+    compiled.materials.clear();
+    compiled.batches.clear();
+    compiled.ranges.clear();
+    compiled.nodes.clear();
+    std::vector<GLubyte>().swap(compiled.bakedColors);
+    compiled.bakedOffsets.clear();
+    std::vector<GLfloat>().swap(compiled.vertexData);
+    compiled.data = NULL;
+    compiled.dataSize = 0;
+    unmap_scene_cache(&compiled);
+
+    s->importer.FreeScene();
+    s->scene = NULL;
 }
 
 void set_float4(float f[4], float a, float b, float c, float d)
@@ -284,406 +652,2245 @@ void color4_to_float4(const aiColor4D *c, float f[4])
     f[3] = c->a;
 }
 
-void apply_material(const aiMaterial *mtl)
+// Resolve the colors, shininess, fill mode and diffuse texture of every material
+// once per scene, so that drawing never has to query the aiMaterial
+void BuildMaterialTable(CompiledScene *cs, const aiScene *sc)
 {
-    float c[4];
-
-    GLenum fill_mode;
-    int ret1, ret2;
-    aiColor4D diffuse;
-    aiColor4D specular;
-    aiColor4D ambient;
-    aiColor4D emission;
-    float shininess, strength;
-    int two_sided;
-    int wireframe;
-    unsigned int max;    // changed: to unsigned
-
-    int texIndex = 0;
-    aiString texPath;    //contains filename of texture
+    CompiledScene &compiled = *cs;
+    std::map<std::string, int> textureIndex;
 
+    compiled.materials.resize(sc->mNumMaterials);
+    for (unsigned int m = 0; m < sc->mNumMaterials; m++)
     {
-        aiString path;    // filename
-        int texFound = mtl->GetTexture(aiTextureType_DIFFUSE, 0, &path);
-        char * filename_unix = replace(path.data, '\\', "/");
-    }
+        const aiMaterial *mtl = sc->mMaterials[m];
+        MaterialRecord *rec = &compiled.materials[m];
+        aiColor4D color;
+        float shininess, strength;
+        int wireframe;
+        int ret1, ret2;
+        unsigned int max;    // changed: to unsigned
+        aiString texPath;    //contains filename of texture
+
+        rec->texture = -1;
+        if(AI_SUCCESS == mtl->GetTexture(aiTextureType_DIFFUSE, 0, &texPath))
+        {
+            char * filename_unix = replace(texPath.data, '\\', "/");
+            std::map<std::string, int>::iterator itr = textureIndex.find(filename_unix);
+            if (itr == textureIndex.end())
+            {
+                rec->texture = compiled.textureNames.size();
+                textureIndex[filename_unix] = rec->texture;
+                compiled.textureNames.push_back(filename_unix);
+            }
+            else
+            {
+                rec->texture = (*itr).second;
+                free(filename_unix);
+            }
+        }
 
-    if(AI_SUCCESS == mtl->GetTexture(aiTextureType_DIFFUSE, texIndex, &texPath))
-    {
-        //bind texture
-        char * filename_unix = replace(texPath.data, '\\', "/");
-        unsigned int texId = *textureIdMap[hash(filename_unix)];
-        glBindTexture(GL_TEXTURE_2D, texId);
-    }
-
-    set_float4(c, 0.8f, 0.8f, 0.8f, 1.0f);
-    if(AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_DIFFUSE, &diffuse))
-        color4_to_float4(&diffuse, c);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, c);
-
-    set_float4(c, 0.2f, 0.2f, 0.2f, 1.0f);
-    if(AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_SPECULAR, &specular))
-        color4_to_float4(&specular, c);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, c);
-
-    set_float4(c, 0.2f, 0.2f, 0.2f, 1.0f);
-    if(AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_AMBIENT, &ambient))
-        color4_to_float4(&ambient, c);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, c);
-
-    set_float4(c, 0.0f, 0.0f, 0.0f, 1.0f);
-    if(AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_EMISSIVE, &emission))
-        color4_to_float4(&emission, c);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, c);
-
-    max = 1;
-    ret1 = aiGetMaterialFloatArray(mtl, AI_MATKEY_SHININESS, &shininess, &max);
-    max = 1;
-    ret2 = aiGetMaterialFloatArray(mtl, AI_MATKEY_SHININESS_STRENGTH, &strength, &max);
-    if((ret1 == AI_SUCCESS) && (ret2 == AI_SUCCESS))
-        glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, shininess * strength);
-    else {
-        glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 0.0f);
-        set_float4(c, 0.0f, 0.0f, 0.0f, 0.0f);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, c);
+        set_float4(rec->diffuse, 0.8f, 0.8f, 0.8f, 1.0f);
+        if(AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_DIFFUSE, &color))
+            color4_to_float4(&color, rec->diffuse);
+
+        set_float4(rec->specular, 0.2f, 0.2f, 0.2f, 1.0f);
+        if(AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_SPECULAR, &color))
+            color4_to_float4(&color, rec->specular);
+
+        set_float4(rec->ambient, 0.2f, 0.2f, 0.2f, 1.0f);
+        if(AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_AMBIENT, &color))
+            color4_to_float4(&color, rec->ambient);
+
+        set_float4(rec->emission, 0.0f, 0.0f, 0.0f, 1.0f);
+        if(AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_EMISSIVE, &color))
+            color4_to_float4(&color, rec->emission);
+
+        max = 1;
+        ret1 = aiGetMaterialFloatArray(mtl, AI_MATKEY_SHININESS, &shininess, &max);
+        max = 1;
+        ret2 = aiGetMaterialFloatArray(mtl, AI_MATKEY_SHININESS_STRENGTH, &strength, &max);
+        if((ret1 == AI_SUCCESS) && (ret2 == AI_SUCCESS))
+            rec->shininess = shininess * strength;
+        else {
+            rec->shininess = 0.0f;
+            set_float4(rec->specular, 0.0f, 0.0f, 0.0f, 0.0f);
+        }
+
+        max = 1;
+        if(AI_SUCCESS == aiGetMaterialIntegerArray(mtl, AI_MATKEY_ENABLE_WIREFRAME, &wireframe, &max))
+            rec->fill_mode = wireframe ? GL_LINE : GL_FILL;
+        else
+            rec->fill_mode = GL_FILL;
     }
+}
 
-    max = 1;
-    if(AI_SUCCESS == aiGetMaterialIntegerArray(mtl, AI_MATKEY_ENABLE_WIREFRAME, &wireframe, &max))
-        fill_mode = wireframe ? GL_LINE : GL_FILL;
-    else
-        fill_mode = GL_FILL;
-    glPolygonMode(GL_FRONT_AND_BACK, fill_mode);
+// Set the GL state of a material, only what differs from prev (NULL sets everything)
+void apply_material(const MaterialRecord *mtl, const MaterialRecord *prev, const GLuint *textureIds)
+{
+    if (!prev || mtl->texture != prev->texture)
+        glBindTexture(GL_TEXTURE_2D, mtl->texture >= 0 ? textureIds[mtl->texture] : 0);
+
+    if (!prev || memcmp(mtl->diffuse, prev->diffuse, sizeof(mtl->diffuse)))
+        glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, mtl->diffuse);
+    if (!prev || memcmp(mtl->specular, prev->specular, sizeof(mtl->specular)))
+        glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mtl->specular);
+    if (!prev || memcmp(mtl->ambient, prev->ambient, sizeof(mtl->ambient)))
+        glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, mtl->ambient);
+    if (!prev || memcmp(mtl->emission, prev->emission, sizeof(mtl->emission)))
+        glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, mtl->emission);
+    if (!prev || mtl->shininess != prev->shininess)
+        glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, mtl->shininess);
+
+    if (!prev || mtl->fill_mode != prev->fill_mode)
+        glPolygonMode(GL_FRONT_AND_BACK, mtl->fill_mode);
+}
 
-    max = 1;
-    if((AI_SUCCESS == aiGetMaterialIntegerArray(mtl, AI_MATKEY_TWOSIDED, &two_sided, &max)) && two_sided)
-        glEnable(GL_CULL_FACE);
-    else
-        glDisable(GL_CULL_FACE);
 
-    glDisable(GL_CULL_FACE); ///////////////
+/* Meshes are lit when they have faces or normals of their own. Drawing uses
+ * the computed face normals either way, so the lit state must not depend on
+ * whether the import profile generated normals. */
+static bool
+mesh_lit(const struct aiMesh *mesh)
+{
+    return mesh->mNormals != NULL
+        || (mesh->mPrimitiveTypes & (aiPrimitiveType_TRIANGLE | aiPrimitiveType_POLYGON));
 }
 
+static void
+push_vertex(MeshArrays *a, const struct aiMesh *mesh, unsigned int vertexIndex, const GLfloat normal[3])
+{
+    const aiVector3D &p = mesh->mVertices[vertexIndex];
+    a->positions.push_back(p.x);
+    a->positions.push_back(p.y);
+    a->positions.push_back(p.z);
+    a->normals.push_back(normal[0]);
+    a->normals.push_back(normal[1]);
+    a->normals.push_back(normal[2]);
+    if (mesh_lit(mesh) && mesh->HasTextureCoords(0)) {
+        a->texcoords.push_back(mesh->mTextureCoords[0][vertexIndex].x);
+        a->texcoords.push_back(1 - mesh->mTextureCoords[0][vertexIndex].y);
+    }
+    if (mesh->mColors[0] != NULL) {
+        const aiColor4D &c = mesh->mColors[0][vertexIndex];
+        a->colors.push_back(c.r);
+        a->colors.push_back(c.g);
+        a->colors.push_back(c.b);
+        a->colors.push_back(c.a);
+    }
+}
 
-void recursive_render(const struct aiScene * sc, const struct aiNode * nd, float scale)
+/* Flat normal of every face, -normalize(cross(p1-p0, p2-p0)) over the first three
+ * vertices, 3 floats per face. Faces with less than three vertices, zero area or
+ * non-finite positions get a zero normal instead of NaNs. The edges are gathered
+ * into SoA blocks so that the cross products and normalizations run on four faces
+ * at a time. */
+static void
+compute_face_normals(const struct aiMesh *mesh, std::vector<GLfloat> *normals)
 {
-    unsigned int i;
-    unsigned int n=0, t;
-    aiMatrix4x4 m = nd->mTransformation;
+    enum { BLOCK = 256 };
+    float ax[BLOCK], ay[BLOCK], az[BLOCK];    // p1 - p0
+    float bx[BLOCK], by[BLOCK], bz[BLOCK];    // p2 - p0
+    float nx[BLOCK], ny[BLOCK], nz[BLOCK];
+    unsigned int numFaces = mesh->mNumFaces;
+
+    normals->resize(3 * numFaces);
+
+    for (unsigned int start = 0; start < numFaces; start += BLOCK) {
+        unsigned int n = std::min<unsigned int>(BLOCK, numFaces - start);
+        unsigned int i;
+
+        for (i = 0; i < n; i++) {
+            const struct aiFace* face = &mesh->mFaces[start + i];
+            if (face->mNumIndices < 3) {
+                ax[i] = ay[i] = az[i] = bx[i] = by[i] = bz[i] = 0.0f;
+                continue;
+            }
+            const aiVector3D &p0 = mesh->mVertices[face->mIndices[0]];
+            const aiVector3D &p1 = mesh->mVertices[face->mIndices[1]];
+            const aiVector3D &p2 = mesh->mVertices[face->mIndices[2]];
+            ax[i] = p1.x - p0.x; ay[i] = p1.y - p0.y; az[i] = p1.z - p0.z;
+            bx[i] = p2.x - p0.x; by[i] = p2.y - p0.y; bz[i] = p2.z - p0.z;
+        }
 
-    aiMatrix4x4 m2;
-    aiMatrix4x4::Scaling(aiVector3D(scale, scale, scale), m2);
-    m = m * m2;
+        i = 0;
+#ifdef __SSE__
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 inf = _mm_set1_ps(HUGE_VALF);
+        const __m128 minus_one = _mm_set1_ps(-1.0f);
+        for (; i + 4 <= n; i += 4) {
+            __m128 x0 = _mm_loadu_ps(ax + i), y0 = _mm_loadu_ps(ay + i), z0 = _mm_loadu_ps(az + i);
+            __m128 x1 = _mm_loadu_ps(bx + i), y1 = _mm_loadu_ps(by + i), z1 = _mm_loadu_ps(bz + i);
+            __m128 cx = _mm_sub_ps(_mm_mul_ps(y0, z1), _mm_mul_ps(y1, z0));
+            __m128 cy = _mm_sub_ps(_mm_mul_ps(z0, x1), _mm_mul_ps(z1, x0));
+            __m128 cz = _mm_sub_ps(_mm_mul_ps(x0, y1), _mm_mul_ps(x1, y0));
+            __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, cx), _mm_mul_ps(cy, cy)), _mm_mul_ps(cz, cz));
+            // false for zero, infinite and NaN lengths
+            __m128 valid = _mm_and_ps(_mm_cmpgt_ps(len2, zero), _mm_cmplt_ps(len2, inf));
+            __m128 scale = _mm_and_ps(valid, _mm_div_ps(minus_one, _mm_sqrt_ps(len2)));
+            _mm_storeu_ps(nx + i, _mm_mul_ps(cx, scale));
+            _mm_storeu_ps(ny + i, _mm_mul_ps(cy, scale));
+            _mm_storeu_ps(nz + i, _mm_mul_ps(cz, scale));
+        }
+#endif
+        for (; i < n; i++) {
+            float cx = ay[i] * bz[i] - by[i] * az[i];
+            float cy = az[i] * bx[i] - bz[i] * ax[i];
+            float cz = ax[i] * by[i] - bx[i] * ay[i];
+            float len2 = cx * cx + cy * cy + cz * cz;
+            float scale = (len2 > 0.0f && len2 < HUGE_VALF) ? -1.0f / sqrtf(len2) : 0.0f;
+            nx[i] = cx * scale;
+            ny[i] = cy * scale;
+            nz[i] = cz * scale;
+        }
 
-    // update transform
-    m.Transpose();
-    glPushMatrix();
-    glMultMatrixf((float*)&m);
+        GLfloat *out = &(*normals)[3 * start];
+        for (i = 0; i < n; i++) {
+            out[3*i] = nx[i];
+            out[3*i+1] = ny[i];
+            out[3*i+2] = nz[i];
+        }
+    }
+}
 
-    // draw all meshes assigned to this node
-    for (; n < nd->mNumMeshes; ++n)
-    {
-        const struct aiMesh* mesh = scene->mMeshes[nd->mMeshes[n]];
+static void
+build_mesh_arrays(MeshArrays *a, const struct aiMesh *mesh)
+{
+    unsigned int t, i;
+    size_t vertices = 0;
+    std::vector<GLfloat> faceNormals;
+    std::vector<unsigned char> flip(mesh->mNumFaces);
 
-        apply_material(sc->mMaterials[mesh->mMaterialIndex]); 
+    compute_face_normals(mesh, &faceNormals);
+    a->closed = orient_closed_mesh(mesh, flip.empty() ? NULL : &flip[0]);
 
-        if(mesh->mNormals == NULL)
-        {
-            glDisable(GL_LIGHTING);
-        }
-        else
-        {
-            glEnable(GL_LIGHTING);            
-        }
+    for (t = 0; t < mesh->mNumFaces; ++t) {
+        unsigned int n = mesh->mFaces[t].mNumIndices;
+        vertices += n >= 3 ? 3 * (n - 2) : n;
+    }
+    a->positions.reserve(3 * vertices);
+    a->normals.reserve(3 * vertices);
+    if (mesh_lit(mesh) && mesh->HasTextureCoords(0))
+        a->texcoords.reserve(2 * vertices);
+    if (mesh->mColors[0] != NULL)
+        a->colors.reserve(4 * vertices);
 
-        if(mesh->mColors[0] != NULL)
-        {
-            glEnable(GL_COLOR_MATERIAL);
-        }
-        else
-        {
-            glDisable(GL_COLOR_MATERIAL);
-        }
+    // one pass per primitive class keeps each class contiguous
+    for (int k = 0; k < 3; k++) {
+        a->first[k] = a->positions.size() / 3;
 
         for (t = 0; t < mesh->mNumFaces; ++t) {
             const struct aiFace* face = &mesh->mFaces[t];
-            GLenum face_mode;
+            int cls = face->mNumIndices >= 3 ? 0 : face->mNumIndices == 2 ? 1 : 2;
+            if (cls != k || face->mNumIndices == 0)
+                continue;
 
-            switch(face->mNumIndices)
-            {
-                case 1: face_mode = GL_POINTS; break;
-                case 2: face_mode = GL_LINES; break;
-                case 3: face_mode = GL_TRIANGLES; break;
-                default: face_mode = GL_POLYGON; break;
+            const GLfloat *res = &faceNormals[3 * t];
+
+            if (cls != 0) {
+                for (i = 0; i < face->mNumIndices; i++)
+                    push_vertex(a, mesh, face->mIndices[i], res);
+                continue;
             }
 
-            glBegin(face_mode);
-            int v0 = face->mIndices[0];
-            int v1 = face->mIndices[1];
-            int v2 = face->mIndices[2];
-            glm::vec3 p0(mesh->mVertices[v0].x, mesh->mVertices[v0].y, mesh->mVertices[v0].z);
-            glm::vec3 p1(mesh->mVertices[v1].x, mesh->mVertices[v1].y, mesh->mVertices[v1].z);
-            glm::vec3 p2(mesh->mVertices[v2].x, mesh->mVertices[v2].y, mesh->mVertices[v2].z);
-            
-            glm::vec3 res = glm::cross(p1-p0, p2-p0);
-            res = -glm::normalize(res);            
-            
-            for(i = 0; i < face->mNumIndices; i++)        // go through all vertices in face
-            {
-                int vertexIndex = face->mIndices[i];    // get group index for current index
-                if(mesh->mColors[0] != NULL)
-                    Color4f(&mesh->mColors[0][vertexIndex]);
-                if(mesh->mNormals != NULL) 
-                    if(mesh->HasTextureCoords(0))        //HasTextureCoords(texture_coordinates_set)
-                    {
-                        glTexCoord2f(mesh->mTextureCoords[0][vertexIndex].x, 1 - mesh->mTextureCoords[0][vertexIndex].y); //mTextureCoords[channel][vertex]
-                    }
-
-                glNormal3fv(&res[0]);            
-                // glColor3fv(&res[0]);            
-                glVertex3fv(&mesh->mVertices[vertexIndex].x);
+            /* Faces of closed meshes that are wound the wrong way round are
+             * turned over, with the normal negated. With two-sided lighting
+             * either side of the face is lit as before. */
+            GLfloat flipped[3] = { -res[0], -res[1], -res[2] };
+            bool turn = a->closed && flip[t];
+
+            // polygons become a fan around their first vertex
+            for (i = 2; i < face->mNumIndices; i++) {
+                push_vertex(a, mesh, face->mIndices[0], turn ? flipped : res);
+                push_vertex(a, mesh, face->mIndices[turn ? i : i-1], turn ? flipped : res);
+                push_vertex(a, mesh, face->mIndices[turn ? i-1 : i], turn ? flipped : res);
             }
-            glEnd();
         }
-    }
 
-    // draw all children
-    for (n = 0; n < nd->mNumChildren; ++n)
-    {
-        recursive_render(sc, nd->mChildren[n], scale);
+        a->count[k] = a->positions.size() / 3 - a->first[k];
     }
-
-    glPopMatrix();
 }
 
-
-void drawAiScene(const aiScene* scene)
+// Convert every mesh of the scene once after import
+void BuildMeshArrays(const aiScene *sc, std::vector<MeshArrays> *meshArrays)
 {
-    recursive_render(scene, scene->mRootNode, 1);
+    meshArrays->clear();
+    meshArrays->resize(sc->mNumMeshes);
+    for (unsigned int m = 0; m < sc->mNumMeshes; m++)
+        build_mesh_arrays(&(*meshArrays)[m], sc->mMeshes[m]);
 }
 
+// a mesh referenced by a node, with the node's world transform
+struct MeshInstance {
+    unsigned int mesh;
+    unsigned int node;    // index of the node in depth first order
+    glm::mat4 world;
+};
 
-//////////////////////////////////////////
-float camDist = 4.0f;
+static unsigned int
+batch_flags(const CompiledScene &compiled, const struct aiMesh *mesh)
+{
+    unsigned int flags = 0;
+    if (mesh_lit(mesh))
+        flags |= BATCH_LIT;
+    if (mesh->mColors[0] != NULL)
+        flags |= BATCH_COLORED;
+    if (compiled.materials[mesh->mMaterialIndex].texture >= 0)
+        flags |= BATCH_TEXTURED;
+    if (mesh_lit(mesh) && mesh->HasTextureCoords(0))
+        flags |= BATCH_TEXCOORDS;
+    return flags;
+}
 
-// All Setup For OpenGL goes here
-int InitGL(int width, int height)
+static void
+reset_bounds(GLfloat min[3], GLfloat max[3])
 {
-    if (!LoadGLTextures(scene))
-    {
-        return false;
+    for (int k = 0; k < 3; k++) {
+        min[k] = HUGE_VALF;
+        max[k] = -HUGE_VALF;
     }
-
-    glViewport(0, 0, width, height);                    // Reset The Current Viewport
-
-    glMatrixMode(GL_PROJECTION);                        // Select The Projection Matrix
-    glLoadIdentity();                            // Reset The Projection Matrix
-
-    // Calculate The Aspect Ratio Of The Window
-    gluPerspective(fovy,(GLfloat)width/(GLfloat)height,0.1f,100.0f);
-    gluLookAt(camx, camy, camz,
-              centerx, centery, centerz,
-              upx, upy, upz);
-
-    glMatrixMode(GL_MODELVIEW);                        // Select The Modelview Matrix
-    glLoadIdentity();       
-
-    glEnable(GL_TEXTURE_2D);
-    glShadeModel(GL_SMOOTH);         // Enables Smooth Shading
-    glClearColor(0.0f, 0.0f, 1.0f, 1.0f);
-    glClearDepth(1.0f);                // Depth Buffer Setup
-    glEnable(GL_DEPTH_TEST);        // Enables Depth Testing
-    glDepthFunc(GL_LEQUAL);            // The Type Of Depth Test To Do
-    glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);    // Really Nice Perspective Calculation
-
-    glEnable(GL_LIGHTING);
-    glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
-    
-    glEnable(GL_LIGHT0);    // Uses default lighting parameters        
-    glLightfv(GL_LIGHT0, GL_AMBIENT, LightAmbient);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, LightDiffuse);
-    glLightfv(GL_LIGHT0, GL_POSITION, Light8Position);
-    glEnable(GL_NORMALIZE);
-    
-    glEnable(GL_LIGHT1);    
-    glLightfv(GL_LIGHT1, GL_AMBIENT, LightAmbient);
-    glLightfv(GL_LIGHT1, GL_DIFFUSE, LightDiffuse);
-    glLightfv(GL_LIGHT1, GL_POSITION, Light1Position);
-    
-    glEnable(GL_LIGHT2);    
-    glLightfv(GL_LIGHT2, GL_AMBIENT, LightAmbient);
-    glLightfv(GL_LIGHT2, GL_DIFFUSE, LightDiffuse);
-    glLightfv(GL_LIGHT2, GL_POSITION, Light2Position);
-    
-    glEnable(GL_LIGHT3);    
-    glLightfv(GL_LIGHT3, GL_AMBIENT, LightAmbient);
-    glLightfv(GL_LIGHT3, GL_DIFFUSE, LightDiffuse);
-    glLightfv(GL_LIGHT3, GL_POSITION, Light3Position);
-    
-    /*
-    glEnable(GL_LIGHT4);    
-    glLightfv(GL_LIGHT4, GL_AMBIENT, LightAmbient);
-    glLightfv(GL_LIGHT4, GL_DIFFUSE, LightDiffuse);
-    glLightfv(GL_LIGHT4, GL_POSITION, Light4Position);
-    
-    glEnable(GL_LIGHT5);    
-    glLightfv(GL_LIGHT5, GL_AMBIENT, LightAmbient);
-    glLightfv(GL_LIGHT5, GL_DIFFUSE, LightDiffuse);
-    glLightfv(GL_LIGHT5, GL_POSITION, Light5Position);
-    
-    glEnable(GL_LIGHT6);    
-    glLightfv(GL_LIGHT6, GL_AMBIENT, LightAmbient);
-    glLightfv(GL_LIGHT6, GL_DIFFUSE, LightDiffuse);
-    glLightfv(GL_LIGHT6, GL_POSITION, Light6Position);
-    
-    glEnable(GL_LIGHT7);    
-    glLightfv(GL_LIGHT7, GL_AMBIENT, LightAmbient);
-    glLightfv(GL_LIGHT7, GL_DIFFUSE, LightDiffuse);
-    glLightfv(GL_LIGHT7, GL_POSITION, Light7Position); 
-    */
-    
-
-    return true;                    // Initialization Went OK
 }
 
-
 static void
-render_image(void)
+extend_bounds(GLfloat min[3], GLfloat max[3], const GLfloat lo[3], const GLfloat hi[3])
 {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);    // Clear The Screen And The Depth Buffer
-    // glLoadIdentity();                // Reset MV Matrix
-    // glTranslatef(0.0f, 0.0f, -camDist);    // Move 40 Units And Into The Screen
-
-    drawAiScene(scene);
-
-    /* This is very important!!!
-     * Make sure buffered commands are finished!!!
-     */
-    glFinish();
+    for (int k = 0; k < 3; k++) {
+        min[k] = std::min(min[k], lo[k]);
+        max[k] = std::max(max[k], hi[k]);
+    }
 }
 
-    int
-main(int argc, char *argv[])
+/* walk the node tree once and collect every mesh reference with its world
+ * matrix, and a node with empty bounds for every node, depth first */
+static void
+collect_instances(const struct aiNode *nd, const glm::mat4 &parent, unsigned int parentIndex,
+                  std::vector<MeshInstance> *out, std::vector<BoundsNode> *nodes)
 {
-    OSMesaContext ctx;
-    void *buffer;
-
-    if (argc < 3) {
-        fprintf(stderr, "Usage:\n");
-        fprintf(stderr, "  render modelname pngname [width height] [camx camy camz] [centerx centerz centerz] [upx upy upz] [fovy]\n");
-        fprintf(stderr, "Default: width=%d height=%d cam=[%0.4f %0.4f %0.4f] center=[%0.4f %0.4f %0.4f] up=[%0.4f %0.4f %0.4f] fovy=%0.4f\n", Width, Height, camx, camy, camz, centerx, centery, centerz, upx, upy, upz, fovy);
-        return 0;
+    // aiMatrix4x4 is row major, glm is column major
+    glm::mat4 world = parent * glm::transpose(glm::make_mat4(&nd->mTransformation.a1));
+
+    BoundsNode bn;
+    bn.parent = parentIndex;
+    reset_bounds(bn.min, bn.max);
+    unsigned int index = nodes->size();
+    nodes->push_back(bn);
+
+    for (unsigned int n = 0; n < nd->mNumMeshes; ++n) {
+        MeshInstance inst;
+        inst.mesh = nd->mMeshes[n];
+        inst.node = index;
+        inst.world = world;
+        out->push_back(inst);
     }
 
-    modelname = argv[1];
-    pngname = argv[2];
-
-    if (argc >= 5) {
-        Width = atoi(argv[3]);
-        Height = atoi(argv[4]);
-    }
+    for (unsigned int n = 0; n < nd->mNumChildren; ++n)
+        collect_instances(nd->mChildren[n], world, index, out, nodes);
+}
 
-    if (argc >= 8) {
-        camx = atoi(argv[5]);
-        camy = atoi(argv[6]);
-        camz = atoi(argv[7]);
+/* append primitive class k of a mesh to the batch, transformed to world space,
+ * range gets the vertices and their bounds. A mirroring transform turns the
+ * triangles of a closed mesh inside out, they are turned over again. */
+static void
+append_instance(MeshArrays *b, const MeshArrays &a, const glm::mat4 &world, int k, DrawRange *range)
+{
+    glm::mat3 normalMatrix = glm::inverseTranspose(glm::mat3(world));
+    GLint first = a.first[k];
+    GLsizei count = a.count[k];
+    bool turn = k == 0 && a.closed && glm::determinant(glm::mat3(world)) < 0;
+
+    range->first = b->positions.size() / 3;
+    range->count = count;
+    reset_bounds(range->min, range->max);
+    for (GLsizei i = 0; i < count; i++) {
+        // the second and third vertex of every triangle swap places when turning
+        GLsizei v = first + (turn && i % 3 ? i + 3 - 2 * (i % 3) : i);
+        glm::vec4 p = world * glm::vec4(a.positions[3*v], a.positions[3*v+1], a.positions[3*v+2], 1.0f);
+        const GLfloat q[3] = { p.x, p.y, p.z };
+        extend_bounds(range->min, range->max, q, q);
+        glm::vec3 nrm = normalMatrix * glm::vec3(a.normals[3*v], a.normals[3*v+1], a.normals[3*v+2]);
+        if (turn)
+            nrm = -nrm;
+        b->positions.push_back(p.x);
+        b->positions.push_back(p.y);
+        b->positions.push_back(p.z);
+        b->normals.push_back(nrm.x);
+        b->normals.push_back(nrm.y);
+        b->normals.push_back(nrm.z);
+        if (!a.texcoords.empty())
+            b->texcoords.insert(b->texcoords.end(), a.texcoords.begin() + 2*v, a.texcoords.begin() + 2*(v + 1));
+        if (!a.colors.empty())
+            b->colors.insert(b->colors.end(), a.colors.begin() + 4*v, a.colors.begin() + 4*(v + 1));
     }
+}
 
-    if (argc >= 11) {
-        centerx = atoi(argv[8]);
-        centery = atoi(argv[9]);
-        centerz = atoi(argv[10]);
+struct InstanceOrder {
+    const aiScene *sc;
+    const std::vector<MeshInstance> *instances;
+    const std::vector<unsigned int> *flags;    // batch_flags() per mesh
+    // by state first so that lighting and color material toggle as rarely as possible
+    bool operator()(unsigned int i, unsigned int j) const {
+        unsigned int mi = (*instances)[i].mesh, mj = (*instances)[j].mesh;
+        if ((*flags)[mi] != (*flags)[mj])
+            return (*flags)[mi] < (*flags)[mj];
+        return sc->mMeshes[mi]->mMaterialIndex < sc->mMeshes[mj]->mMaterialIndex;
     }
+};
 
-    if (argc >= 14) {
-        upx = atoi(argv[11]);
-        upy = atoi(argv[12]);
-        upz = atoi(argv[13]);
-    }
-        
-    if (argc >= 15) {
-        fovy = atoi(argv[14]);
-    }
+// meshes are never simplified below this many triangles
+static const unsigned int MinDecimatedFaces = 64;
 
-    if (!Import3DFromFile(modelname)) {
-        fprintf(stderr, "model cannot be loaded!\n");
-        return 0;
-    }    
+// world to clip space of view v, the same projection SetupView() gets from gluPerspective() and gluLookAt()
+static glm::mat4
+view_clip(const RenderSession *s, const View &v)
+{
+    return glm::perspective(glm::radians(v.fovy), (float)s->width / s->height, v.znear, v.zfar)
+        * glm::lookAt(glm::vec3(v.camx, v.camy, v.camz), glm::vec3(v.centerx, v.centery, v.centerz), glm::vec3(v.upx, v.upy, v.upz));
+}
 
-    /* Create an RGBA-mode context */
-#if OSMESA_MAJOR_VERSION * 100 + OSMESA_MINOR_VERSION >= 305
-    /* specify Z, stencil, accum sizes */
-    ctx = OSMesaCreateContextExt( OSMESA_RGBA, 16, 0, 0, NULL );
-#else
-    ctx = OSMesaCreateContext( OSMESA_RGBA, NULL );
-#endif
-    if (!ctx) {
-        printf("OSMesaCreateContext failed!\n");
-        return 0;
+/* pixels of the image covered by the bounds of a mesh instance in view v, all
+ * of them if the bounds reach behind the camera */
+static double
+projected_pixels(const RenderSession *s, const View &v, const glm::mat4 &world, const aiVector3D &lo, const aiVector3D &hi)
+{
+    glm::mat4 clip = view_clip(s, v) * world;
+
+    float x0 = HUGE_VALF, x1 = -HUGE_VALF, y0 = HUGE_VALF, y1 = -HUGE_VALF;
+    for (int i = 0; i < 8; i++) {
+        glm::vec4 p = clip * glm::vec4(i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y, i & 4 ? hi.z : lo.z, 1.0f);
+        if (p.w <= 0)
+            return (double)s->width * s->height;
+        x0 = std::min(x0, p.x / p.w);
+        x1 = std::max(x1, p.x / p.w);
+        y0 = std::min(y0, p.y / p.w);
+        y1 = std::max(y1, p.y / p.w);
     }
-
-    /* Allocate the image buffer */
-    buffer = malloc( Width * Height * 4 * sizeof(GLubyte) );
-    if (!buffer) {
-        printf("Alloc image buffer failed!\n");
+    x0 = std::max(x0, -1.0f); x1 = std::min(x1, 1.0f);
+    y0 = std::max(y0, -1.0f); y1 = std::min(y1, 1.0f);
+    if (x1 <= x0 || y1 <= y0)
         return 0;
-    }
+    return (x1 - x0) / 2 * s->width * (y1 - y0) / 2 * s->height;
+}
 
-    /* Bind the buffer to the context and make it current */
-    if (!OSMesaMakeCurrent( ctx, buffer, GL_UNSIGNED_BYTE, Width, Height )) {
-        printf("OSMesaMakeCurrent failed!\n");
-        return 0;
+/* Simplify every mesh of the imported scene to decimateRatio triangles per
+ * pixel its bounds cover in the view of the job where it is largest, so that a
+ * dense model costs about as much as the image it is drawn to. The meshes are
+ * simplified in place on decimateThreads threads. */
+static void
+DecimateScene(RenderSession *s)
+{
+    // the importer owns the scene, changing it is what its own post-processing does too
+    aiScene *sc = const_cast<aiScene*>(s->scene);
+    std::vector<aiVector3D> lo(sc->mNumMeshes), hi(sc->mNumMeshes);
+    unsigned int before = 0, after = 0;
+    for (unsigned int m = 0; m < sc->mNumMeshes; m++) {
+        const aiMesh *mesh = sc->mMeshes[m];
+        lo[m] = aiVector3D(HUGE_VALF, HUGE_VALF, HUGE_VALF);
+        hi[m] = aiVector3D(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF);
+        for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
+            const aiVector3D &p = mesh->mVertices[i];
+            lo[m] = aiVector3D(std::min(lo[m].x, p.x), std::min(lo[m].y, p.y), std::min(lo[m].z, p.z));
+            hi[m] = aiVector3D(std::max(hi[m].x, p.x), std::max(hi[m].y, p.y), std::max(hi[m].z, p.z));
+        }
+        before += mesh->mNumFaces;
     }
 
-    {
-        int z, s, a;
-        glGetIntegerv(GL_DEPTH_BITS, &z);
-        glGetIntegerv(GL_STENCIL_BITS, &s);
-        glGetIntegerv(GL_ACCUM_RED_BITS, &a);
-        printf("Depth=%d Stencil=%d Accum=%d\n", z, s, a);
+    std::vector<MeshInstance> instances;
+    std::vector<BoundsNode> nodes;
+    collect_instances(sc->mRootNode, glm::mat4(1.0f), NoParent, &instances, &nodes);
+    std::vector<double> pixels(sc->mNumMeshes, 0.0);
+    for (size_t i = 0; i < instances.size(); i++) {
+        unsigned int m = instances[i].mesh;
+        if (sc->mMeshes[m]->mNumVertices == 0)
+            continue;
+        for (size_t v = 0; v < s->views.size(); v++)
+            pixels[m] = std::max(pixels[m], projected_pixels(s, s->views[v], instances[i].world, lo[m], hi[m]));
     }
 
-    InitGL(Width, Height);
-    render_image();
+    std::vector<unsigned int> targets(sc->mNumMeshes);
+    for (unsigned int m = 0; m < sc->mNumMeshes; m++)
+        targets[m] = (unsigned int)std::min<double>(UINT_MAX, std::max<double>(MinDecimatedFaces, decimateRatio * pixels[m]));
+    decimate_meshes(sc->mMeshes, &targets[0], sc->mNumMeshes, decimateThreads);
 
-    if (pngname != NULL) {
-        png::image< png::rgba_pixel > image(Width, Height);
-        GLubyte * p_buffer = (GLubyte*)buffer;
-        for (png::uint_32 y = 0; y < Height; ++y)
-        {
-            for (png::uint_32 x = 0; x < Width; ++x)
-            {
-                png::uint_32 r, g, b, a;
-                r = *(p_buffer++);
-                g = *(p_buffer++);
-                b = *(p_buffer++);
-                a = *(p_buffer++);
-                image[Height-1-y][x] = png::rgba_pixel(r, g, b, a);
+    for (unsigned int m = 0; m < sc->mNumMeshes; m++)
+        after += sc->mMeshes[m]->mNumFaces;
+    if (after < before)
+        printf("Decimated %s: %u of %u faces kept\n", s->modelname, after, before);
+}
+
+// Flatten the scene into world space batches, one per (state, material)
+void CompileScene(CompiledScene *cs, const aiScene *sc)
+{
+    CompiledScene &compiled = *cs;
+    std::vector<MeshArrays> meshArrays;    // one per scene->mMeshes entry
+
+    BuildMaterialTable(cs, sc);
+    BuildMeshArrays(sc, &meshArrays);
+
+    std::vector<MeshInstance> instances;
+    compiled.nodes.clear();
+    collect_instances(sc->mRootNode, glm::mat4(1.0f), NoParent, &instances, &compiled.nodes);
+
+    std::vector<unsigned int> flags(sc->mNumMeshes);
+    for (unsigned int m = 0; m < sc->mNumMeshes; m++)
+        flags[m] = batch_flags(compiled, sc->mMeshes[m]) | (meshArrays[m].closed ? BATCH_CLOSED : 0);
+
+    std::vector<unsigned int> order(instances.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    InstanceOrder cmp = { sc, &instances, &flags };
+    std::stable_sort(order.begin(), order.end(), cmp);
+
+    compiled.batches.clear();
+    compiled.ranges.clear();
+    compiled.vertexData.clear();
+    size_t i = 0;
+    while (i < order.size()) {
+        // the run of instances sharing a state and material
+        size_t j = i + 1;
+        while (j < order.size() && !cmp(order[i], order[j]))
+            j++;
+
+        const struct aiMesh *mesh = sc->mMeshes[instances[order[i]].mesh];
+        DrawBatch b;
+        MeshArrays arrays;
+        b.material = mesh->mMaterialIndex;
+        b.flags = flags[instances[order[i]].mesh];
+
+        size_t vertices = 0;
+        for (size_t r = i; r < j; r++)
+            vertices += meshArrays[instances[order[r]].mesh].positions.size() / 3;
+        arrays.positions.reserve(3 * vertices);
+        arrays.normals.reserve(3 * vertices);
+
+        for (int k = 0; k < 3; k++) {
+            b.first[k] = arrays.positions.size() / 3;
+            b.firstRange[k] = compiled.ranges.size();
+            for (size_t r = i; r < j; r++) {
+                const MeshInstance &inst = instances[order[r]];
+                DrawRange range;
+                append_instance(&arrays, meshArrays[inst.mesh], inst.world, k, &range);
+                range.node = inst.node;
+                if (range.count) {
+                    compiled.ranges.push_back(range);
+                    extend_bounds(compiled.nodes[inst.node].min, compiled.nodes[inst.node].max, range.min, range.max);
+                }
             }
+            b.count[k] = arrays.positions.size() / 3 - b.first[k];
+            b.rangeCount[k] = compiled.ranges.size() - b.firstRange[k];
         }
-        image.write(pngname);
+
+        // move the attributes into the scene's vertex data
+        std::vector<GLfloat> &data = compiled.vertexData;
+        b.vertices = arrays.positions.size() / 3;
+        b.positions = data.size();
+        data.insert(data.end(), arrays.positions.begin(), arrays.positions.end());
+        b.normals = data.size();
+        data.insert(data.end(), arrays.normals.begin(), arrays.normals.end());
+        b.texcoords = data.size();
+        data.insert(data.end(), arrays.texcoords.begin(), arrays.texcoords.end());
+        b.colors = data.size();
+        data.insert(data.end(), arrays.colors.begin(), arrays.colors.end());
+        compiled.batches.push_back(b);
+
+        i = j;
     }
-    else {
-        printf("Specify a filename if you want to make an image file\n");
+
+    // children come after their parents, so one backward pass sums up the bounds
+    for (size_t n = compiled.nodes.size(); n-- > 1; ) {
+        BoundsNode &node = compiled.nodes[n];
+        BoundsNode &parent = compiled.nodes[node.parent];
+        extend_bounds(parent.min, parent.max, node.min, node.max);
     }
 
-    printf("all done\n");
+    compiled.data = compiled.vertexData.empty() ? NULL : &compiled.vertexData[0];
+    compiled.dataSize = compiled.vertexData.size();
+}
 
-    /* free the image buffer */
-    free( buffer );
+// the lights InitGLState() sets up, with GL's defaults for what it leaves alone
+static void
+light_rig(LightRig *rig)
+{
+    rig->count = NumLights;
+    for (int i = 0; i < NumLights; i++) {
+        for (int k = 0; k < 3; k++)
+            rig->position[i][k] = LightPositions[i][k];
+        for (int c = 0; c < 4; c++) {
+            rig->ambient[i][c] = LightAmbient[c];
+            rig->diffuse[i][c] = LightDiffuse[c];
+            // only GL_LIGHT0 has a specular color by default
+            rig->specular[i][c] = i == 0 || c == 3 ? 1.0f : 0.0f;
+        }
+    }
+    set_float4(rig->modelAmbient, 0.2f, 0.2f, 0.2f, 1.0f);
+}
 
-    // *** cleanup ***
-    textureIdMap.clear(); //no need to delete pointers in it manually here. (Pointers point to textureIds deleted in next step)
-    textureName.clear(); //no need to delete pointers in it manually here. (Pointers point to textureIds deleted in next step)
+static void
+lit_material(const MaterialRecord &mtl, LitMaterial *m)
+{
+    memcpy(m->ambient, mtl.ambient, sizeof(m->ambient));
+    memcpy(m->diffuse, mtl.diffuse, sizeof(m->diffuse));
+    memcpy(m->specular, mtl.specular, sizeof(m->specular));
+    memcpy(m->emission, mtl.emission, sizeof(m->emission));
+    // GL rejects shininess outside of [0, 128]
+    m->shininess = std::min(std::max(mtl.shininess, 0.0f), 128.0f);
+}
 
-    if (textureIds)
-    {
-        delete[] textureIds;
-        textureIds = NULL;
+/* Light the vertices of every lit batch once, both sides, with the material
+ * of the batch or its vertex colors. The light rig is fixed in world space
+ * and the viewer is at infinity, so the colors hold for every view. */
+static void
+BakeLighting(CompiledScene *cs)
+{
+    CompiledScene &compiled = *cs;
+    LightRig rig;
+    light_rig(&rig);
+
+    size_t size = 0;
+    compiled.bakedOffsets.resize(compiled.batches.size());
+    for (size_t i = 0; i < compiled.batches.size(); i++) {
+        compiled.bakedOffsets[i] = size;
+        if (compiled.batches[i].flags & BATCH_LIT)
+            size += 8 * compiled.batches[i].vertices;
+    }
+    compiled.bakedColors.resize(size);
+
+    for (size_t i = 0; i < compiled.batches.size(); i++) {
+        const DrawBatch &b = compiled.batches[i];
+        if (!(b.flags & BATCH_LIT) || b.vertices == 0)
+            continue;
+        LitMaterial m;
+        lit_material(compiled.materials[b.material], &m);
+
+        GLubyte *front = &compiled.bakedColors[compiled.bakedOffsets[i]];
+        bake_lighting(&rig, &m, compiled.data + b.positions, compiled.data + b.normals,
+                      (b.flags & BATCH_COLORED) ? compiled.data + b.colors : NULL, b.vertices, front, front + 4 * b.vertices);
+    }
+}
+
+// the camera of the current view, for culling
+static void
+load_view_clip(DrawScratch *scratch)
+{
+    // the camera is part of the projection matrix, the modelview stays identity
+    glGetFloatv(GL_PROJECTION_MATRIX, scratch->clip);
+    glGetIntegerv(GL_VIEWPORT, scratch->viewport);
+}
+
+/* The triangles of count vertices from first that are left to draw: with
+ * sub-pixel culling only those that may cover a pixel center of the viewport,
+ * written to scratch->indices unless all of them are left. positions are the
+ * vertex positions stride floats apart. Wireframe materials draw their
+ * triangles as lines, which can light up pixels without covering a center, so
+ * they are culled only when fill is set. Returns the number of triangles. */
+static size_t
+kept_triangles(DrawScratch *scratch, const GLfloat *positions, size_t stride, GLint first, GLsizei count, bool fill)
+{
+    if (!(cullFlags & CULL_SUBPIXEL) || !fill || count == 0)
+        return count / 3;
+
+    std::vector<GLuint> &indices = scratch->indices;
+    indices.resize(count);
+    return cull_subpixel_triangles(scratch->clip, positions + first * stride, stride, count / 3,
+                                   scratch->viewport[2], scratch->viewport[3], first, &indices[0]);
+}
+
+// draw the triangles kept_triangles() left from the enabled arrays
+static void
+draw_kept(const DrawScratch *scratch, GLint first, GLsizei count, size_t kept)
+{
+    if (kept == (size_t)count / 3)
+        glDrawArrays(GL_TRIANGLES, first, count);
+    else if (kept > 0)
+        glDrawElements(GL_TRIANGLES, 3 * kept, GL_UNSIGNED_INT, &scratch->indices[0]);
+}
+
+static void
+draw_triangles(DrawScratch *scratch, const GLfloat *positions, size_t stride, GLint first, GLsizei count, bool fill)
+{
+    draw_kept(scratch, first, count, kept_triangles(scratch, positions, stride, first, count, fill));
+}
+
+/* Where every node of the scene is relative to the view frustum. A node
+ * outside or inside of it has all of its children there as well, so only
+ * the nodes below intersecting ones are tested. */
+static void
+classify_nodes(const CompiledScene &compiled, DrawScratch *scratch)
+{
+    std::vector<unsigned char> &state = scratch->nodeState;
+    state.resize(compiled.nodes.size());
+    for (size_t n = 0; n < compiled.nodes.size(); n++) {
+        const BoundsNode &node = compiled.nodes[n];
+        int parent = node.parent == NoParent ? BOX_INTERSECTS : state[node.parent];
+        state[n] = parent == BOX_INTERSECTS ? box_visibility(scratch->clip, node.min, node.max) : parent;
+    }
+}
+
+/* The runs of vertices of a batch to draw, as (primitive class, first,
+ * count). Without frustum culling that is all of them, otherwise the ranges
+ * of instances that may be in view, with adjacent ones merged. Filled
+ * triangles of closed meshes are back-face culled in the ranges that are
+ * wholly beyond the near plane: the eye is outside of them and can only see
+ * their outside, and the near plane doesn't cut them open. */
+static void
+visible_spans(const CompiledScene &compiled, const DrawBatch &b, DrawScratch *scratch)
+{
+    std::vector<DrawSpan> &spans = scratch->spans;
+    spans.clear();
+    for (int k = 0; k < 3; k++) {
+        if (b.count[k] == 0)
+            continue;
+        bool backface = k == 0 && (cullFlags & CULL_BACKFACE) && (b.flags & BATCH_CLOSED)
+            && compiled.materials[b.material].fill_mode == GL_FILL;
+        if (!(cullFlags & CULL_FRUSTUM) && !backface) {
+            DrawSpan span = { k, b.first[k], b.count[k], false };
+            spans.push_back(span);
+            continue;
+        }
+
+        for (unsigned int r = b.firstRange[k]; r < b.firstRange[k] + b.rangeCount[k]; r++) {
+            const DrawRange &range = compiled.ranges[r];
+            if (cullFlags & CULL_FRUSTUM) {
+                int state = scratch->nodeState[range.node];
+                if (state == BOX_OUTSIDE
+                    || (state == BOX_INTERSECTS && box_visibility(scratch->clip, range.min, range.max) == BOX_OUTSIDE))
+                    continue;
+            }
+            bool cull = backface && box_beyond_near_plane(scratch->clip, range.min, range.max);
+            if (!spans.empty() && spans.back().mode == k && spans.back().cull == cull
+                && spans.back().first + spans.back().count == range.first)
+                spans.back().count += range.count;
+            else {
+                DrawSpan span = { k, range.first, range.count, cull };
+                spans.push_back(span);
+            }
+        }
+    }
+}
+
+void drawAiScene(const CompiledScene &compiled, const GLuint *textureIds, DrawScratch *scratch)
+{
+    const MaterialRecord *material = NULL;
+    unsigned int flags = ~0u;
+    bool culling = false;
+
+    load_view_clip(scratch);
+    if (cullFlags & CULL_FRUSTUM)
+        classify_nodes(compiled, scratch);
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+
+    for (size_t i = 0; i < compiled.batches.size(); i++) {
+        const DrawBatch &b = compiled.batches[i];
+        if (b.vertices == 0)
+            continue;
+
+        // batches out of view don't even change the state
+        visible_spans(compiled, b, scratch);
+        if (scratch->spans.empty())
+            continue;
+
+        // lit batches with baked lighting are drawn unlit, in their baked colors
+        const GLubyte *front = NULL, *back = NULL;
+        unsigned int state = b.flags;
+        if (!compiled.bakedOffsets.empty() && (b.flags & BATCH_LIT)) {
+            front = &compiled.bakedColors[compiled.bakedOffsets[i]];
+            back = front + 4 * b.vertices;
+            state = (state & ~(BATCH_LIT | BATCH_COLORED)) | STATE_BAKED;
+        }
+
+        unsigned int changed = state ^ flags;
+        if (changed & BATCH_LIT) {
+            if (state & BATCH_LIT)
+                glEnable(GL_LIGHTING);
+            else
+                glDisable(GL_LIGHTING);
+        }
+        if (changed & BATCH_COLORED) {
+            if (state & BATCH_COLORED)
+                glEnable(GL_COLOR_MATERIAL);
+            else {
+                glDisable(GL_COLOR_MATERIAL);
+                // the vertex colors replaced the ambient and diffuse color, set all of it again
+                material = NULL;
+            }
+        }
+        if (changed & (BATCH_COLORED | STATE_BAKED)) {
+            if (state & (BATCH_COLORED | STATE_BAKED))
+                glEnableClientState(GL_COLOR_ARRAY);
+            else {
+                glDisableClientState(GL_COLOR_ARRAY);
+                glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+            }
+        }
+        if (changed & BATCH_TEXCOORDS) {
+            if (state & BATCH_TEXCOORDS)
+                glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+            else
+                glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        }
+        flags = state;
+
+        // after GL_COLOR_MATERIAL is off, so that the material colors stick
+        if (material != &compiled.materials[b.material]) {
+            apply_material(&compiled.materials[b.material], material, textureIds);
+            material = &compiled.materials[b.material];
+        }
+
+        glVertexPointer(3, GL_FLOAT, 0, compiled.data + b.positions);
+        glNormalPointer(GL_FLOAT, 0, compiled.data + b.normals);
+        if (state & BATCH_TEXCOORDS)
+            glTexCoordPointer(2, GL_FLOAT, 0, compiled.data + b.texcoords);
+        if (state & BATCH_COLORED)
+            glColorPointer(4, GL_FLOAT, 0, compiled.data + b.colors);
+        if (state & STATE_BAKED)
+            glColorPointer(4, GL_UNSIGNED_BYTE, 0, front);
+
+        for (size_t j = 0; j < scratch->spans.size(); j++) {
+            const DrawSpan &span = scratch->spans[j];
+            if (span.cull != culling) {
+                // front faces are lit the same either way, one side is half the work
+                if (span.cull)
+                    glEnable(GL_CULL_FACE);
+                else
+                    glDisable(GL_CULL_FACE);
+                glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, span.cull ? GL_FALSE : GL_TRUE);
+                culling = span.cull;
+            }
+            if (span.mode != 0)
+                glDrawArrays(BatchModes[span.mode], span.first, span.count);
+            else if (!(state & STATE_BAKED))
+                draw_triangles(scratch, compiled.data + b.positions, 3, span.first, span.count, material->fill_mode == GL_FILL);
+            else {
+                /* Two-sided lighting colors each triangle by the side that is
+                 * seen, so the front colors are drawn with back faces culled
+                 * and the back colors with front faces culled. Spans that
+                 * cull back faces anyway can't show any back face. */
+                size_t kept = kept_triangles(scratch, compiled.data + b.positions, 3, span.first, span.count,
+                                             material->fill_mode == GL_FILL);
+                if (!span.cull)
+                    glEnable(GL_CULL_FACE);
+                draw_kept(scratch, span.first, span.count, kept);
+                if (!span.cull) {
+                    glCullFace(GL_FRONT);
+                    glColorPointer(4, GL_UNSIGNED_BYTE, 0, back);
+                    draw_kept(scratch, span.first, span.count, kept);
+                    glColorPointer(4, GL_UNSIGNED_BYTE, 0, front);
+                    glCullFace(GL_BACK);
+                    glDisable(GL_CULL_FACE);
+                }
+            }
+        }
+    }
+
+    if (culling) {
+        glDisable(GL_CULL_FACE);
+        glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
+    }
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+}
+
+// streamed models have no materials of their own
+static const MaterialRecord StreamedMaterial = {
+    { 0.8f, 0.8f, 0.8f, 1.0f }, { 0.0f, 0.0f, 0.0f, 0.0f }, { 0.2f, 0.2f, 0.2f, 1.0f },
+    { 0.0f, 0.0f, 0.0f, 1.0f }, 0.0f, GL_FILL, -1
+};
+
+/* Draw a streamed model chunk by chunk into the current color and depth
+ * buffers, with the default material. Chunks outside the view aren't read.
+ * The scratch chunk has room for the model's chunkTriangles triangles. */
+static void
+draw_streamed(const StreamedModel &m, DrawScratch *scratch)
+{
+    float *chunk = scratch->chunk;
+    apply_material(&StreamedMaterial, NULL, NULL);
+    glEnable(GL_LIGHTING);
+    load_view_clip(scratch);
+
+    // GL copies client arrays when drawing, so the buffer can be refilled right after
+    glInterleavedArrays(GL_N3F_V3F, 0, chunk);
+    for (size_t i = 0; i < m.chunks.size(); i++) {
+        const StreamedChunk &c = m.chunks[i];
+        if ((cullFlags & CULL_FRUSTUM) && box_visibility(scratch->clip, c.min, c.max) == BOX_OUTSIDE)
+            continue;
+        if (!read_streamed_chunk(&m, c, chunk)) {
+            fprintf(stderr, "Couldn't read spill file\n");
+            break;
+        }
+        draw_triangles(scratch, chunk + 3, 6, 0, 3 * c.triangles, true);
+    }
+
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+}
+
+/* drawAiScene() for the built-in rasterizer: the same batches and spans,
+ * recorded as draws of the frame. Lit batches are drawn in their baked colors,
+ * which the rasterizer picks by the side each triangle shows. It rejects
+ * triangles that cover no pixel center as it sets them up, sub-pixel culling
+ * is left to it. */
+static void
+raster_scene(const RenderSession *s, DrawScratch *scratch, RasterFrame *frame)
+{
+    const CompiledScene &compiled = s->compiled;
+    if (cullFlags & CULL_FRUSTUM)
+        classify_nodes(compiled, scratch);
+
+    for (size_t i = 0; i < compiled.batches.size(); i++) {
+        const DrawBatch &b = compiled.batches[i];
+        if (b.vertices == 0)
+            continue;
+        visible_spans(compiled, b, scratch);
+        if (scratch->spans.empty())
+            continue;
+
+        const MaterialRecord &mtl = compiled.materials[b.material];
+        RasterDraw d;
+        memset(&d, 0, sizeof(d));
+        d.positions = compiled.data + b.positions;
+        d.stride = 3;
+        if (b.flags & BATCH_LIT) {
+            d.front = &compiled.bakedColors[compiled.bakedOffsets[i]];
+            d.back = d.front + 4 * b.vertices;
+        }
+        else if (b.flags & BATCH_COLORED)
+            d.colors = compiled.data + b.colors;
+        else
+            set_float4(d.color, 1.0f, 1.0f, 1.0f, 1.0f);
+        if (b.flags & BATCH_TEXCOORDS)
+            d.texcoords = compiled.data + b.texcoords;
+        // textures that failed to load leave GL's texture incomplete, which disables texturing
+        if (mtl.texture >= 0 && s->rasterTextures[mtl.texture].rgb)
+            d.texture = &s->rasterTextures[mtl.texture];
+        d.wireframe = mtl.fill_mode == GL_LINE;
+
+        for (size_t j = 0; j < scratch->spans.size(); j++) {
+            const DrawSpan &span = scratch->spans[j];
+            d.mode = span.mode;
+            d.first = span.first;
+            d.count = span.count;
+            d.cullBack = span.cull;
+            raster_draw(frame, &d);
+        }
+    }
+}
+
+/* draw_streamed() for the built-in rasterizer, the lighting of every chunk is
+ * baked as it is read and the chunk is drawn before the next one is read */
+static void
+raster_streamed(const StreamedModel &m, DrawScratch *scratch, RasterFrame *frame)
+{
+    float *chunk = scratch->chunk;
+    LightRig rig;
+    light_rig(&rig);
+    LitMaterial material;
+    lit_material(StreamedMaterial, &material);
+
+    for (size_t i = 0; i < m.chunks.size(); i++) {
+        const StreamedChunk &c = m.chunks[i];
+        if (c.triangles == 0 || ((cullFlags & CULL_FRUSTUM) && box_visibility(scratch->clip, c.min, c.max) == BOX_OUTSIDE))
+            continue;
+        if (!read_streamed_chunk(&m, c, chunk)) {
+            fprintf(stderr, "Couldn't read spill file\n");
+            break;
+        }
+
+        // the chunk interleaves normals and positions, GL_N3F_V3F
+        size_t vertices = 3 * c.triangles;
+        scratch->unpacked.resize(6 * vertices);
+        scratch->colors.resize(8 * vertices);
+        GLfloat *positions = &scratch->unpacked[0], *normals = positions + 3 * vertices;
+        for (size_t v = 0; v < vertices; v++) {
+            memcpy(normals + 3 * v, chunk + 6 * v, 3 * sizeof(GLfloat));
+            memcpy(positions + 3 * v, chunk + 6 * v + 3, 3 * sizeof(GLfloat));
+        }
+        GLubyte *front = &scratch->colors[0];
+        bake_lighting(&rig, &material, positions, normals, NULL, vertices, front, front + 4 * vertices);
+
+        RasterDraw d;
+        memset(&d, 0, sizeof(d));
+        d.mode = RASTER_TRIANGLES;
+        d.count = vertices;
+        d.positions = positions;
+        d.stride = 3;
+        d.front = front;
+        d.back = front + 4 * vertices;
+        raster_draw(frame, &d);
+        raster_flush(frame);
+    }
+}
+
+
+//////////////////////////////////////////
+float camDist = 4.0f;
+
+// Viewport and camera for the current view, may be called again for every view
+void SetupView(const View &v, int width, int height)
+{
+    glViewport(0, 0, width, height);                    // Reset The Current Viewport
+
+    glMatrixMode(GL_PROJECTION);                        // Select The Projection Matrix
+    glLoadIdentity();                            // Reset The Projection Matrix
+
+    // Calculate The Aspect Ratio Of The Window
+    gluPerspective(v.fovy,(GLfloat)width/(GLfloat)height,v.znear,v.zfar);
+    gluLookAt(v.camx, v.camy, v.camz,
+              v.centerx, v.centery, v.centerz,
+              v.upx, v.upy, v.upz);
+
+    glMatrixMode(GL_MODELVIEW);                        // Select The Modelview Matrix
+}
+
+// GL state for drawing the scene, the same in every context that renders it
+static void
+InitGLState(const RenderSession *s)
+{
+    SetupView(s->camera, s->width, s->height);
+
+    glMatrixMode(GL_MODELVIEW);                        // Select The Modelview Matrix
+    glLoadIdentity();       
+
+    glEnable(GL_TEXTURE_2D);
+    glShadeModel(GL_SMOOTH);         // Enables Smooth Shading
+    glClearColor(0.0f, 0.0f, 1.0f, 1.0f);
+    glClearDepth(1.0f);                // Depth Buffer Setup
+    glEnable(GL_DEPTH_TEST);        // Enables Depth Testing
+    glDepthFunc(GL_LEQUAL);            // The Type Of Depth Test To Do
+    glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);    // Really Nice Perspective Calculation
+
+    glEnable(GL_LIGHTING);
+    glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
+    // closed meshes face out counterclockwise, see visible_spans()
+    glFrontFace(GL_CCW);
+    glCullFace(GL_BACK);
+    
+    for (int i = 0; i < NumLights; i++) {
+        glEnable(GL_LIGHT0 + i);
+        glLightfv(GL_LIGHT0 + i, GL_AMBIENT, LightAmbient);
+        glLightfv(GL_LIGHT0 + i, GL_DIFFUSE, LightDiffuse);
+        glLightfv(GL_LIGHT0 + i, GL_POSITION, LightPositions[i]);
+    }
+    glEnable(GL_NORMALIZE);
+}
+
+// All Setup For OpenGL goes here
+int InitGL(RenderSession *s)
+{
+    if (!LoadGLTextures(s))
+    {
+        return false;
+    }
+
+    InitGLState(s);
+
+    return true;                    // Initialization Went OK
+}
+
+
+static void
+render_image(const RenderSession *s, DrawScratch *scratch)
+{
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);    // Clear The Screen And The Depth Buffer
+    // glLoadIdentity();                // Reset MV Matrix
+    // glTranslatef(0.0f, 0.0f, -camDist);    // Move 40 Units And Into The Screen
+
+    if (s->streaming)
+        draw_streamed(s->streamed, scratch);
+    else
+        drawAiScene(s->compiled, s->textureIds, scratch);
+
+    /* This is very important!!!
+     * Make sure buffered commands are finished!!!
+     */
+    glFinish();
+}
+
+/* parse "camx camy camz [centerx centery centerz] [upx upy upz] [fovy] [output]",
+ * values that are left out are taken from def, the pose given on the command line */
+static bool
+parse_view(const char *line, const View &def, View *v)
+{
+    GLfloat f[10] = { def.camx, def.camy, def.camz, def.centerx, def.centery, def.centerz,
+                      def.upx, def.upy, def.upz, def.fovy };
+    char output[1000];
+    int n = 0, len;
+
+    while (n < 10 && sscanf(line, "%f%n", &f[n], &len) == 1) {
+        line += len;
+        n++;
+    }
+    if (n < 3)
+        return false;
+
+    v->camx = f[0];    v->camy = f[1];    v->camz = f[2];
+    v->centerx = f[3]; v->centery = f[4]; v->centerz = f[5];
+    v->upx = f[6];     v->upy = f[7];     v->upz = f[8];
+    v->fovy = f[9];
+    v->znear = def.znear;
+    v->zfar = def.zfar;
+    v->output = NULL;
+    if (sscanf(line, "%999s", output) == 1)
+        v->output = strdup(output);
+    return true;
+}
+
+/* read one view per line, blank lines and lines starting with '#' are skipped */
+static bool
+load_view_list(RenderSession *s, const char *filename)
+{
+    FILE *fp = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+    if (!fp) {
+        fprintf(stderr, "Couldn't open view list: %s\n", filename);
+        return false;
+    }
+
+    char line[4096];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        char *p = line + strspn(line, " \t\r\n");
+        if (*p == 0 || *p == '#')
+            continue;
+
+        View v;
+        if (!parse_view(p, s->camera, &v)) {
+            fprintf(stderr, "%s:%d: bad view\n", filename, lineno);
+            if (fp != stdin)
+                fclose(fp);
+            return false;
+        }
+        s->views.push_back(v);
+    }
+
+    if (fp != stdin)
+        fclose(fp);
+    return true;
+}
+
+/* true if pattern is safe to give to printf with one int: exactly one %d, with
+ * optional flags and a width of up to 3 digits, and no conversions but %% */
+static bool
+index_pattern(const char *pattern)
+{
+    int conversions = 0;
+    for (const char *p = strchr(pattern, '%'); p; p = strchr(p, '%')) {
+        p++;
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+        p += strspn(p, "-+ 0");
+        size_t digits = strspn(p, "0123456789");
+        if (digits > 3 || p[digits] != 'd')
+            return false;
+        p += digits + 1;
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+/* output name of view i: a printf pattern such as out_%02d.png gets the view
+ * index, any other name gets _i inserted before its extension */
+static void
+view_output_name(char *dst, size_t size, const char *pattern, int i)
+{
+    if (index_pattern(pattern)) {
+        snprintf(dst, size, pattern, i);
+        return;
+    }
+
+    const char *ext = strrchr(pattern, '.');
+    if (!ext || strchr(ext, '/'))
+        ext = pattern + strlen(pattern);
+    snprintf(dst, size, "%.*s_%d%s", (int)(ext - pattern), pattern, i, ext);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "  render [run options] [job options] modelname pngname [width height] [camx camy camz] [centerx centerz centerz] [upx upy upz] [fovy]\n");
+    fprintf(stderr, "  render [run options] -manifest file\n");
+    fprintf(stderr, "  render [run options] -serve socket\n");
+    fprintf(stderr, "  render -client socket [job options] modelname pngname ...\n");
+    fprintf(stderr, "Default: width=%d height=%d cam=[%0.4f %0.4f %0.4f] center=[%0.4f %0.4f %0.4f] up=[%0.4f %0.4f %0.4f] fovy=%0.4f\n", DefaultWidth, DefaultHeight,
+            DefaultCamera.camx, DefaultCamera.camy, DefaultCamera.camz, DefaultCamera.centerx, DefaultCamera.centery, DefaultCamera.centerz,
+            DefaultCamera.upx, DefaultCamera.upy, DefaultCamera.upz, DefaultCamera.fovy);
+    fprintf(stderr, "Run options:\n");
+    fprintf(stderr, "  -manifest file render many models in one process (- for stdin), one job per line,\n");
+    fprintf(stderr, "                 a job is written like a command line without the leading 'render'\n");
+    fprintf(stderr, "  -jobs n        render n jobs of the manifest at the same time, on threads with\n");
+    fprintf(stderr, "                 a context of their own (default: 1)\n");
+    fprintf(stderr, "  -serve socket  set up once and serve jobs on a UNIX socket with -jobs pre-forked\n");
+    fprintf(stderr, "                 workers (default: number of CPUs), see -client\n");
+    fprintf(stderr, "  -client socket send the job to a render service and wait for it\n");
+    fprintf(stderr, "  -cores n|auto  run the manifest in worker processes sharing n cores (auto: all),\n");
+    fprintf(stderr, "                 the split into workers and rasterizer threads (LP_NUM_THREADS)\n");
+    fprintf(stderr, "                 adapts to the measured jobs, workers are pinned to their cores\n");
+    fprintf(stderr, "  -view-threads n  render the views of a job on n threads, with a context each\n");
+    fprintf(stderr, "                 that draws from the one copy of the scene (default: 1)\n");
+    fprintf(stderr, "  -texture-threads n  decode textures on n threads (default: number of CPUs)\n");
+    fprintf(stderr, "  -encode-threads n  deflate PNGs of a megapixel or more on n threads (default: number of CPUs)\n");
+    fprintf(stderr, "  -max-texture-size n|auto  scale larger textures down while decoding, 0 for no limit\n");
+    fprintf(stderr, "                 (default: auto, twice the larger image dimension)\n");
+    fprintf(stderr, "  -import profile  Assimp post-processing: fast, quality (default) or a comma\n");
+    fprintf(stderr, "                 separated list of aiProcess_ step names, e.g. Triangulate,FindDegenerates\n");
+    fprintf(stderr, "  -import-timing print the time spent reading and in each post-processing step\n");
+    fprintf(stderr, "  -cache dir     keep compiled scenes in dir and map them instead of importing\n");
+    fprintf(stderr, "                 models again, entries are keyed by the model's contents\n");
+    fprintf(stderr, "  -cull steps    comma separated culling run on the CPU before drawing: frustum skips\n");
+    fprintf(stderr, "                 meshes and nodes out of view, subpixel drops triangles that cover\n");
+    fprintf(stderr, "                 no pixel center, backface culls closed meshes seen from outside,\n");
+    fprintf(stderr, "                 none (default: frustum)\n");
+    fprintf(stderr, "  -bake-lighting light the scene once on the CPU and draw it unlit in the resulting\n");
+    fprintf(stderr, "                 colors, instead of lighting every vertex of every view in GL\n");
+    fprintf(stderr, "  -backend b     osmesa (default) or soft, the built-in tile-based rasterizer that draws\n");
+    fprintf(stderr, "                 every view on all CPUs in turn, -view-threads doesn't apply to it\n");
+    fprintf(stderr, "  -decimate r    simplify meshes after import to r triangles per pixel their bounds\n");
+    fprintf(stderr, "                 cover in the job's largest view, e.g. 1 (default: off, no caching)\n");
+    fprintf(stderr, "  -memory-budget MB  stream OBJ, OFF, PLY and STL models larger than MB from a spill\n");
+    fprintf(stderr, "                 file in chunks of at most MB instead of loading them (default: off)\n");
+    fprintf(stderr, "Job options:\n");
+    fprintf(stderr, "  -views file    render every view listed in file (- for stdin), one per line:\n");
+    fprintf(stderr, "                 camx camy camz [centerx centery centerz] [upx upy upz] [fovy] [output]\n");
+    fprintf(stderr, "  -view \"camx camy camz ...\"  add a single view, same format, may be repeated\n");
+    fprintf(stderr, "  -frame az el dist  aim the camera at the center of the scene bounds from azimuth az\n");
+    fprintf(stderr, "                 (0 on the -z side, 90 on +x) and elevation el in degrees, dist times\n");
+    fprintf(stderr, "                 as far as needed to fit the bounds, cam and center arguments are ignored\n");
+    fprintf(stderr, "  -format f      png, qoi, ppm, pgm or rgba (raw pixels, no header), by default\n");
+    fprintf(stderr, "                 from the output extension, PNG for unknown extensions\n");
+    fprintf(stderr, "  -png-level n   zlib level 0-9, 0 stores the image uncompressed (default: 6)\n");
+    fprintf(stderr, "  -png-filter f  none, sub, up, avg, paeth or adaptive (default: adaptive)\n");
+    fprintf(stderr, "  -fast-encode   same as -png-level 1 -png-filter sub\n");
+    fprintf(stderr, "  Without an output per view, view i is written to pngname with %%d replaced by i,\n");
+    fprintf(stderr, "  or to pngname with _i inserted before the extension.\n");
+}
+
+static void
+free_views(RenderSession *s)
+{
+    for (size_t i = 0; i < s->views.size(); i++)
+        if (s->views[i].output != s->pngname)
+            free(s->views[i].output);
+    s->views.clear();
+}
+
+/* parse "[-views file] [-view ...] modelname pngname [width height] [camx camy camz] ..."
+ * into the session, argv[0] is not used */
+static bool
+parse_job(RenderSession *s, int argc, char *argv[])
+{
+    const char *viewfile = NULL;
+    std::vector<const char*> viewargs;
+
+    s->width = DefaultWidth;
+    s->height = DefaultHeight;
+    s->camera = DefaultCamera;
+    default_output_options(&s->output);
+    s->output.threads = encodeThreads;
+    s->framed = false;
+    free_views(s);
+
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-' && argv[argi][1] != 0) {
+        if (!strcmp(argv[argi], "-views") && argi + 1 < argc) {
+            viewfile = argv[argi+1];
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-view") && argi + 1 < argc) {
+            viewargs.push_back(argv[argi+1]);
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-frame") && argi + 3 < argc) {
+            for (int k = 0; k < 3; k++)
+                s->frame[k] = atof(argv[argi+1+k]);
+            if (!(s->frame[2] > 0)) {
+                fprintf(stderr, "Frame distance must be positive: %s\n", argv[argi+3]);
+                return false;
+            }
+            s->framed = true;
+            argi += 4;
+        }
+        else if (!strcmp(argv[argi], "-format") && argi + 1 < argc) {
+            if (!parse_image_format(argv[argi+1], &s->output.format)) {
+                fprintf(stderr, "Unknown image format: %s\n", argv[argi+1]);
+                return false;
+            }
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-png-level") && argi + 1 < argc) {
+            s->output.pngLevel = atoi(argv[argi+1]);
+            if (s->output.pngLevel < 0 || s->output.pngLevel > 9) {
+                fprintf(stderr, "PNG level must be 0 to 9: %s\n", argv[argi+1]);
+                return false;
+            }
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-png-filter") && argi + 1 < argc) {
+            if (!parse_png_filter(argv[argi+1], &s->output.pngFilter)) {
+                fprintf(stderr, "Unknown PNG filter: %s\n", argv[argi+1]);
+                return false;
+            }
+            argi += 2;
+        }
+        else if (!strcmp(argv[argi], "-fast-encode")) {
+            s->output.pngLevel = 1;
+            parse_png_filter("sub", &s->output.pngFilter);
+            argi++;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[argi]);
+            return false;
+        }
+    }
+    argv += argi - 1;
+    argc -= argi - 1;
+
+    if (argc < 3)
+        return false;
+
+    s->modelname = argv[1];
+    s->pngname = argv[2];
+
+    if (argc >= 5) {
+        s->width = atoi(argv[3]);
+        s->height = atoi(argv[4]);
+    }
+
+    View &c = s->camera;
+    if (argc >= 8) {
+        c.camx = atof(argv[5]);
+        c.camy = atof(argv[6]);
+        c.camz = atof(argv[7]);
+    }
+
+    if (argc >= 11) {
+        c.centerx = atof(argv[8]);
+        c.centery = atof(argv[9]);
+        c.centerz = atof(argv[10]);
+    }
+
+    if (argc >= 14) {
+        c.upx = atof(argv[11]);
+        c.upy = atof(argv[12]);
+        c.upz = atof(argv[13]);
+    }
+        
+    if (argc >= 15) {
+        c.fovy = atof(argv[14]);
+    }
+
+    if (s->width <= 0 || s->height <= 0) {
+        fprintf(stderr, "bad image size %dx%d\n", s->width, s->height);
+        return false;
+    }
+
+    if (s->framed && (viewfile || !viewargs.empty())) {
+        fprintf(stderr, "-frame places the job's camera, it can't be combined with listed views\n");
+        return false;
+    }
+
+    // the job's camera is the default for every listed view
+    if (viewfile && !load_view_list(s, viewfile))
+        return false;
+    for (size_t i = 0; i < viewargs.size(); i++) {
+        View v;
+        if (!parse_view(viewargs[i], s->camera, &v)) {
+            fprintf(stderr, "bad view: %s\n", viewargs[i]);
+            return false;
+        }
+        s->views.push_back(v);
+    }
+
+    return true;
+}
+
+/* Fill the session's scene bounds: from the streaming reader for streamed
+ * models, otherwise by a reduction over every vertex, of the compiled batches
+ * once there are any and else of the imported meshes moved by the nodes that
+ * reference them. A cached scene gets the same bounds as a freshly compiled one. */
+static void
+SceneBounds(RenderSession *s)
+{
+    GLfloat min[3], max[3];
+    std::vector<BoundsInput> inputs;
+    const CompiledScene &compiled = s->compiled;
+
+    if (s->streaming) {
+        for (int k = 0; k < 3; k++) {
+            min[k] = s->streamed.min[k];
+            max[k] = s->streamed.max[k];
+        }
+    }
+    else {
+        if (!compiled.batches.empty() || !s->scene) {
+            static const GLfloat identity[16] = { 1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1 };
+            for (size_t i = 0; i < compiled.batches.size(); i++) {
+                BoundsInput in;
+                in.points = compiled.data + compiled.batches[i].positions;
+                in.count = compiled.batches[i].vertices;
+                memcpy(in.world, identity, sizeof(identity));
+                inputs.push_back(in);
+            }
+        }
+        else {
+            std::vector<MeshInstance> instances;
+            std::vector<BoundsNode> nodes;
+            collect_instances(s->scene->mRootNode, glm::mat4(1.0f), NoParent, &instances, &nodes);
+            for (size_t i = 0; i < instances.size(); i++) {
+                const aiMesh *mesh = s->scene->mMeshes[instances[i].mesh];
+                if (mesh->mNumVertices == 0)
+                    continue;
+                BoundsInput in;
+                in.points = &mesh->mVertices[0].x;
+                in.count = mesh->mNumVertices;
+                memcpy(in.world, glm::value_ptr(instances[i].world), sizeof(in.world));
+                inputs.push_back(in);
+            }
+        }
+        reduce_bounds(inputs.empty() ? NULL : &inputs[0], inputs.size(), boundsThreads, min, max);
+    }
+
+    s->scene_min = aiVector3D(min[0], min[1], min[2]);
+    s->scene_max = aiVector3D(max[0], max[1], max[2]);
+    s->scene_center = (s->scene_min + s->scene_max) * 0.5f;
+}
+
+/* Place the camera of a framed job: it looks at the center of the scene bounds
+ * from the azimuth and elevation of -frame, at the distance where the bounding
+ * sphere just fits the narrower field of view times the given factor. Azimuth 0
+ * is on the -z side like the default camera, 90 on the +x side; elevation is
+ * up from the xz plane. The clip planes are moved to enclose the sphere. */
+static void
+frame_view(const RenderSession *s, View *v)
+{
+    glm::vec3 lo(s->scene_min.x, s->scene_min.y, s->scene_min.z);
+    glm::vec3 hi(s->scene_max.x, s->scene_max.y, s->scene_max.z);
+    if (!(lo.x <= hi.x && lo.y <= hi.y && lo.z <= hi.z)) {
+        fprintf(stderr, "Nothing to frame in %s, the camera is left alone\n", s->modelname);
+        return;
+    }
+    glm::vec3 center = (lo + hi) * 0.5f;
+    float radius = glm::length(hi - lo) * 0.5f;
+    if (!(radius > 0))
+        radius = 1;
+
+    float half = glm::radians(v->fovy) * 0.5f;
+    float fit = std::min(half, atanf(tanf(half) * s->width / s->height));
+    float dist = s->frame[2] * radius / sinf(fit);
+
+    float az = glm::radians(s->frame[0]), el = glm::radians(s->frame[1]);
+    glm::vec3 horizontal(sinf(az), 0, -cosf(az));
+    glm::vec3 dir = horizontal * cosf(el) + glm::vec3(0, sinf(el), 0);
+    glm::vec3 up(v->upx, v->upy, v->upz);
+    // looking along up, the far side of the scene is up in the image instead
+    if (glm::length(glm::cross(dir, up)) <= 1e-4f * glm::length(up))
+        up = horizontal * (el > 0 ? -1.0f : 1.0f);
+
+    glm::vec3 eye = center + dir * dist;
+    v->camx = eye.x;        v->camy = eye.y;        v->camz = eye.z;
+    v->centerx = center.x;  v->centery = center.y;  v->centerz = center.z;
+    v->upx = up.x;          v->upy = up.y;          v->upz = up.z;
+    v->znear = std::max((dist - radius) * 0.99f, dist * 1e-3f);
+    v->zfar = (dist + radius) * 1.01f;
+}
+
+/* bounds of the loaded model, and the views of a framed job placed from them */
+static void
+FrameViews(RenderSession *s)
+{
+    SceneBounds(s);
+    if (!s->framed)
+        return;
+    frame_view(s, &s->camera);
+    for (size_t i = 0; i < s->views.size(); i++)
+        frame_view(s, &s->views[i]);
+}
+
+/* Fill the session's compiled scene from the scene cache if it has a current
+ * entry, otherwise by importing and compiling the model and storing the result
+ * in the cache. s->scene stays NULL when the cache is used. */
+static bool
+LoadScene(RenderSession *s, const char *filename)
+{
+    uint64_t key;
+    char cachename[4096], path[PATH_MAX];
+    // simplified scenes depend on the views and image size, they aren't cached
+    bool caching = cacheDir && decimateRatio <= 0 && hash_file(filename, &key);
+    if (caching) {
+        // .mtl files and such are found next to the model, copies elsewhere get entries of their own
+        const char *model = realpath(filename, path) ? path : filename;
+        hash_string(model, &key);
+        // one entry per import profile, so that runs with different flags don't replace each other's
+        snprintf(cachename, sizeof(cachename), "%s/%016llx-%08x.scene", cacheDir, (unsigned long long)key, importFlags);
+        if (map_scene_cache(cachename, key, importFlags, &s->compiled)) {
+            FrameViews(s);
+            return true;
+        }
+
+        s->recordingIO->model = model;
+        s->recordingIO->opened.clear();
+    }
+
+    if (!Import3DFromFile(s, filename))
+        return false;
+    // simplification needs the final views, the other scenes are framed from what is drawn
+    if (decimateRatio > 0) {
+        FrameViews(s);
+        DecimateScene(s);
+        CompileScene(&s->compiled, s->scene);
+    }
+    else {
+        CompileScene(&s->compiled, s->scene);
+        FrameViews(s);
+    }
+
+    if (caching && !save_scene_cache(cachename, key, importFlags, &s->compiled, s->recordingIO->opened))
+        fprintf(stderr, "Couldn't write scene cache: %s\n", cachename);
+    return true;
+}
+
+/* Models larger than the memory budget are streamed if their format allows
+ * it, every other model is loaded by LoadScene(). The budget is shared by the
+ * chunk buffers of the threads that render the job's views and whatever else
+ * is held per triangle of a chunk while it is drawn. */
+static bool
+LoadModel(RenderSession *s)
+{
+    struct stat st;
+    s->streaming = memoryBudget > 0 && streamable_format(s->modelname)
+        && stat(s->modelname, &st) == 0 && (uint64_t)st.st_size > memoryBudget;
+    if (!s->streaming) {
+        if (!LoadScene(s, s->modelname))
+            return false;
+        // the built-in rasterizer has no lighting of its own
+        if (bakeLighting || softRaster)
+            BakeLighting(&s->compiled);
+        return true;
+    }
+
+    size_t threads = softRaster ? 1 : std::max<size_t>(1, std::min<size_t>(viewThreads, s->views.size()));
+    size_t budget = memoryBudget / threads;
+    const size_t triangle = STREAMED_FLOATS_PER_TRIANGLE * sizeof(float);
+    if (softRaster) {
+        /* raster_streamed() unpacks every chunk and bakes its colors, and the
+         * rasterizer sets up its triangles, all of which take their share */
+        size_t extra = 3 * (6 * sizeof(GLfloat) + 8 * sizeof(GLubyte)) + raster_primitive_bytes();
+        budget = budget / (triangle + extra) * triangle;
+    }
+    else if (cullFlags & CULL_SUBPIXEL) {
+        // the indices of the culled chunk take their share
+        budget = budget / (triangle + 3 * sizeof(GLuint)) * triangle;
+    }
+    const char *tmpdir = cacheDir ? cacheDir : getenv("TMPDIR");
+    if (!open_streamed_model(s->modelname, tmpdir, budget, &s->streamed)) {
+        s->streaming = false;
+        return false;
+    }
+    FrameViews(s);
+    const StreamedModel &m = s->streamed;
+    printf("Streaming %s: %llu triangles in %d chunks, bounds [%g %g %g] - [%g %g %g]\n", s->modelname,
+           (unsigned long long)m.triangles, (int)m.chunks.size(), m.min[0], m.min[1], m.min[2], m.max[0], m.max[1], m.max[2]);
+    return true;
+}
+
+// grow buffer to the session's image size as needed, it is kept for the next job
+static bool
+grow_buffer(const RenderSession *s, void **buffer, size_t *bufferSize)
+{
+    /* Allocate the image buffer */
+    size_t size = s->width * s->height * 4 * sizeof(GLubyte);
+    if (size > *bufferSize) {
+        free(*buffer);
+        *buffer = malloc(size);
+        *bufferSize = *buffer ? size : 0;
+    }
+    if (!*buffer) {
+        printf("Alloc image buffer failed!\n");
+        return false;
+    }
+    return true;
+}
+
+/* make ctx current with buffer, which is grown to the session's image size as
+ * needed and kept for the next job */
+static bool
+make_current(const RenderSession *s, OSMesaContext ctx, void **buffer, size_t *bufferSize)
+{
+    if (!grow_buffer(s, buffer, bufferSize))
+        return false;
+
+    /* Bind the buffer to the context and make it current */
+    if (!OSMesaMakeCurrent( ctx, *buffer, GL_UNSIGNED_BYTE, s->width, s->height )) {
+        printf("OSMesaMakeCurrent failed!\n");
+        return false;
+    }
+    return true;
+}
+
+// write the image of view i from buffer, false if it can't be written
+static bool
+write_view(const RenderSession *s, size_t i, bool multiview, const void *buffer)
+{
+    char outname[1000];
+    const char *filename = s->views[i].output;
+    if (!filename && multiview) {
+        view_output_name(outname, sizeof(outname), s->pngname, i);
+        filename = outname;
+    }
+
+    if (filename != NULL)
+        return write_image(filename, buffer, s->width, s->height, &s->output);
+    printf("Specify a filename if you want to make an image file\n");
+    return true;
+}
+
+/* render views first, first + stride, ... of the job with the current context,
+ * which renders into buffer, and add the seconds spent drawing to drawing;
+ * false if an image couldn't be written */
+static bool
+render_views(const RenderSession *s, size_t first, size_t stride, bool multiview, const void *buffer,
+             double *drawing)
+{
+    DrawScratch scratch;
+    scratch.chunk = NULL;
+    if (s->streaming) {
+        scratch.chunk = (float*)malloc(s->streamed.chunkTriangles * STREAMED_FLOATS_PER_TRIANGLE * sizeof(float));
+        if (!scratch.chunk) {
+            printf("Alloc chunk buffer failed!\n");
+            return false;
+        }
+    }
+
+    bool ok = true;
+    for (size_t i = first; i < s->views.size(); i += stride) {
+        const View &v = s->views[i];
+
+        double start = seconds();
+        SetupView(v, s->width, s->height);
+        render_image(s, &scratch);
+        *drawing += seconds() - start;
+
+        ok = write_view(s, i, multiview, buffer) && ok;
+    }
+    free(scratch.chunk);
+    return ok;
+}
+
+/* render_views() with the built-in rasterizer, every view on rasterThreads
+ * threads one after the other, into the session's buffer. false if an image
+ * can't be drawn or written. */
+static bool
+raster_views(RenderSession *s, bool multiview)
+{
+    static const GLfloat clear[4] = { 0.0f, 0.0f, 1.0f, 1.0f };    // as InitGLState() clears
+
+    if (!s->raster)
+        s->raster = raster_create(rasterThreads);
+    DrawScratch scratch;
+    scratch.chunk = NULL;
+    if (s->streaming) {
+        scratch.chunk = (float*)malloc(s->streamed.chunkTriangles * STREAMED_FLOATS_PER_TRIANGLE * sizeof(float));
+        if (!scratch.chunk) {
+            printf("Alloc chunk buffer failed!\n");
+            return false;
+        }
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < s->views.size(); i++) {
+        double start = seconds();
+        memcpy(scratch.clip, glm::value_ptr(view_clip(s, s->views[i])), sizeof(scratch.clip));
+        if (!raster_begin(s->raster, s->width, s->height, scratch.clip, clear)) {
+            printf("The built-in rasterizer draws images of up to %dx%d pixels\n", RASTER_MAX_SIZE, RASTER_MAX_SIZE);
+            ok = false;
+            break;
+        }
+        if (s->streaming)
+            raster_streamed(s->streamed, &scratch, s->raster);
+        else
+            raster_scene(s, &scratch, s->raster);
+        raster_end(s->raster, s->buffer);
+        s->stats.renderSeconds += seconds() - start;
+
+        ok = write_view(s, i, multiview, s->buffer) && ok;
+    }
+    free(scratch.chunk);
+    return ok;
+}
+
+// views of a job rendered by one of the session's view contexts
+struct ViewWork {
+    const RenderSession *session;
+    ViewContext *context;
+    size_t first, stride;
+    bool multiview;
+    bool ok;
+    double drawing;
+    bool started;    // thread is running view_worker()
+    pthread_t thread;
+};
+
+static void *
+view_worker(void *arg)
+{
+    ViewWork *w = (ViewWork*)arg;
+    ViewContext *vc = w->context;
+
+    w->ok = make_current(w->session, vc->ctx, &vc->buffer, &vc->bufferSize);
+    if (!w->ok)
+        return NULL;
+
+    // the textures are shared with the session's context, only the state is set up
+    InitGLState(w->session);
+    w->ok = render_views(w->session, w->first, w->stride, w->multiview, vc->buffer, &w->drawing);
+    return NULL;
+}
+
+static OSMesaContext create_context(OSMesaContext sharelist);
+
+/* Render the views of the job on up to viewThreads contexts at once. The
+ * compiled scene is only read while drawing, so all of them draw from the one
+ * copy the session holds, and the view contexts share the session context's
+ * textures. Views are dealt out round robin. */
+static bool
+render_job_views(RenderSession *s, bool multiview)
+{
+    size_t threads = std::min<size_t>(viewThreads, s->views.size());
+    while (s->viewContexts.size() + 1 < threads) {
+        ViewContext vc = { create_context(s->ctx), NULL, 0 };
+        if (!vc.ctx)
+            break;
+        s->viewContexts.push_back(vc);
+    }
+    threads = std::min(threads, s->viewContexts.size() + 1);
+
+    if (threads > 1) {
+        // the textures have to be complete before other contexts use them
+        glFinish();
+    }
+
+    std::vector<ViewWork> work(threads);
+    for (size_t t = 1; t < threads; t++) {
+        ViewWork &w = work[t];
+        w.session = s;
+        w.context = &s->viewContexts[t-1];
+        w.first = t;
+        w.stride = threads;
+        w.multiview = multiview;
+        w.ok = false;
+        w.drawing = 0;
+        w.started = pthread_create(&w.thread, NULL, view_worker, &w) == 0;
+    }
+
+    // the views of threads that couldn't be started are drawn with the session's context
+    s->stats.renderSeconds = 0;
+    bool ok = render_views(s, 0, threads, multiview, s->buffer, &s->stats.renderSeconds);
+    for (size_t t = 1; t < threads; t++) {
+        if (!work[t].started) {
+            ok = render_views(s, t, threads, multiview, s->buffer, &s->stats.renderSeconds) && ok;
+            continue;
+        }
+        pthread_join(work[t].thread, NULL);
+        ok = ok && work[t].ok;
+        s->stats.renderSeconds += work[t].drawing;
+    }
+    return ok;
+}
+
+/* render all views of the parsed job with the session's context or the
+ * built-in rasterizer, the image buffer is grown as needed and kept for the
+ * next job */
+static bool
+render_job(RenderSession *s)
+{
+    double start = seconds();
+    memset(&s->stats, 0, sizeof(s->stats));
+
+    bool multiview = !s->views.empty();
+    if (!multiview) {
+        View v = s->camera;
+        v.output = s->pngname;
+        s->views.push_back(v);
+    }
+
+    if (!LoadModel(s)) {
+        fprintf(stderr, "model cannot be loaded!\n");
+        return false;
+    }
+
+    bool ok;
+    if (softRaster) {
+        // no context: the textures stay in memory and the views are drawn on the CPU
+        ok = grow_buffer(s, &s->buffer, &s->bufferSize) && LoadGLTextures(s) && raster_views(s, multiview);
+    }
+    else {
+        if (!make_current(s, s->ctx, &s->buffer, &s->bufferSize)) {
+            ReleaseScene(s);
+            return false;
+        }
+
+        static int reported = 0;
+        if (__sync_bool_compare_and_swap(&reported, 0, 1)) {
+            int z, st, a;
+            glGetIntegerv(GL_DEPTH_BITS, &z);
+            glGetIntegerv(GL_STENCIL_BITS, &st);
+            glGetIntegerv(GL_ACCUM_RED_BITS, &a);
+            printf("Depth=%d Stencil=%d Accum=%d\n", z, st, a);
+        }
+
+        // textures and GL state are set up once per model, only the camera changes per view
+        InitGL(s);
+
+        ok = render_job_views(s, multiview);
+    }
+
+    for (size_t i = 0; i < s->compiled.batches.size(); i++)
+        s->stats.triangles += s->compiled.batches[i].count[0] / 3;
+    if (s->streaming)
+        s->stats.triangles = s->streamed.triangles;
+    s->stats.triangles *= s->views.size();
+    s->stats.pixels = (double)s->width * s->height * s->views.size();
+
+    ReleaseScene(s);
+    if (s->streaming)
+        close_streamed_model(&s->streamed);
+    s->stats.seconds = seconds() - start;
+    return ok;
+}
+
+/* an RGBA context, sharing textures with sharelist unless that is NULL */
+static OSMesaContext
+create_context(OSMesaContext sharelist)
+{
+    OSMesaContext ctx;
+
+    /* Create an RGBA-mode context */
+#if OSMESA_MAJOR_VERSION * 100 + OSMESA_MINOR_VERSION >= 305
+    /* specify Z, stencil, accum sizes */
+    ctx = OSMesaCreateContextExt( OSMESA_RGBA, 16, 0, 0, sharelist );
+#else
+    ctx = OSMesaCreateContext( OSMESA_RGBA, sharelist );
+#endif
+    if (!ctx)
+        printf("OSMesaCreateContext failed!\n");
+    return ctx;
+}
+
+/* a session with its own importer and an RGBA context, unless the built-in
+ * rasterizer draws, NULL if the context can't be created */
+static RenderSession *
+create_session(void)
+{
+    RenderSession *s = new RenderSession();
+
+    // the importer owns and deletes its IO handler
+    if (cacheDir) {
+        s->recordingIO = new RecordingIOSystem;
+        s->importer.SetIOHandler(s->recordingIO);
+    }
+
+    if (softRaster)
+        return s;
+    s->ctx = create_context(NULL);
+    if (!s->ctx) {
+        delete s;
+        return NULL;
+    }
+    return s;
+}
+
+static void
+destroy_session(RenderSession *s)
+{
+    /* free the image buffer */
+    free(s->buffer);
+    free_views(s);
+
+    for (size_t i = 0; i < s->viewContexts.size(); i++) {
+        OSMesaDestroyContext(s->viewContexts[i].ctx);
+        free(s->viewContexts[i].buffer);
     }
 
     /* destroy the context */
-    OSMesaDestroyContext( ctx );
+    if (s->ctx)
+        OSMesaDestroyContext(s->ctx);
+    raster_destroy(s->raster);
+    delete s;
+}
+
+/* run the job of a manifest line, false for blank lines and comments. The
+ * line is split in place. */
+static bool
+run_job_line(RenderSession *s, char *line, bool *ok)
+{
+    // split the line into a command line, argv[0] stays unused
+    char *jobargv[64], *save;
+    int jobargc = 1;
+    jobargv[0] = (char*)"render";
+    for (char *tok = strtok_r(line, " \t\r\n", &save); tok && jobargc < 64; tok = strtok_r(NULL, " \t\r\n", &save))
+        jobargv[jobargc++] = tok;
+    if (jobargc == 1 || jobargv[1][0] == '#')
+        return false;
+
+    *ok = parse_job(s, jobargc, jobargv) && render_job(s);
+    return true;
+}
+
+// a scheduler worker process runs its jobs in a session of its own
+static void *
+start_worker_session(int cores)
+{
+    textureThreads = cores;
+    encodeThreads = cores;
+    decimateThreads = cores;
+    boundsThreads = cores;
+    rasterThreads = cores;
+    return create_session();
+}
+
+static bool
+run_worker_job(void *worker, char *line, JobStats *stats)
+{
+    RenderSession *s = (RenderSession*)worker;
+    bool ok = false;
+    if (!run_job_line(s, line, &ok))
+        return true;
+    *stats = s->stats;
+    return ok;
+}
+
+static void
+stop_worker_session(void *worker)
+{
+    destroy_session((RenderSession*)worker);
+}
+
+static const WorkerOps SessionWorkers = { start_worker_session, run_worker_job, stop_worker_session };
+
+/* Draw one triangle in each common state (lit, vertex colored, unlit, textured)
+ * so that llvmpipe has compiled the shaders for them before the service forks
+ * its workers, which then start with the code in place */
+static void
+warm_up(RenderSession *s)
+{
+    static const GLfloat triangle[] = {
+        // positions
+        -0.5f, -0.5f, 0.0f,   0.5f, -0.5f, 0.0f,   0.0f, 0.5f, 0.0f,
+        // normals
+        0.0f, 0.0f, -1.0f,    0.0f, 0.0f, -1.0f,   0.0f, 0.0f, -1.0f,
+        // texcoords
+        0.0f, 0.0f,   1.0f, 0.0f,   0.5f, 1.0f,
+        // colors
+        1.0f, 0.0f, 0.0f, 1.0f,   0.0f, 1.0f, 0.0f, 1.0f,   0.0f, 0.0f, 1.0f, 1.0f,
+    };
+    static const unsigned int states[] = {
+        BATCH_LIT, BATCH_LIT | BATCH_COLORED, 0, BATCH_LIT | BATCH_TEXTURED | BATCH_TEXCOORDS,
+        BATCH_LIT | BATCH_CLOSED
+    };
+    static const GLubyte white[3] = { 255, 255, 255 };
+
+    s->width = s->height = 16;
+    s->camera = DefaultCamera;
+    if (!make_current(s, s->ctx, &s->buffer, &s->bufferSize))
+        return;
+
+    CompiledScene &c = s->compiled;
+    c.vertexData.assign(triangle, triangle + sizeof(triangle) / sizeof(triangle[0]));
+    c.data = &c.vertexData[0];
+    c.dataSize = c.vertexData.size();
+
+    MaterialRecord m;
+    set_float4(m.diffuse, 0.8f, 0.8f, 0.8f, 1.0f);
+    set_float4(m.specular, 0.2f, 0.2f, 0.2f, 1.0f);
+    set_float4(m.ambient, 0.2f, 0.2f, 0.2f, 1.0f);
+    set_float4(m.emission, 0.0f, 0.0f, 0.0f, 1.0f);
+    m.shininess = 0.0f;
+    m.fill_mode = GL_FILL;
+    m.texture = -1;
+    c.materials.push_back(m);
+    m.texture = 0;
+    c.materials.push_back(m);
+    c.textureNames.push_back(strdup("warm-up"));
+
+    // one node and one range around the triangle, so that culling draws it
+    BoundsNode root = { NoParent, { -0.5f, -0.5f, 0.0f }, { 0.5f, 0.5f, 0.0f } };
+    DrawRange range = { 0, 3, 0, { -0.5f, -0.5f, 0.0f }, { 0.5f, 0.5f, 0.0f } };
+    c.nodes.push_back(root);
+    c.ranges.push_back(range);
+
+    for (size_t i = 0; i < sizeof(states) / sizeof(states[0]); i++) {
+        DrawBatch b;
+        memset(&b, 0, sizeof(b));
+        b.rangeCount[0] = 1;
+        b.material = (states[i] & BATCH_TEXTURED) ? 1 : 0;
+        b.flags = states[i];
+        b.vertices = 3;
+        b.positions = 0;
+        b.normals = 9;
+        b.texcoords = 18;
+        b.colors = 24;
+        b.count[0] = 3;
+        c.batches.push_back(b);
+    }
+
+    s->textureIds = new GLuint[1];
+    glGenTextures(1, s->textureIds);
+    upload_texture(s->textureIds[0], 3, 1, 1, GL_RGB, white);
+    if (bakeLighting)
+        BakeLighting(&c);
+
+    InitGLState(s);
+    DrawScratch scratch;
+    scratch.chunk = NULL;
+    render_image(s, &scratch);
+    ReleaseScene(s);
+}
+
+// a job of the render service, run in a worker's copy of the warmed up session
+static bool
+run_service_job(void *state, int argc, char *argv[], JobStats *stats)
+{
+    RenderSession *s = (RenderSession*)state;
+    bool ok = parse_job(s, argc, argv) && render_job(s);
+    *stats = s->stats;
+    return ok;
+}
+
+// jobs of a manifest, shared by the threads rendering them
+struct Manifest {
+    const char *filename;
+    FILE *fp;
+    pthread_mutex_t lock;    // guards everything below
+    int lineno;
+    int jobs;
+    int failed;
+};
+
+/* render jobs of the manifest in the session until it is exhausted, a failed
+ * job is reported and skipped */
+static void
+run_manifest_jobs(Manifest *m, RenderSession *s)
+{
+    char line[4096];
+    for (;;) {
+        pthread_mutex_lock(&m->lock);
+        bool more = fgets(line, sizeof(line), m->fp) != NULL;
+        int lineno = ++m->lineno;
+        pthread_mutex_unlock(&m->lock);
+        if (!more)
+            return;
+
+        bool ok;
+        if (!run_job_line(s, line, &ok))
+            continue;
+
+        pthread_mutex_lock(&m->lock);
+        m->jobs++;
+        if (!ok) {
+            fprintf(stderr, "%s:%d: job failed\n", m->filename, lineno);
+            m->failed++;
+        }
+        pthread_mutex_unlock(&m->lock);
+    }
+}
+
+struct ManifestWorker {
+    Manifest *manifest;
+    RenderSession *session;
+    bool started;    // thread is running manifest_worker()
+    pthread_t thread;
+};
+
+static void *
+manifest_worker(void *arg)
+{
+    ManifestWorker *w = (ManifestWorker*)arg;
+    run_manifest_jobs(w->manifest, w->session);
+    return NULL;
+}
+
+/* run every job of the manifest, on renderThreads threads with a session each */
+static int
+run_manifest(const char *filename)
+{
+    Manifest m;
+    m.filename = filename;
+    m.fp = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+    if (!m.fp) {
+        fprintf(stderr, "Couldn't open manifest: %s\n", filename);
+        return -1;
+    }
+    pthread_mutex_init(&m.lock, NULL);
+    m.lineno = m.jobs = m.failed = 0;
+
+    std::vector<ManifestWorker> workers;
+    for (int i = 0; i < renderThreads; i++) {
+        ManifestWorker w = { &m, create_session(), false };
+        if (!w.session)
+            break;
+        workers.push_back(w);
+    }
+    // the jobs are shared, so the threads that do start take the others' share
+    for (size_t i = 1; i < workers.size(); i++)
+        workers[i].started = pthread_create(&workers[i].thread, NULL, manifest_worker, &workers[i]) == 0;
+    if (!workers.empty())
+        manifest_worker(&workers[0]);
+    for (size_t i = 0; i < workers.size(); i++) {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+        destroy_session(workers[i].session);
+    }
+
+    if (m.fp != stdin)
+        fclose(m.fp);
+    pthread_mutex_destroy(&m.lock);
+
+    printf("%d of %d jobs done\n", m.jobs - m.failed, m.jobs);
+    return m.failed;
+}
+
+    int
+main(int argc, char *argv[])
+{
+    const char *manifest = NULL;
+    const char *serviceSocket = NULL;
+    const char *clientSocket = NULL;
+    bool jobsGiven = false;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    textureThreads = cpus > 0 ? cpus : 1;
+    encodeThreads = textureThreads;
+    decimateThreads = textureThreads;
+    boundsThreads = textureThreads;
+    rasterThreads = textureThreads;
+
+    // options for the whole run, the job options follow
+    int argi = 1;
+    while (argi < argc) {
+        if (!strcmp(argv[argi], "-import-timing")) {
+            importTiming = true;
+            argi++;
+            continue;
+        }
+        if (!strcmp(argv[argi], "-bake-lighting")) {
+            bakeLighting = true;
+            argi++;
+            continue;
+        }
+        if (argi + 1 >= argc)
+            break;
+        if (!strcmp(argv[argi], "-manifest"))
+            manifest = argv[argi+1];
+        else if (!strcmp(argv[argi], "-jobs")) {
+            renderThreads = std::max(1, atoi(argv[argi+1]));
+            jobsGiven = true;
+        }
+        else if (!strcmp(argv[argi], "-serve"))
+            serviceSocket = argv[argi+1];
+        else if (!strcmp(argv[argi], "-client"))
+            clientSocket = argv[argi+1];
+        else if (!strcmp(argv[argi], "-cores"))
+            coreBudget = strcmp(argv[argi+1], "auto") ? std::max(1, atoi(argv[argi+1])) : 0;
+        else if (!strcmp(argv[argi], "-view-threads"))
+            viewThreads = std::max(1, atoi(argv[argi+1]));
+        else if (!strcmp(argv[argi], "-texture-threads"))
+            textureThreads = atoi(argv[argi+1]);
+        else if (!strcmp(argv[argi], "-encode-threads"))
+            encodeThreads = std::max(1, atoi(argv[argi+1]));
+        else if (!strcmp(argv[argi], "-max-texture-size"))
+            maxTextureSize = strcmp(argv[argi+1], "auto") ? atoi(argv[argi+1]) : -1;
+        else if (!strcmp(argv[argi], "-cache"))
+            cacheDir = argv[argi+1];
+        else if (!strcmp(argv[argi], "-cull")) {
+            if (!parse_cull_steps(argv[argi+1], &cullFlags)) {
+                usage();
+                return 0;
+            }
+        }
+        else if (!strcmp(argv[argi], "-backend")) {
+            if (strcmp(argv[argi+1], "osmesa") && strcmp(argv[argi+1], "soft")) {
+                usage();
+                return 0;
+            }
+            softRaster = !strcmp(argv[argi+1], "soft");
+        }
+        else if (!strcmp(argv[argi], "-decimate"))
+            decimateRatio = std::max(0.0, atof(argv[argi+1]));
+        else if (!strcmp(argv[argi], "-memory-budget"))
+            memoryBudget = (size_t)std::max(0.0, atof(argv[argi+1]) * 1024 * 1024);
+        else if (!strcmp(argv[argi], "-import")) {
+            if (!parse_import_profile(argv[argi+1], &importFlags)) {
+                usage();
+                return 0;
+            }
+        }
+        else
+            break;
+        argi += 2;
+    }
+    argv += argi - 1;
+    argc -= argi - 1;
+
+    // the service renders the job, this process only waits for the answer
+    if (clientSocket)
+        return service_request(clientSocket, argc, argv) ? 0 : 1;
+
+    if ((manifest || serviceSocket) && argc > 1) {
+        usage();
+        return 0;
+    }
+
+    if (serviceSocket) {
+        /* Rasterizer threads don't survive fork(), so the service's context
+         * must rasterize on the calling thread; the workers are the parallelism */
+        setenv("LP_NUM_THREADS", "0", 1);
+        rasterThreads = 1;
+        if (!jobsGiven)
+            renderThreads = textureThreads;
+        // jobs run in their clients' directories, the cache stays where it was given
+        static char cachePath[PATH_MAX];
+        if (cacheDir && realpath(cacheDir, cachePath))
+            cacheDir = cachePath;
+    }
+
+    if (!InitDevIL())
+        return 0;
+
+    if (serviceSocket) {
+        RenderSession *s = create_session();
+        if (!s)
+            return 0;
+        // the built-in rasterizer has nothing to compile
+        if (!softRaster)
+            warm_up(s);
+        run_service(serviceSocket, renderThreads, s, run_service_job);
+        destroy_session(s);
+        return 0;
+    }
+
+    if (manifest && coreBudget >= 0) {
+        run_scheduled_manifest(manifest, coreBudget, &SessionWorkers);
+    }
+    else if (manifest) {
+        run_manifest(manifest);
+    }
+    else {
+        RenderSession *s = create_session();
+        if (!s)
+            return 0;
+        if (!parse_job(s, argc, argv)) {
+            usage();
+            destroy_session(s);
+            return 0;
+        }
+        render_job(s);
+        destroy_session(s);
+    }
+
+    printf("all done\n");
 
     return 0;
 }
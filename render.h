@@ -0,0 +1,91 @@
+/*
+ * The flattened, draw-ready form of a scene, shared by the renderer and the
+ * scene cache
+ */
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <vector>
+#include "gl_wrap.h"
+
+// everything apply_material() needs, resolved once per scene
+struct MaterialRecord {
+    GLfloat diffuse[4];
+    GLfloat specular[4];
+    GLfloat ambient[4];
+    GLfloat emission[4];
+    GLfloat shininess;
+    GLenum fill_mode;
+    int texture;    // index into textureNames, -1 without a diffuse texture
+};
+
+// render state shared by all meshes of a batch
+enum {
+    BATCH_LIT = 1,         // the mesh has normals, lighting on
+    BATCH_COLORED = 2,     // vertex colors, color material on
+    BATCH_TEXTURED = 4,    // the material has a diffuse texture
+    BATCH_TEXCOORDS = 8,   // texture coordinates are given per vertex
+    BATCH_CLOSED = 16      // closed meshes, every triangle faces out counterclockwise
+};
+
+/* Meshes of the flattened scene that share material and render state, already
+ * transformed to world space. Vertices are duplicated per face; triangles, lines
+ * and points are stored in that order. The attributes are offsets into the
+ * scene's vertex data, in floats: 3 per vertex for positions and normals, 2 for
+ * texcoords and 4 for colors. */
+struct DrawBatch {
+    unsigned int material;
+    unsigned int flags;
+    GLsizei vertices;
+    size_t positions;
+    size_t normals;
+    size_t texcoords;    // only with BATCH_TEXCOORDS
+    size_t colors;       // only with BATCH_COLORED
+    GLint first[3];
+    GLsizei count[3];
+    unsigned int firstRange[3];    // the DrawRanges of each primitive class, in vertex order
+    unsigned int rangeCount[3];
+};
+
+/* The vertices one mesh instance adds to a batch for one primitive class,
+ * with their world space bounds, the unit frustum culling skips */
+struct DrawRange {
+    GLint first;          // vertex of the batch
+    GLsizei count;
+    unsigned int node;    // the node that references the mesh, index into nodes
+    GLfloat min[3], max[3];
+};
+
+/* A node of the scene graph with the world space bounds of all meshes below
+ * it, empty bounds have min > max. Nodes are stored depth first, so a parent
+ * always comes before its children. */
+struct BoundsNode {
+    unsigned int parent;    // NoParent for the root
+    GLfloat min[3], max[3];
+};
+
+static const unsigned int NoParent = ~0u;
+
+struct CompiledScene {
+    std::vector<MaterialRecord> materials;    // one per scene->mMaterials entry
+    std::vector<char*> textureNames;          // unique diffuse texture filenames, '/' separated, malloc'ed
+    std::vector<DrawBatch> batches;
+    std::vector<DrawRange> ranges;
+    std::vector<BoundsNode> nodes;
+
+    std::vector<GLfloat> vertexData;    // vertex data of a scene compiled in this process
+    const GLfloat *data;                // vertexData, or the vertex data of a mapped cache file
+    size_t dataSize;                    // in floats
+
+    void *mapping;                      // the mapped cache file, if any
+    size_t mappingSize;
+
+    // lighting baked into vertex colors, not cached, empty unless baking is on
+    std::vector<GLubyte> bakedColors;    // front then back RGBA of every vertex of a lit batch
+    std::vector<size_t> bakedOffsets;    // of each batch into bakedColors
+};
+
+static const GLenum BatchModes[3] = { GL_TRIANGLES, GL_LINES, GL_POINTS };
+
+#endif
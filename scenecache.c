@@ -0,0 +1,334 @@
+/*
+ * On-disk cache of compiled scenes, see scenecache.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scenecache.h"
+
+#define SCENE_CACHE_MAGIC "RSCACHE"
+#define SCENE_CACHE_VERSION 3
+
+/* File layout, every section starts on a 16 byte boundary:
+ *   CacheHeader
+ *   MaterialRecord[numMaterials]
+ *   DrawBatch[numBatches]
+ *   DrawRange[numRanges]
+ *   BoundsNode[numNodes]
+ *   CacheDependency[numDependencies]
+ *   strings: numTextures texture names, then numDependencies paths, NUL terminated
+ *   vertex data: dataSize floats
+ * Records are stored as they are in memory; the header keeps their sizes and the
+ * byte order so files from another build are rejected instead of misread. */
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t materialSize;
+    uint32_t batchSize;
+    uint32_t rangeSize;
+    uint32_t nodeSize;
+    uint64_t key;
+    uint32_t flags;
+    uint32_t numMaterials;
+    uint32_t numTextures;
+    uint32_t numBatches;
+    uint32_t numDependencies;
+    uint32_t numRanges;
+    uint32_t numNodes;
+    uint32_t reserved;
+    uint64_t materialsOffset;
+    uint64_t batchesOffset;
+    uint64_t rangesOffset;
+    uint64_t nodesOffset;
+    uint64_t dependenciesOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t dataOffset;
+    uint64_t dataSize;
+    uint64_t fileSize;
+};
+
+struct CacheDependency {
+    uint64_t size;
+    int64_t mtime;
+};
+
+static uint64_t
+align16(uint64_t offset)
+{
+    return (offset + 15) & ~(uint64_t)15;
+}
+
+bool
+hash_file(const char *filename, uint64_t *hash)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return false;
+
+    uint64_t h = 14695981039346656037ULL;
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            h ^= buf[i];
+            h *= 1099511628211ULL;
+        }
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+
+    *hash = h;
+    return ok;
+}
+
+void
+hash_string(const char *str, uint64_t *hash)
+{
+    uint64_t h = *hash;
+    for (const unsigned char *p = (const unsigned char*)str; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    *hash = h;
+}
+
+static bool
+dependency_unchanged(const char *path, const CacheDependency *dep)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && (uint64_t)st.st_size == dep->size && (int64_t)st.st_mtime == dep->mtime;
+}
+
+// n elements of elemSize bytes at offset lie within size bytes, without overflowing
+static bool
+fits(uint64_t offset, uint64_t n, uint64_t elemSize, uint64_t size)
+{
+    return offset <= size && n <= (size - offset) / elemSize;
+}
+
+// the attribute of a batch at offset with n floats per vertex lies within the data
+static bool
+in_range(const CacheHeader *h, uint64_t offset, GLsizei vertices, int n)
+{
+    return offset <= h->dataSize && (uint64_t)vertices * n <= h->dataSize - offset;
+}
+
+bool
+map_scene_cache(const char *filename, uint64_t key, unsigned int flags, CompiledScene *cs)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+
+    const char *bytes = (const char*)base;
+    const CacheHeader *h = (const CacheHeader*)base;
+    bool ok = !memcmp(h->magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC))
+        && h->version == SCENE_CACHE_VERSION
+        && h->byteOrder == 0x01020304
+        && h->materialSize == sizeof(MaterialRecord)
+        && h->batchSize == sizeof(DrawBatch)
+        && h->rangeSize == sizeof(DrawRange)
+        && h->nodeSize == sizeof(BoundsNode)
+        && h->key == key
+        && h->flags == flags
+        && h->fileSize == size
+        && fits(h->materialsOffset, h->numMaterials, sizeof(MaterialRecord), size)
+        && fits(h->batchesOffset, h->numBatches, sizeof(DrawBatch), size)
+        && fits(h->rangesOffset, h->numRanges, sizeof(DrawRange), size)
+        && fits(h->nodesOffset, h->numNodes, sizeof(BoundsNode), size)
+        && fits(h->dependenciesOffset, h->numDependencies, sizeof(CacheDependency), size)
+        && fits(h->stringsOffset, h->stringsSize, 1, size)
+        && h->dataOffset % sizeof(GLfloat) == 0
+        && fits(h->dataOffset, h->dataSize, sizeof(GLfloat), size);
+
+    // the strings section holds exactly numTextures + numDependencies names
+    std::vector<const char*> strings;
+    if (ok) {
+        const char *s = bytes + h->stringsOffset, *end = s + h->stringsSize;
+        while (s < end) {
+            const char *nul = (const char*)memchr(s, 0, end - s);
+            if (!nul)
+                break;
+            strings.push_back(s);
+            s = nul + 1;
+        }
+        ok = s == end && strings.size() == (size_t)h->numTextures + h->numDependencies;
+    }
+
+    const CacheDependency *deps = (const CacheDependency*)(bytes + h->dependenciesOffset);
+    for (uint32_t i = 0; ok && i < h->numDependencies; i++)
+        ok = dependency_unchanged(strings[h->numTextures + i], &deps[i]);
+
+    const MaterialRecord *materials = (const MaterialRecord*)(bytes + h->materialsOffset);
+    for (uint32_t i = 0; ok && i < h->numMaterials; i++)
+        ok = materials[i].texture >= -1 && materials[i].texture < (int)h->numTextures;
+
+    // a node's parent comes before it
+    const BoundsNode *nodes = (const BoundsNode*)(bytes + h->nodesOffset);
+    for (uint32_t i = 0; ok && i < h->numNodes; i++)
+        ok = i == 0 ? nodes[i].parent == NoParent : nodes[i].parent < i;
+
+    const DrawRange *ranges = (const DrawRange*)(bytes + h->rangesOffset);
+    const DrawBatch *batches = (const DrawBatch*)(bytes + h->batchesOffset);
+    for (uint32_t i = 0; ok && i < h->numBatches; i++) {
+        const DrawBatch &b = batches[i];
+        ok = b.material < h->numMaterials
+            && in_range(h, b.positions, b.vertices, 3)
+            && in_range(h, b.normals, b.vertices, 3)
+            && (!(b.flags & BATCH_TEXCOORDS) || in_range(h, b.texcoords, b.vertices, 2))
+            && (!(b.flags & BATCH_COLORED) || in_range(h, b.colors, b.vertices, 4));
+
+        // triangles, lines and points follow each other and fill the vertices
+        int64_t end = 0;
+        for (int k = 0; ok && k < 3; k++) {
+            ok = b.first[k] == end && b.count[k] >= 0;
+            end += b.count[k];
+        }
+        ok = ok && end == b.vertices;
+
+        // the ranges of a primitive class lie within its vertices
+        for (int k = 0; ok && k < 3; k++) {
+            ok = (uint64_t)b.firstRange[k] + b.rangeCount[k] <= h->numRanges;
+            for (uint32_t r = b.firstRange[k]; ok && r < b.firstRange[k] + b.rangeCount[k]; r++)
+                ok = ranges[r].node < h->numNodes
+                    && ranges[r].first >= b.first[k]
+                    && ranges[r].count >= 0
+                    && (int64_t)ranges[r].first + ranges[r].count <= (int64_t)b.first[k] + b.count[k];
+        }
+    }
+
+    if (!ok) {
+        munmap(base, size);
+        return false;
+    }
+
+    cs->materials.assign(materials, materials + h->numMaterials);
+    cs->batches.assign(batches, batches + h->numBatches);
+    cs->ranges.assign(ranges, ranges + h->numRanges);
+    cs->nodes.assign(nodes, nodes + h->numNodes);
+    for (uint32_t i = 0; i < h->numTextures; i++)
+        cs->textureNames.push_back(strdup(strings[i]));
+    cs->vertexData.clear();
+    cs->data = (const GLfloat*)(bytes + h->dataOffset);
+    cs->dataSize = h->dataSize;
+    cs->mapping = base;
+    cs->mappingSize = size;
+    return true;
+}
+
+void
+unmap_scene_cache(CompiledScene *cs)
+{
+    if (cs->mapping)
+        munmap(cs->mapping, cs->mappingSize);
+    cs->mapping = NULL;
+    cs->mappingSize = 0;
+}
+
+static bool
+write_at(FILE *fp, uint64_t offset, const void *data, size_t size)
+{
+    return fseeko(fp, offset, SEEK_SET) == 0 && (size == 0 || fwrite(data, size, 1, fp) == 1);
+}
+
+bool
+save_scene_cache(const char *filename, uint64_t key, unsigned int flags,
+                 const CompiledScene *cs, const std::vector<std::string> &dependencies)
+{
+    CacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC));
+    h.version = SCENE_CACHE_VERSION;
+    h.byteOrder = 0x01020304;
+    h.materialSize = sizeof(MaterialRecord);
+    h.batchSize = sizeof(DrawBatch);
+    h.rangeSize = sizeof(DrawRange);
+    h.nodeSize = sizeof(BoundsNode);
+    h.key = key;
+    h.flags = flags;
+    h.numMaterials = cs->materials.size();
+    h.numTextures = cs->textureNames.size();
+    h.numBatches = cs->batches.size();
+    h.numRanges = cs->ranges.size();
+    h.numNodes = cs->nodes.size();
+
+    std::string strings;
+    for (size_t i = 0; i < cs->textureNames.size(); i++) {
+        strings += cs->textureNames[i];
+        strings += '\0';
+    }
+
+    std::vector<CacheDependency> deps;
+    for (size_t i = 0; i < dependencies.size(); i++) {
+        struct stat st;
+        if (stat(dependencies[i].c_str(), &st) != 0)
+            continue;
+        CacheDependency d = { (uint64_t)st.st_size, (int64_t)st.st_mtime };
+        deps.push_back(d);
+        strings += dependencies[i];
+        strings += '\0';
+    }
+    h.numDependencies = deps.size();
+
+    h.materialsOffset = align16(sizeof(CacheHeader));
+    h.batchesOffset = align16(h.materialsOffset + h.numMaterials * sizeof(MaterialRecord));
+    h.rangesOffset = align16(h.batchesOffset + h.numBatches * sizeof(DrawBatch));
+    h.nodesOffset = align16(h.rangesOffset + h.numRanges * sizeof(DrawRange));
+    h.dependenciesOffset = align16(h.nodesOffset + h.numNodes * sizeof(BoundsNode));
+    h.stringsOffset = align16(h.dependenciesOffset + h.numDependencies * sizeof(CacheDependency));
+    h.stringsSize = strings.size();
+    h.dataOffset = align16(h.stringsOffset + h.stringsSize);
+    h.dataSize = cs->dataSize;
+    h.fileSize = h.dataOffset + h.dataSize * sizeof(GLfloat);
+
+    // a name of its own for every writer, jobs on threads of one process may write the same entry
+    char tmpname[4096];
+    snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+    int fd = mkstemp(tmpname);
+    if (fd < 0)
+        return false;
+    // mkstemp() creates the file private, cache entries are shared
+    fchmod(fd, 0644);
+    FILE *fp = fdopen(fd, "wb");
+    if (!fp) {
+        close(fd);
+        unlink(tmpname);
+        return false;
+    }
+
+    bool ok = write_at(fp, 0, &h, sizeof(h))
+        && write_at(fp, h.materialsOffset, cs->materials.empty() ? NULL : &cs->materials[0], h.numMaterials * sizeof(MaterialRecord))
+        && write_at(fp, h.batchesOffset, cs->batches.empty() ? NULL : &cs->batches[0], h.numBatches * sizeof(DrawBatch))
+        && write_at(fp, h.rangesOffset, cs->ranges.empty() ? NULL : &cs->ranges[0], h.numRanges * sizeof(DrawRange))
+        && write_at(fp, h.nodesOffset, cs->nodes.empty() ? NULL : &cs->nodes[0], h.numNodes * sizeof(BoundsNode))
+        && write_at(fp, h.dependenciesOffset, deps.empty() ? NULL : &deps[0], h.numDependencies * sizeof(CacheDependency))
+        && write_at(fp, h.stringsOffset, strings.data(), h.stringsSize)
+        && write_at(fp, h.dataOffset, cs->data, h.dataSize * sizeof(GLfloat));
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmpname, filename) != 0) {
+        unlink(tmpname);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,42 @@
+/*
+ * On-disk cache of compiled scenes
+ *
+ * A cache file holds everything CompileScene() produces for a model: material
+ * records, texture filenames, draw batches with the bounds of their instances
+ * and of the scene's nodes, and the world space vertex data, laid out so that
+ * the file can be mapped and drawn from directly. Files are named by a hash of
+ * the model file's contents and canonical path and by the Assimp
+ * post-processing flags; other files the importer read (material libraries and
+ * such) are recorded with their size and modification time and checked when
+ * the file is mapped. The path is part of the key because those files are
+ * found relative to the model: a copy of it elsewhere reads other ones.
+ */
+
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "render.h"
+
+// 64 bit FNV-1a hash of a file's contents, false if it can't be read
+bool hash_file(const char *filename, uint64_t *hash);
+
+// continue an FNV-1a hash with the characters of str
+void hash_string(const char *str, uint64_t *hash);
+
+/* map a cache file written for the same key and flags into cs, false if there is
+ * none, it was written by another version or one of its dependencies changed */
+bool map_scene_cache(const char *filename, uint64_t key, unsigned int flags, CompiledScene *cs);
+
+// unmap the file mapped into cs, if any
+void unmap_scene_cache(CompiledScene *cs);
+
+/* write cs to filename, dependencies are the other files the import read. The
+ * file is written under a unique temporary name and renamed, so concurrent
+ * renders never see a partial file and concurrent writers don't mix. */
+bool save_scene_cache(const char *filename, uint64_t key, unsigned int flags,
+                      const CompiledScene *cs, const std::vector<std::string> &dependencies);
+
+#endif
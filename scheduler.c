@@ -0,0 +1,347 @@
+/*
+ * Core budget scheduler for batch runs, see scheduler.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "scheduler.h"
+
+struct Worker {
+    pid_t pid;
+    int cores;                 // rasterizer threads, and cores it is pinned to
+    std::vector<int> slots;    // its cores, indices into the core budget
+    FILE *to, *from;
+    int job;                   // the job it runs, -1 while idle
+};
+
+/* Render time is modeled as a * triangles + b * pixels / k for a worker with k
+ * rasterizer threads: llvmpipe transforms vertices on the calling thread and
+ * spreads only the rasterization over its threads. The rest of a job (import,
+ * textures, encoding) is taken as independent of k. a and b are fitted by least
+ * squares over the finished jobs. */
+struct CostModel {
+    int n;
+    double sxx, sxy, syy, sxr, syr;    // x = triangles, y = pixels / k, r = render seconds
+    double other, triangles, pixels;   // sums over the jobs
+};
+
+static void
+model_add(CostModel *m, const JobStats &st, int k)
+{
+    double x = st.triangles, y = st.pixels / k, r = st.renderSeconds;
+    m->n++;
+    m->sxx += x * x;
+    m->sxy += x * y;
+    m->syy += y * y;
+    m->sxr += x * r;
+    m->syr += y * r;
+    m->other += std::max(0.0, st.seconds - st.renderSeconds);
+    m->triangles += st.triangles;
+    m->pixels += st.pixels;
+}
+
+// predicted seconds of an average job with k rasterizer threads
+static double
+model_job_seconds(const CostModel *m, int k)
+{
+    double a = 0, b = 0;
+    double det = m->sxx * m->syy - m->sxy * m->sxy;
+    if (det > 1e-9 * m->sxx * m->syy) {
+        a = (m->syy * m->sxr - m->sxy * m->syr) / det;
+        b = (m->sxx * m->syr - m->sxy * m->sxr) / det;
+    }
+    if (a < 0 || b < 0 || det <= 1e-9 * m->sxx * m->syy) {
+        // not enough variety to tell the two apart, count it all as fill
+        a = 0;
+        b = m->syy > 0 ? m->syr / m->syy : 0;
+    }
+    return (m->other + a * m->triangles + b * m->pixels / k) / m->n;
+}
+
+/* cores per worker that finishes the remaining jobs soonest, jobs run in rounds
+ * of cores / k at a time. Changing the split costs new processes, so the
+ * current one is kept unless another is clearly better. */
+static int
+plan_split(const CostModel *m, int cores, size_t remaining, int current)
+{
+    if (m->n == 0 || remaining == 0)
+        return current;
+
+    int best = current;
+    double bestTime = 0;
+    for (int k = 1; k <= cores; k++) {
+        size_t workers = cores / k;
+        double t = ((remaining + workers - 1) / workers) * model_job_seconds(m, k);
+        if (k == 1 || t < bestTime) {
+            best = k;
+            bestTime = t;
+        }
+    }
+
+    size_t workers = cores / current;
+    double currentTime = ((remaining + workers - 1) / workers) * model_job_seconds(m, current);
+    return bestTime < 0.9 * currentTime ? best : current;
+}
+
+void
+serve_jobs(FILE *in, FILE *out, void *worker, const WorkerOps *ops)
+{
+    char line[4096];
+    while (fgets(line, sizeof(line), in)) {
+        JobStats st;
+        memset(&st, 0, sizeof(st));
+        bool ok = ops->run(worker, line, &st);
+        fflush(stdout);
+        fprintf(out, "%d %g %g %g %g\n", ok, st.seconds, st.renderSeconds, st.triangles, st.pixels);
+        fflush(out);
+    }
+}
+
+/* fork a worker pinned to the given core slots, NULL if that fails */
+static Worker *
+start_worker(int cores, const std::vector<int> &slots, const std::vector<int> &cpus,
+             const std::vector<Worker*> &workers, const WorkerOps *ops)
+{
+    int down[2], up[2];
+    if (pipe(down) != 0)
+        return NULL;
+    if (pipe(up) != 0) {
+        close(down[0]);
+        close(down[1]);
+        return NULL;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(down[0]); close(down[1]);
+        close(up[0]);   close(up[1]);
+        return NULL;
+    }
+
+    if (pid == 0) {
+        // the other workers must see EOF when the supervisor closes their pipes
+        for (size_t i = 0; i < workers.size(); i++) {
+            close(fileno(workers[i]->to));
+            close(fileno(workers[i]->from));
+        }
+        close(down[1]);
+        close(up[0]);
+
+        if ((int)cpus.size() >= (int)slots.size()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (size_t i = 0; i < slots.size(); i++)
+                CPU_SET(cpus[slots[i] % cpus.size()], &set);
+            sched_setaffinity(0, sizeof(set), &set);
+        }
+
+        // llvmpipe reads this when the first context is created, 0 rasterizes on the calling thread
+        char threads[16];
+        snprintf(threads, sizeof(threads), "%d", cores > 1 ? cores : 0);
+        setenv("LP_NUM_THREADS", threads, 1);
+
+        void *state = ops->start(cores);
+        if (state) {
+            FILE *in = fdopen(down[0], "r");
+            FILE *out = fdopen(up[1], "w");
+            serve_jobs(in, out, state, ops);
+            ops->stop(state);
+        }
+        fflush(stdout);
+        fflush(stderr);
+        _exit(state ? 0 : 1);
+    }
+
+    close(down[0]);
+    close(up[1]);
+    Worker *w = new Worker;
+    w->pid = pid;
+    w->cores = cores;
+    w->slots = slots;
+    w->to = fdopen(down[1], "w");
+    w->from = fdopen(up[0], "r");
+    w->job = -1;
+    return w;
+}
+
+static void
+send_job(Worker *w, int job, const std::vector<std::string> &jobs)
+{
+    w->job = job;
+    fputs(jobs[job].c_str(), w->to);
+    if (jobs[job][jobs[job].size() - 1] != '\n')
+        fputc('\n', w->to);
+    fflush(w->to);
+}
+
+static void
+stop_worker(Worker *w, std::vector<bool> *slotUsed)
+{
+    fclose(w->to);
+    fclose(w->from);
+    waitpid(w->pid, NULL, 0);
+    for (size_t i = 0; i < w->slots.size(); i++)
+        (*slotUsed)[w->slots[i]] = false;
+    delete w;
+}
+
+int
+run_scheduled_manifest(const char *filename, int cores, const WorkerOps *ops)
+{
+    FILE *fp = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+    if (!fp) {
+        fprintf(stderr, "Couldn't open manifest: %s\n", filename);
+        return -1;
+    }
+
+    // the jobs are read up front, the plan depends on how many are left
+    std::vector<std::string> jobs;
+    std::vector<int> linenos;
+    char line[4096];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        const char *p = line + strspn(line, " \t\r\n");
+        if (*p == 0 || *p == '#')
+            continue;
+        jobs.push_back(line);
+        linenos.push_back(lineno);
+    }
+    if (fp != stdin)
+        fclose(fp);
+
+    std::vector<int> cpus;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &set))
+                cpus.push_back(c);
+    }
+    if (cores <= 0)
+        cores = cpus.empty() ? 1 : cpus.size();
+
+    // a worker that dies must not take the supervisor with it
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<bool> slotUsed(cores, false);
+    std::vector<Worker*> workers;
+    CostModel model;
+    memset(&model, 0, sizeof(model));
+    size_t next = 0, done = 0;
+    int failed = 0;
+
+    // few jobs get the cores to themselves until there are measurements
+    int split = std::max<int>(1, std::min<size_t>(cores, cores / std::max<size_t>(1, jobs.size())));
+    printf("scheduler: %d cores as %d workers x %d rasterizer threads\n", cores, cores / split, split);
+
+    while (done < jobs.size()) {
+        // idle workers get the next job, or leave when their share no longer fits
+        for (size_t i = 0; i < workers.size(); i++) {
+            Worker *w = workers[i];
+            if (w->job >= 0)
+                continue;
+            if (next < jobs.size() && w->cores == split) {
+                send_job(w, next++, jobs);
+                continue;
+            }
+            stop_worker(w, &slotUsed);
+            workers.erase(workers.begin() + i);
+            i--;
+        }
+
+        // start workers on free cores while there are jobs nobody took
+        while (next < jobs.size()) {
+            std::vector<int> slots;
+            for (int c = 0; c < cores && (int)slots.size() < split; c++)
+                if (!slotUsed[c])
+                    slots.push_back(c);
+            if ((int)slots.size() < split)
+                break;
+
+            Worker *w = start_worker(split, slots, cpus, workers, ops);
+            if (!w) {
+                fprintf(stderr, "Couldn't start a worker\n");
+                break;
+            }
+            for (size_t i = 0; i < slots.size(); i++)
+                slotUsed[slots[i]] = true;
+            send_job(w, next++, jobs);
+            workers.push_back(w);
+        }
+
+        if (workers.empty()) {
+            // not even one worker could be started
+            failed += jobs.size() - done;
+            break;
+        }
+
+        std::vector<struct pollfd> fds(workers.size());
+        for (size_t i = 0; i < workers.size(); i++) {
+            fds[i].fd = fileno(workers[i]->from);
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll(&fds[0], fds.size(), -1) < 0)
+            continue;
+
+        for (size_t i = 0; i < workers.size(); i++) {
+            Worker *w = workers[i];
+            if (!fds[i].revents || w->job < 0)
+                continue;
+
+            JobStats st;
+            int ok;
+            bool answered = fgets(line, sizeof(line), w->from)
+                && sscanf(line, "%d %lf %lf %lf %lf", &ok, &st.seconds, &st.renderSeconds, &st.triangles, &st.pixels) == 5;
+            done++;
+            if (!answered) {
+                // the worker crashed on this job
+                fprintf(stderr, "%s:%d: job failed, worker exited\n", filename, linenos[w->job]);
+                failed++;
+                w->job = -1;
+                stop_worker(w, &slotUsed);
+                workers[i] = NULL;
+                continue;
+            }
+
+            if (!ok) {
+                fprintf(stderr, "%s:%d: job failed\n", filename, linenos[w->job]);
+                failed++;
+            }
+            else {
+                model_add(&model, st, w->cores);
+            }
+            w->job = -1;
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (!workers[i]) {
+                workers.erase(workers.begin() + i);
+                i--;
+            }
+        }
+
+        int planned = plan_split(&model, cores, jobs.size() - next, split);
+        if (planned != split) {
+            split = planned;
+            printf("scheduler: %d cores as %d workers x %d rasterizer threads\n", cores, cores / split, split);
+        }
+    }
+
+    for (size_t i = 0; i < workers.size(); i++)
+        stop_worker(workers[i], &slotUsed);
+
+    printf("%d of %d jobs done\n", (int)jobs.size() - failed, (int)jobs.size());
+    return failed;
+}
@@ -0,0 +1,42 @@
+/*
+ * Core budget scheduler for batch runs
+ *
+ * Jobs of a manifest run in worker processes, each with a share of the cores:
+ * a worker with k cores is pinned to them and told to start k rasterizer
+ * threads (LP_NUM_THREADS) before it creates its OSMesa context, so the run
+ * never has more busy threads than cores. The supervisor picks k from the
+ * triangle counts, image sizes and times the workers report and replaces
+ * workers whose share no longer fits.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdio.h>
+
+// what a worker reports about a job
+struct JobStats {
+    double seconds;          // the whole job
+    double renderSeconds;    // drawing, summed over the views
+    double triangles;        // drawn, summed over the views
+    double pixels;           // rendered, summed over the views
+};
+
+// how a worker process runs jobs, all called in the worker
+struct WorkerOps {
+    // set up a worker with the given number of cores, NULL if that fails
+    void *(*start)(int cores);
+    // run one manifest line, false if the job failed
+    bool (*run)(void *worker, char *line, JobStats *stats);
+    void (*stop)(void *worker);
+};
+
+/* run every job of a manifest on worker processes sharing cores CPUs, returns
+ * the number of failed jobs or -1 if the manifest can't be read */
+int run_scheduled_manifest(const char *filename, int cores, const WorkerOps *ops);
+
+/* run jobs read line by line from in in this process, answering each with a
+ * stats line on out, until in is closed; used by the worker processes */
+void serve_jobs(FILE *in, FILE *out, void *worker, const WorkerOps *ops);
+
+#endif
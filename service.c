@@ -0,0 +1,276 @@
+/*
+ * Persistent render service on a UNIX domain socket, see service.h
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+#include "service.h"
+
+#define MAX_ARGS 64    // argv entries of a job, argv[0] included
+
+static volatile sig_atomic_t stopping = 0;
+
+static void
+stop_service(int sig)
+{
+    (void) sig;
+    stopping = 1;
+}
+
+static bool
+socket_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+/* read a request, one argument per line up to an empty line, into argv, the
+ * arguments are malloc'ed; the directory of a leading "-cwd dir" goes into cwd.
+ * One argument more than MAX_ARGS is kept, so that requests that are too long
+ * can be rejected. False if the connection ends first. */
+static bool
+read_request(FILE *in, std::vector<char*> *args, std::string *cwd)
+{
+    char line[4096];
+    bool dir = false;
+    args->push_back(strdup("render"));
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0)
+            return true;
+        if (dir) {
+            *cwd = line;
+            dir = false;
+        }
+        else if (args->size() == 1 && cwd->empty() && !strcmp(line, "-cwd"))
+            dir = true;
+        else if (args->size() <= MAX_ARGS)
+            args->push_back(strdup(line));
+    }
+    return false;
+}
+
+/* run a request in its client's directory, so that its relative paths mean what
+ * they meant there, and write the answer; false if the job failed */
+static bool
+run_request(int argc, char *argv[], const std::string &cwd, void *state, ServiceJob run,
+            char *answer, size_t size)
+{
+    if (argc > MAX_ARGS) {
+        fprintf(stderr, "Request with more than %d arguments rejected\n", MAX_ARGS - 1);
+        snprintf(answer, size, "failed: more than %d arguments\n", MAX_ARGS - 1);
+        return false;
+    }
+    if (!cwd.empty() && chdir(cwd.c_str()) != 0) {
+        fprintf(stderr, "Couldn't change to %s: %s\n", cwd.c_str(), strerror(errno));
+        snprintf(answer, size, "failed: no such directory\n");
+        return false;
+    }
+
+    JobStats st;
+    memset(&st, 0, sizeof(st));
+    bool ok = run(state, argc, argv, &st);
+    fflush(stdout);
+    fflush(stderr);
+    if (ok)
+        snprintf(answer, size, "ok %0.3fs\n", st.seconds);
+    else
+        snprintf(answer, size, "failed\n");
+    return ok;
+}
+
+// take connections until the supervisor stops the worker
+static void
+serve_connections(int listener, void *state, ServiceJob run)
+{
+    // requests that don't name a directory run in the service's
+    char home[PATH_MAX];
+    if (!getcwd(home, sizeof(home)))
+        strcpy(home, "/");
+
+    while (!stopping) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            return;
+        }
+
+        FILE *in = fdopen(fd, "r");
+        if (!in) {
+            perror("fdopen");
+            close(fd);
+            continue;
+        }
+        std::vector<char*> args;
+        std::string cwd;
+        if (read_request(in, &args, &cwd)) {
+            char answer[100];
+            run_request(args.size(), &args[0], cwd, state, run, answer, sizeof(answer));
+            if (chdir(home) != 0)
+                perror(home);
+            int len = strlen(answer);
+            if (write(fd, answer, len) != len)
+                perror("write");
+        }
+        for (size_t i = 0; i < args.size(); i++)
+            free(args[i]);
+        fclose(in);
+    }
+}
+
+static pid_t
+fork_worker(int listener, void *state, ServiceJob run)
+{
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        serve_connections(listener, state, run);
+        fflush(stdout);
+        _exit(0);
+    }
+    if (pid < 0)
+        perror("fork");
+    return pid;
+}
+
+bool
+run_service(const char *path, int workers, void *state, ServiceJob run)
+{
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr))
+        return false;
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("socket");
+        return false;
+    }
+    /* jobs write files as the service's user wherever they ask to, so only
+     * that user may connect: the socket is created with mode 0600 */
+    unlink(path);
+    mode_t mask = umask(077);
+    bool bound = bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || listen(listener, 128) != 0) {
+        fprintf(stderr, "Couldn't listen on %s: %s\n", path, strerror(errno));
+        close(listener);
+        return false;
+    }
+
+    // a client that hangs up early must not kill the worker answering it
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_service;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    std::vector<pid_t> pids;
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork_worker(listener, state, run);
+        if (pid > 0)
+            pids.push_back(pid);
+    }
+    printf("serving on %s with %d workers\n", path, (int)pids.size());
+    fflush(stdout);
+
+    while (!stopping && !pids.empty()) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (size_t i = 0; i < pids.size(); i++) {
+            if (pids[i] != pid)
+                continue;
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "worker %d killed by signal %d, starting another\n", (int)pid, WTERMSIG(status));
+            else
+                fprintf(stderr, "worker %d exited, starting another\n", (int)pid);
+            pid_t replacement = stopping ? -1 : fork_worker(listener, state, run);
+            if (replacement > 0)
+                pids[i] = replacement;
+            else
+                pids.erase(pids.begin() + i);
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < pids.size(); i++)
+        kill(pids[i], SIGTERM);
+    for (size_t i = 0; i < pids.size(); i++)
+        waitpid(pids[i], NULL, 0);
+    close(listener);
+    unlink(path);
+    return true;
+}
+
+bool
+service_request(const char *path, int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr))
+        return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Couldn't connect to %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    // relative paths of the job are resolved in the client's directory
+    FILE *conn = fdopen(fd, "r+");
+    if (!conn) {
+        perror("fdopen");
+        close(fd);
+        return false;
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)))
+        fprintf(conn, "-cwd\n%s\n", cwd);
+    for (int i = 1; i < argc; i++)
+        fprintf(conn, "%s\n", argv[i]);
+    fprintf(conn, "\n");
+    fflush(conn);
+
+    char answer[100];
+    bool ok = false;
+    if (fgets(answer, sizeof(answer), conn)) {
+        fputs(answer, stdout);
+        ok = !strncmp(answer, "ok", 2);
+    }
+    else {
+        fprintf(stderr, "The service dropped the job\n");
+    }
+    fclose(conn);
+    return ok;
+}
@@ -0,0 +1,30 @@
+/*
+ * Persistent render service on a UNIX domain socket
+ *
+ * The supervisor sets up everything once, then forks workers that inherit the
+ * set up state copy-on-write and take connections on the shared listening
+ * socket. A request is a job written like the command line, one argument per
+ * line and an empty line at the end, at most 63 of them. It may start
+ * with "-cwd" and a directory on the next line, the job's relative paths are
+ * then resolved there. The answer is a line starting with "ok" or "failed".
+ * Workers that exit, because a model crashed them for instance, are replaced.
+ */
+
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include "scheduler.h"
+
+// run a job in a worker, argv[0] is not used
+typedef bool (*ServiceJob)(void *state, int argc, char *argv[], JobStats *stats);
+
+/* serve jobs on a socket at path with the given number of workers until
+ * SIGINT or SIGTERM, state is what the supervisor set up; returns false if the
+ * socket can't be set up. Only the user running the service may connect. */
+bool run_service(const char *path, int workers, void *state, ServiceJob run);
+
+/* send a job to the service at path, run in the current directory, and print
+ * its answer; false if the job failed or the service couldn't be reached */
+bool service_request(const char *path, int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,684 @@
+/*
+ * Out-of-core path for models larger than memory, see streaming.h
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+
+#include "streaming.h"
+
+enum { STL_RECORD = 50, STL_BLOCK = 4096 };    // binary STL records read at a time
+
+// triangles on their way to the spill file, cut into chunks
+struct TriangleSink {
+    FILE *fp;
+    StreamedModel *m;
+    StreamedChunk chunk;
+    bool ok;
+};
+
+// vertices of an indexed format, spilled while reading and mapped for the faces
+struct VertexSpill {
+    FILE *fp;
+    uint64_t count;
+    const float *vertices;    // 3 per vertex once mapped
+    size_t mappingSize;
+};
+
+/* an unlinked temporary file in dir, -1 on errors */
+static int
+spill_file(const char *dir)
+{
+    std::string path = std::string(dir ? dir : "/tmp") + "/render-spill-XXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back(0);
+
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) {
+        fprintf(stderr, "Couldn't create spill file in %s: %s\n", dir ? dir : "/tmp", strerror(errno));
+        return -1;
+    }
+    unlink(&name[0]);
+    return fd;
+}
+
+static void
+reset_bounds(float min[3], float max[3])
+{
+    for (int k = 0; k < 3; k++) {
+        min[k] = HUGE_VALF;
+        max[k] = -HUGE_VALF;
+    }
+}
+
+static void
+extend_bounds(float min[3], float max[3], const float p[3])
+{
+    for (int k = 0; k < 3; k++) {
+        if (p[k] < min[k]) min[k] = p[k];
+        if (p[k] > max[k]) max[k] = p[k];
+    }
+}
+
+static void
+flush_chunk(TriangleSink *sink)
+{
+    if (sink->chunk.triangles == 0)
+        return;
+    sink->m->chunks.push_back(sink->chunk);
+    sink->chunk.first += sink->chunk.triangles;
+    sink->chunk.triangles = 0;
+    reset_bounds(sink->chunk.min, sink->chunk.max);
+}
+
+/* append a triangle with the flat normal the renderer gives faces,
+ * -normalize(cross(p1-p0, p2-p0)), zero for degenerate triangles */
+static void
+emit_triangle(TriangleSink *sink, const float *p0, const float *p1, const float *p2, const float n[3])
+{
+    float t[STREAMED_FLOATS_PER_TRIANGLE];
+    const float *p[3] = { p0, p1, p2 };
+    for (int i = 0; i < 3; i++) {
+        memcpy(t + 6*i, n, 3 * sizeof(float));
+        memcpy(t + 6*i + 3, p[i], 3 * sizeof(float));
+        extend_bounds(sink->chunk.min, sink->chunk.max, p[i]);
+    }
+    if (fwrite(t, sizeof(t), 1, sink->fp) != 1)
+        sink->ok = false;
+
+    sink->m->triangles++;
+    if (++sink->chunk.triangles == sink->m->chunkTriangles)
+        flush_chunk(sink);
+}
+
+static void
+face_normal(const float *p0, const float *p1, const float *p2, float n[3])
+{
+    float ax = p1[0] - p0[0], ay = p1[1] - p0[1], az = p1[2] - p0[2];
+    float bx = p2[0] - p0[0], by = p2[1] - p0[1], bz = p2[2] - p0[2];
+    float cx = ay * bz - by * az;
+    float cy = az * bx - bz * ax;
+    float cz = ax * by - bx * ay;
+    float len2 = cx * cx + cy * cy + cz * cz;
+    float scale = (len2 > 0.0f && len2 < HUGE_VALF) ? -1.0f / sqrtf(len2) : 0.0f;
+    n[0] = cx * scale;
+    n[1] = cy * scale;
+    n[2] = cz * scale;
+}
+
+/* a polygon becomes a fan around its first vertex, with the normal of its
+ * first three vertices like imported faces; lines and points are dropped */
+static void
+emit_polygon(TriangleSink *sink, const std::vector<const float*> &p)
+{
+    if (p.size() < 3)
+        return;
+    float n[3];
+    face_normal(p[0], p[1], p[2], n);
+    for (size_t i = 2; i < p.size(); i++)
+        emit_triangle(sink, p[0], p[i-1], p[i], n);
+}
+
+static void
+spill_vertex(VertexSpill *vs, StreamedModel *m, const float p[3])
+{
+    fwrite(p, sizeof(float), 3, vs->fp);
+    extend_bounds(m->min, m->max, p);
+    vs->count++;
+}
+
+/* map the spilled vertices for the faces, the mapping is backed by the page
+ * cache and not by the heap */
+static bool
+map_vertices(VertexSpill *vs)
+{
+    if (fflush(vs->fp) != 0) {
+        fprintf(stderr, "Couldn't write spill file: %s\n", strerror(errno));
+        return false;
+    }
+    vs->mappingSize = vs->count * 3 * sizeof(float);
+    if (vs->mappingSize == 0)
+        return true;
+
+    void *p = mmap(NULL, vs->mappingSize, PROT_READ, MAP_SHARED, fileno(vs->fp), 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Couldn't map spill file: %s\n", strerror(errno));
+        vs->mappingSize = 0;
+        return false;
+    }
+    madvise(p, vs->mappingSize, MADV_RANDOM);
+    vs->vertices = (const float*)p;
+    return true;
+}
+
+static bool
+open_vertex_spill(VertexSpill *vs, const char *tmpdir)
+{
+    memset(vs, 0, sizeof(*vs));
+    int fd = spill_file(tmpdir);
+    if (fd < 0)
+        return false;
+    vs->fp = fdopen(fd, "w+");
+    return vs->fp != NULL;
+}
+
+static void
+close_vertex_spill(VertexSpill *vs)
+{
+    if (vs->vertices)
+        munmap((void*)vs->vertices, vs->mappingSize);
+    if (vs->fp)
+        fclose(vs->fp);
+}
+
+// vertex i of the spill, NULL if there is no such vertex
+static const float *
+spilled_vertex(const VertexSpill *vs, int64_t i)
+{
+    if (i < 0 || (uint64_t)i >= vs->count)
+        return NULL;
+    return vs->vertices + 3 * i;
+}
+
+/* the first three numbers of s, false if there are less */
+static bool
+parse_position(const char *s, float p[3])
+{
+    for (int k = 0; k < 3; k++) {
+        char *end;
+        p[k] = strtof(s, &end);
+        if (end == s)
+            return false;
+        s = end;
+    }
+    return true;
+}
+
+/* OBJ: "v x y z" and "f a/b/c ..." lines, 1-based or negative indices. The
+ * vertices are spilled in a first pass, the faces are read in a second pass
+ * over the file. */
+static bool
+read_obj(FILE *fp, VertexSpill *vs, TriangleSink *sink, const char *filename)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    float p[3];
+
+    while (getline(&line, &cap, fp) >= 0)
+        if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t') && parse_position(line + 2, p))
+            spill_vertex(vs, sink->m, p);
+    if (!map_vertices(vs)) {
+        free(line);
+        return false;
+    }
+
+    rewind(fp);
+    std::vector<const float*> face;
+    uint64_t seen = 0;    // negative indices count back from the vertices read so far
+    int lineno = 0;
+    bool ok = true;
+    while (ok && getline(&line, &cap, fp) >= 0) {
+        lineno++;
+        if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t') && parse_position(line + 2, p))
+            seen++;
+        if (line[0] != 'f' || (line[1] != ' ' && line[1] != '\t'))
+            continue;
+
+        face.clear();
+        char *s = line + 2;
+        for (;;) {
+            char *end;
+            long long i = strtoll(s, &end, 10);
+            if (end == s)
+                break;
+            const float *v = spilled_vertex(vs, i < 0 ? (int64_t)seen + i : i - 1);
+            if (!v) {
+                fprintf(stderr, "%s:%d: bad vertex index %lld\n", filename, lineno, i);
+                ok = false;
+                break;
+            }
+            face.push_back(v);
+            s = end + strcspn(end, " \t\r\n");    // skip /vt/vn
+        }
+        emit_polygon(sink, face);
+    }
+
+    free(line);
+    return ok;
+}
+
+// the next line that isn't blank or a comment, NULL at the end of the file
+static char *
+off_line(FILE *fp, char **line, size_t *cap)
+{
+    while (getline(line, cap, fp) >= 0) {
+        char *s = *line + strspn(*line, " \t\r\n");
+        if (*s && *s != '#')
+            return s;
+    }
+    return NULL;
+}
+
+/* OFF: a header, the counts, one vertex per line and "n i0 i1 ... [color]" per face */
+static bool
+read_off(FILE *fp, VertexSpill *vs, TriangleSink *sink, const char *filename)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    long long nv, nf;
+    bool ok = false;
+
+    char *s = off_line(fp, &line, &cap);
+    const char *keyword = s ? strstr(s, "OFF") : NULL;
+    if (!keyword) {
+        fprintf(stderr, "%s: not an OFF file\n", filename);
+        free(line);
+        return false;
+    }
+    // the counts may follow the keyword on the same line
+    s = (char*)keyword + 3;
+    if (sscanf(s, "%lld %lld", &nv, &nf) != 2) {
+        s = off_line(fp, &line, &cap);
+        if (!s || sscanf(s, "%lld %lld", &nv, &nf) != 2) {
+            fprintf(stderr, "%s: bad OFF header\n", filename);
+            free(line);
+            return false;
+        }
+    }
+
+    float p[3];
+    for (long long i = 0; i < nv; i++) {
+        s = off_line(fp, &line, &cap);
+        if (!s || !parse_position(s, p)) {
+            fprintf(stderr, "%s: bad vertex %lld\n", filename, i);
+            goto done;
+        }
+        spill_vertex(vs, sink->m, p);
+    }
+    if (!map_vertices(vs))
+        goto done;
+
+    {
+        std::vector<const float*> face;
+        for (long long f = 0; f < nf; f++) {
+            s = off_line(fp, &line, &cap);
+            char *end;
+            long n = s ? strtol(s, &end, 10) : -1;
+            if (n < 0) {
+                fprintf(stderr, "%s: bad face %lld\n", filename, f);
+                goto done;
+            }
+            face.clear();
+            for (long k = 0; k < n; k++) {
+                s = end;
+                long long i = strtoll(s, &end, 10);
+                const float *v = end != s ? spilled_vertex(vs, i) : NULL;
+                if (!v) {
+                    fprintf(stderr, "%s: bad face %lld\n", filename, f);
+                    goto done;
+                }
+                face.push_back(v);
+            }
+            emit_polygon(sink, face);
+        }
+    }
+    ok = true;
+
+done:
+    free(line);
+    return ok;
+}
+
+// PLY scalar types, in the order of their names
+enum { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64 };
+
+static const struct {
+    const char *name, *alias;
+    int size;
+} PlyTypes[] = {
+    { "char", "int8", 1 }, { "uchar", "uint8", 1 }, { "short", "int16", 2 }, { "ushort", "uint16", 2 },
+    { "int", "int32", 4 }, { "uint", "uint32", 4 }, { "float", "float32", 4 }, { "double", "float64", 8 }
+};
+
+enum { PLY_ASCII, PLY_LITTLE_ENDIAN, PLY_BIG_ENDIAN };
+
+struct PlyProperty {
+    int type;
+    int countType;    // of a list, -1 for scalars
+    int role;         // 0-2 for x, y, z of a vertex, 3 for the indices of a face, -1 otherwise
+};
+
+struct PlyElement {
+    std::string name;
+    uint64_t count;
+    std::vector<PlyProperty> properties;
+};
+
+static int
+ply_type(const char *name)
+{
+    for (int t = 0; t < (int)(sizeof(PlyTypes) / sizeof(PlyTypes[0])); t++)
+        if (!strcmp(name, PlyTypes[t].name) || !strcmp(name, PlyTypes[t].alias))
+            return t;
+    return -1;
+}
+
+// one value of the body, false at the end of the file or on a malformed value
+static bool
+read_ply_value(FILE *fp, int format, int type, double *value)
+{
+    if (format == PLY_ASCII)
+        return fscanf(fp, "%lf", value) == 1;
+
+    unsigned char b[8];
+    int size = PlyTypes[type].size;
+    if (fread(b, size, 1, fp) != 1)
+        return false;
+
+    static const uint16_t one = 1;
+    bool little = *(const unsigned char*)&one == 1;
+    if (little != (format == PLY_LITTLE_ENDIAN))
+        std::reverse(b, b + size);
+
+    union { int8_t i8; uint8_t u8; int16_t i16; uint16_t u16; int32_t i32; uint32_t u32; float f; double d; } u;
+    memcpy(&u, b, size);
+    switch (type) {
+    case PLY_INT8:    *value = u.i8; break;
+    case PLY_UINT8:   *value = u.u8; break;
+    case PLY_INT16:   *value = u.i16; break;
+    case PLY_UINT16:  *value = u.u16; break;
+    case PLY_INT32:   *value = u.i32; break;
+    case PLY_UINT32:  *value = u.u32; break;
+    case PLY_FLOAT32: *value = u.f; break;
+    default:          *value = u.d; break;
+    }
+    return true;
+}
+
+/* PLY, ASCII or binary: x, y and z of the vertex element are spilled, the
+ * vertex_indices (or vertex_index) list of the face element is triangulated,
+ * all other elements and properties are read and dropped */
+static bool
+read_ply(FILE *fp, VertexSpill *vs, TriangleSink *sink, const char *filename)
+{
+    char line[1024], a[256], b[256], c[256], d[256];
+    std::vector<PlyElement> elements;
+    int format = -1;
+
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, "ply", 3)) {
+        fprintf(stderr, "%s: not a PLY file\n", filename);
+        return false;
+    }
+    for (;;) {
+        if (!fgets(line, sizeof(line), fp)) {
+            fprintf(stderr, "%s: PLY header has no end\n", filename);
+            return false;
+        }
+        if (!strncmp(line, "end_header", 10))
+            break;
+
+        unsigned long long count;
+        if (sscanf(line, "format %255s", a) == 1) {
+            format = !strcmp(a, "ascii") ? PLY_ASCII : !strcmp(a, "binary_little_endian") ? PLY_LITTLE_ENDIAN
+                   : !strcmp(a, "binary_big_endian") ? PLY_BIG_ENDIAN : -1;
+        }
+        else if (sscanf(line, "element %255s %llu", a, &count) == 2) {
+            PlyElement e;
+            e.name = a;
+            e.count = count;
+            elements.push_back(e);
+        }
+        else if (sscanf(line, "property list %255s %255s %255s", a, b, c) == 3 && !elements.empty()) {
+            PlyProperty p = { ply_type(b), ply_type(a), -1 };
+            if (p.type < 0 || p.countType < 0) {
+                fprintf(stderr, "%s: unknown PLY type in %s", filename, line);
+                return false;
+            }
+            if (elements.back().name == "face" && (!strcmp(c, "vertex_indices") || !strcmp(c, "vertex_index")))
+                p.role = 3;
+            elements.back().properties.push_back(p);
+        }
+        else if (sscanf(line, "property %255s %255s", a, d) == 2 && !elements.empty()) {
+            PlyProperty p = { ply_type(a), -1, -1 };
+            if (p.type < 0) {
+                fprintf(stderr, "%s: unknown PLY type in %s", filename, line);
+                return false;
+            }
+            if (elements.back().name == "vertex" && d[0] >= 'x' && d[0] <= 'z' && d[1] == 0)
+                p.role = d[0] - 'x';
+            elements.back().properties.push_back(p);
+        }
+    }
+    if (format < 0) {
+        fprintf(stderr, "%s: unknown PLY format\n", filename);
+        return false;
+    }
+
+    std::vector<const float*> face;
+    bool mapped = false;
+    for (size_t e = 0; e < elements.size(); e++) {
+        const PlyElement &el = elements[e];
+        bool vertex = el.name == "vertex", faces = el.name == "face";
+        if (faces && !mapped) {
+            fprintf(stderr, "%s: PLY faces before the vertices aren't supported\n", filename);
+            return false;
+        }
+
+        for (uint64_t i = 0; i < el.count; i++) {
+            float p[3] = { 0, 0, 0 };
+            face.clear();
+            for (size_t k = 0; k < el.properties.size(); k++) {
+                const PlyProperty &prop = el.properties[k];
+                double value;
+                if (prop.countType < 0) {
+                    if (!read_ply_value(fp, format, prop.type, &value))
+                        goto truncated;
+                    if (prop.role >= 0)
+                        p[prop.role] = value;
+                    continue;
+                }
+
+                double n;
+                if (!read_ply_value(fp, format, prop.countType, &n) || n < 0)
+                    goto truncated;
+                for (uint64_t j = 0; j < (uint64_t)n; j++) {
+                    if (!read_ply_value(fp, format, prop.type, &value))
+                        goto truncated;
+                    if (prop.role == 3) {
+                        const float *v = spilled_vertex(vs, (int64_t)value);
+                        if (!v) {
+                            fprintf(stderr, "%s: bad vertex index %g in face %llu\n", filename, value, (unsigned long long)i);
+                            return false;
+                        }
+                        face.push_back(v);
+                    }
+                }
+            }
+            if (vertex)
+                spill_vertex(vs, sink->m, p);
+            else if (faces)
+                emit_polygon(sink, face);
+        }
+
+        if (vertex) {
+            if (!map_vertices(vs))
+                return false;
+            mapped = true;
+        }
+    }
+    return true;
+
+truncated:
+    fprintf(stderr, "%s: PLY file is truncated\n", filename);
+    return false;
+}
+
+/* STL, binary or ASCII, is a triangle soup already and is read in one pass;
+ * the normals of the file are replaced by the renderer's face normals */
+static bool
+read_stl(FILE *fp, TriangleSink *sink, const char *filename)
+{
+    StreamedModel *m = sink->m;
+    unsigned char header[84];
+    struct stat st;
+    float n[3];
+
+    // binary files are exactly as long as their triangle count says
+    size_t got = fread(header, 1, sizeof(header), fp);
+    uint32_t count = 0;
+    if (got == sizeof(header))
+        memcpy(&count, header + 80, 4);
+    if (got == sizeof(header) && fstat(fileno(fp), &st) == 0 && (uint64_t)st.st_size == 84 + (uint64_t)STL_RECORD * count) {
+        std::vector<unsigned char> block(STL_BLOCK * STL_RECORD);
+        for (uint32_t done = 0; done < count; ) {
+            size_t records = std::min<uint32_t>(STL_BLOCK, count - done);
+            if (fread(&block[0], STL_RECORD, records, fp) != records) {
+                fprintf(stderr, "%s: STL file is truncated\n", filename);
+                return false;
+            }
+            for (size_t r = 0; r < records; r++) {
+                float p[9];
+                memcpy(p, &block[r * STL_RECORD + 12], sizeof(p));
+                for (int k = 0; k < 3; k++)
+                    extend_bounds(m->min, m->max, p + 3*k);
+                face_normal(p, p + 3, p + 6, n);
+                emit_triangle(sink, p, p + 3, p + 6, n);
+            }
+            done += records;
+        }
+        return true;
+    }
+
+    rewind(fp);
+    char word[256];
+    float p[9];
+    int corners = 0;
+    while (fscanf(fp, "%255s", word) == 1) {
+        if (strcasecmp(word, "vertex"))
+            continue;
+        if (fscanf(fp, "%f %f %f", &p[3*corners], &p[3*corners+1], &p[3*corners+2]) != 3) {
+            fprintf(stderr, "%s: bad STL vertex\n", filename);
+            return false;
+        }
+        extend_bounds(m->min, m->max, p + 3*corners);
+        if (++corners == 3) {
+            face_normal(p, p + 3, p + 6, n);
+            emit_triangle(sink, p, p + 3, p + 6, n);
+            corners = 0;
+        }
+    }
+    return true;
+}
+
+static const char *
+extension(const char *filename)
+{
+    const char *ext = strrchr(filename, '.');
+    return ext && !strchr(ext, '/') ? ext + 1 : "";
+}
+
+bool streamable_format(const char *filename)
+{
+    const char *ext = extension(filename);
+    return !strcasecmp(ext, "obj") || !strcasecmp(ext, "off") || !strcasecmp(ext, "ply") || !strcasecmp(ext, "stl");
+}
+
+bool open_streamed_model(const char *filename, const char *tmpdir, size_t budget, StreamedModel *m)
+{
+    m->fd = -1;
+    m->triangles = 0;
+    m->chunks.clear();
+    m->chunkTriangles = std::max<size_t>(1, budget / (STREAMED_FLOATS_PER_TRIANGLE * sizeof(float)));
+    reset_bounds(m->min, m->max);
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "Couldn't open %s\n", filename);
+        return false;
+    }
+
+    TriangleSink sink;
+    sink.m = m;
+    sink.chunk.first = 0;
+    sink.chunk.triangles = 0;
+    reset_bounds(sink.chunk.min, sink.chunk.max);
+    sink.ok = true;
+    int fd = spill_file(tmpdir);
+    sink.fp = fd >= 0 ? fdopen(fd, "w+") : NULL;
+    if (!sink.fp) {
+        fclose(fp);
+        return false;
+    }
+
+    bool ok;
+    const char *ext = extension(filename);
+    if (!strcasecmp(ext, "stl")) {
+        ok = read_stl(fp, &sink, filename);
+    }
+    else {
+        VertexSpill vs;
+        ok = open_vertex_spill(&vs, tmpdir);
+        if (ok && !strcasecmp(ext, "obj"))
+            ok = read_obj(fp, &vs, &sink, filename);
+        else if (ok && !strcasecmp(ext, "off"))
+            ok = read_off(fp, &vs, &sink, filename);
+        else if (ok)
+            ok = read_ply(fp, &vs, &sink, filename);
+        close_vertex_spill(&vs);
+    }
+    fclose(fp);
+
+    flush_chunk(&sink);
+    if (fflush(sink.fp) != 0 || !sink.ok) {
+        fprintf(stderr, "Couldn't write spill file: %s\n", strerror(errno));
+        ok = false;
+    }
+    if (ok)
+        m->fd = dup(fileno(sink.fp));
+    fclose(sink.fp);
+
+    if (!ok || m->fd < 0) {
+        m->chunks.clear();
+        return false;
+    }
+    return true;
+}
+
+bool read_streamed_chunk(const StreamedModel *m, const StreamedChunk &chunk, float *out)
+{
+    const size_t triangleSize = STREAMED_FLOATS_PER_TRIANGLE * sizeof(float);
+    char *dst = (char*)out;
+    size_t left = chunk.triangles * triangleSize;
+    off_t offset = chunk.first * triangleSize;
+
+    while (left > 0) {
+        ssize_t n = pread(m->fd, dst, left, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        dst += n;
+        offset += n;
+        left -= n;
+    }
+    return true;
+}
+
+void close_streamed_model(StreamedModel *m)
+{
+    if (m->fd >= 0)
+        close(m->fd);
+    m->fd = -1;
+    m->triangles = 0;
+    m->chunks.clear();
+}
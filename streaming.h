@@ -0,0 +1,52 @@
+/*
+ * Out-of-core path for models larger than memory
+ *
+ * OBJ, OFF, PLY and STL files are read in a bounded amount of memory and turned
+ * into a spill file of world space triangles with flat normals, in the layout
+ * GL_N3F_V3F expects. Indexed formats first spill their vertices to a temporary
+ * file that is mapped while the faces are read, so the vertices live in the page
+ * cache instead of the heap. The triangles are grouped into chunks that fit the
+ * memory budget, with the bounds of every chunk, and are drawn one chunk at a
+ * time into the same color and depth buffers.
+ *
+ * Materials, texture coordinates and vertex colors are not read, the model is
+ * drawn with the default material. Lines and points are skipped.
+ */
+
+#ifndef STREAMING_H
+#define STREAMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define STREAMED_FLOATS_PER_TRIANGLE 18    // 3 x (normal, position)
+
+struct StreamedChunk {
+    uint64_t first;        // first triangle
+    size_t triangles;
+    float min[3], max[3];
+};
+
+struct StreamedModel {
+    int fd;                           // the triangle spill file, already unlinked
+    uint64_t triangles;
+    float min[3], max[3];             // bounds of all vertices
+    std::vector<StreamedChunk> chunks;
+    size_t chunkTriangles;            // triangles per chunk, what read_streamed_chunk() needs room for
+};
+
+// true if the streaming readers handle the format of filename, by extension
+bool streamable_format(const char *filename);
+
+/* read the model into spill files in tmpdir, chunks are sized so that one of
+ * them takes at most budget bytes; false if the file can't be read */
+bool open_streamed_model(const char *filename, const char *tmpdir, size_t budget, StreamedModel *m);
+
+/* read the triangles of a chunk into out, which holds chunkTriangles triangles,
+ * false on a read error; safe to call from several threads */
+bool read_streamed_chunk(const StreamedModel *m, const StreamedChunk &chunk, float *out);
+
+void close_streamed_model(StreamedModel *m);
+
+#endif
@@ -0,0 +1,445 @@
+/*
+ * Thread-safe texture decoding for the renderer, see texture.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <vector>
+#include <fstream>
+#include <new>
+#include <jpeglib.h>
+#include <png++/png.hpp>
+
+#include "texture.h"
+
+/* Area averaging downscaler that is fed one source row at a time, so the source
+ * image never has to be in memory as a whole. Every destination pixel is the
+ * mean of the source pixels that map onto it. */
+struct BoxFilter {
+    int src_width, src_height;
+    int width, height;
+    std::vector<int> column;          // destination column of every source column
+    std::vector<unsigned int> count;  // source columns per destination column
+    std::vector<uint64_t> sum;        // 3 per destination pixel of the current row
+    int row;                          // destination row being accumulated
+    int rows;                         // source rows accumulated into it
+    unsigned char *data;
+
+    bool init(int sw, int sh, int dw, int dh)
+    {
+        src_width = sw; src_height = sh;
+        width = dw; height = dh;
+        column.resize(sw);
+        count.assign(dw, 0);
+        for (int x = 0; x < sw; x++) {
+            column[x] = (long long)x * dw / sw;
+            count[column[x]]++;
+        }
+        sum.assign(3 * dw, 0);
+        row = 0;
+        rows = 0;
+        data = (unsigned char*)malloc((size_t)dw * dh * 3);
+        return data != NULL;
+    }
+
+    void flush()
+    {
+        unsigned char *out = data + (size_t)row * width * 3;
+        for (int x = 0; x < width; x++) {
+            uint64_t n = (uint64_t)count[x] * rows;
+            for (int c = 0; c < 3; c++)
+                out[3*x+c] = (sum[3*x+c] + n / 2) / n;
+        }
+        sum.assign(3 * width, 0);
+        rows = 0;
+    }
+
+    void add_row(int y, const unsigned char *src)
+    {
+        int dy = (long long)y * height / src_height;
+        if (dy != row) {
+            flush();
+            row = dy;
+        }
+        for (int x = 0; x < src_width; x++) {
+            uint64_t *acc = &sum[3 * column[x]];
+            acc[0] += src[3*x];
+            acc[1] += src[3*x+1];
+            acc[2] += src[3*x+2];
+        }
+        rows++;
+    }
+
+    void finish(Image *img)
+    {
+        flush();
+        img->width = width;
+        img->height = height;
+        img->data = data;
+        data = NULL;
+    }
+};
+
+/* size of a w x h image fit into max_size x max_size, keeping the aspect ratio;
+ * false if it already fits */
+static bool
+fit_size(int w, int h, int max_size, int *dw, int *dh)
+{
+    if (max_size <= 0 || (w <= max_size && h <= max_size))
+        return false;
+    double scale = (double)max_size / (w > h ? w : h);
+    *dw = (int)(w * scale + 0.5);
+    *dh = (int)(h * scale + 0.5);
+    if (*dw < 1) *dw = 1;
+    if (*dh < 1) *dh = 1;
+    if (*dw > max_size) *dw = max_size;
+    if (*dh > max_size) *dh = max_size;
+    return true;
+}
+
+bool
+downscale_image(const unsigned char *data, int width, int height, int max_size, Image *img)
+{
+    BoxFilter box;
+    int dw, dh;
+
+    if (!fit_size(width, height, max_size, &dw, &dh) || !box.init(width, height, dw, dh))
+        return false;
+    for (int y = 0; y < height; y++)
+        box.add_row(y, data + (size_t)y * width * 3);
+    box.finish(img);
+    return true;
+}
+
+/* libjpeg calls error_exit on fatal errors and expects it not to return */
+struct jpeg_error_handler {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+static void
+jpeg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((jpeg_error_handler*)cinfo->err)->jump, 1);
+}
+
+static void
+jpeg_silent_message(j_common_ptr cinfo)
+{
+    (void) cinfo;
+}
+
+/* libjpeg can decode at 1/2, 1/4 or 1/8 scale directly from the DCT
+ * coefficients; the largest of those that does not go below max_size is used
+ * and the rest is left to the box filter */
+static bool
+decode_jpeg(FILE *fp, int max_size, Image *img)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_handler jerr;
+    unsigned char * volatile data = NULL;
+    BoxFilter * volatile box = NULL;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jerr.pub.output_message = jpeg_silent_message;
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(data);
+        if (box)
+            free(box->data);
+        delete box;
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;    // also expands grayscale
+
+    if (max_size > 0) {
+        unsigned int size = cinfo.image_width > cinfo.image_height ? cinfo.image_width : cinfo.image_height;
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = 1;
+        while (cinfo.scale_denom < 8 && (size + 2 * cinfo.scale_denom - 1) / (2 * cinfo.scale_denom) >= (unsigned int)max_size)
+            cinfo.scale_denom *= 2;
+    }
+    jpeg_start_decompress(&cinfo);
+
+    int dw, dh;
+    size_t stride = cinfo.output_width * 3;
+    if (fit_size(cinfo.output_width, cinfo.output_height, max_size, &dw, &dh)) {
+        // decode into a single row and filter it right away
+        box = new BoxFilter;
+        data = (unsigned char*)malloc(stride);
+        if (!data || !box->init(cinfo.output_width, cinfo.output_height, dw, dh))
+            longjmp(jerr.jump, 1);
+        while (cinfo.output_scanline < cinfo.output_height) {
+            int y = cinfo.output_scanline;
+            JSAMPROW row = data;
+            jpeg_read_scanlines(&cinfo, &row, 1);
+            box->add_row(y, data);
+        }
+        box->finish(img);
+        free(data);
+        delete box;
+    }
+    else {
+        data = (unsigned char*)malloc(stride * cinfo.output_height);
+        if (!data)
+            longjmp(jerr.jump, 1);
+        while (cinfo.output_scanline < cinfo.output_height) {
+            JSAMPROW row = data + stride * cinfo.output_scanline;
+            jpeg_read_scanlines(&cinfo, &row, 1);
+        }
+        img->width = cinfo.output_width;
+        img->height = cinfo.output_height;
+        img->data = data;
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+/* png++ consumer that passes every decoded row through a BoxFilter */
+class png_box_reader
+    : public png::consumer< png::rgb_pixel, png_box_reader >
+{
+public:
+    png_box_reader(png::image_info &info, int max_size)
+        : png::consumer< png::rgb_pixel, png_box_reader >(info),
+          m_max_size(max_size), m_last(-1)
+    {
+    }
+
+    ~png_box_reader()
+    {
+        free(m_box.data);
+    }
+
+    void reset(size_t pass)
+    {
+        (void) pass;
+        int w = get_info().get_width(), h = get_info().get_height(), dw, dh;
+        fit_size(w, h, m_max_size, &dw, &dh);
+        m_row.resize(3 * w);
+        if (!m_box.init(w, h, dw, dh))
+            throw std::bad_alloc();
+    }
+
+    // the row asked for last time has been filled by now
+    png::byte *get_next_row(size_t pos)
+    {
+        if (m_last >= 0)
+            m_box.add_row(m_last, &m_row[0]);
+        m_last = pos;
+        return &m_row[0];
+    }
+
+    void finish(Image *img)
+    {
+        if (m_last >= 0)
+            m_box.add_row(m_last, &m_row[0]);
+        m_box.finish(img);
+    }
+
+private:
+    int m_max_size;
+    int m_last;
+    std::vector< png::byte > m_row;
+    BoxFilter m_box;
+};
+
+static bool
+decode_png(const char *filename, int max_size, bool interlaced, int width, int height, Image *img)
+{
+    typedef png::image< png::rgb_pixel, png::solid_pixel_buffer< png::rgb_pixel > > rgb_image;
+    int dw, dh;
+
+    try {
+        // interlaced images need all passes before a row is final
+        if (!interlaced && fit_size(width, height, max_size, &dw, &dh)) {
+            std::ifstream stream(filename, std::ios::binary);
+            if (!stream.is_open())
+                return false;
+            stream.exceptions(std::ios::badbit);
+
+            png::image_info info = png::make_image_info< png::rgb_pixel >();
+            png_box_reader reader(info, max_size);
+            reader.read(stream, png::convert_color_space< png::rgb_pixel >());
+            reader.finish(img);
+            return true;
+        }
+
+        // png++ converts palette, gray, alpha and 16 bit images to 8 bit RGB
+        rgb_image image(filename);
+        const std::vector< png::byte > &bytes = image.get_pixbuf().get_bytes();
+        if (downscale_image(&bytes[0], image.get_width(), image.get_height(), max_size, img))
+            return true;
+        img->data = (unsigned char*)malloc(bytes.size());
+        if (!img->data)
+            return false;
+        memcpy(img->data, &bytes[0], bytes.size());
+        img->width = image.get_width();
+        img->height = image.get_height();
+        return true;
+    }
+    catch (std::exception &) {
+        free_image(img);
+        return false;
+    }
+}
+
+static unsigned int
+read_be32(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+bool
+decode_image(const char *filename, int max_size, Image *img)
+{
+    unsigned char header[29];
+    bool ok = false;
+
+    img->width = img->height = 0;
+    img->data = NULL;
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return false;
+
+    // look at the signature, texture files are often misnamed
+    size_t n = fread(header, 1, sizeof(header), fp);
+    if (n >= 3 && header[0] == 0xFF && header[1] == 0xD8 && header[2] == 0xFF) {
+        rewind(fp);
+        ok = decode_jpeg(fp, max_size, img);
+        fclose(fp);
+    }
+    else if (n == sizeof(header) && !memcmp(header, "\x89PNG\r\n\x1a\n", 8) && !memcmp(header + 12, "IHDR", 4)) {
+        fclose(fp);
+        ok = decode_png(filename, max_size, header[28] != 0, read_be32(header + 16), read_be32(header + 20), img);
+    }
+    else {
+        fclose(fp);
+    }
+
+    return ok;
+}
+
+void
+free_image(Image *img)
+{
+    free(img->data);
+    img->data = NULL;
+}
+
+struct TextureDecodeQueue {
+    const char * const *filenames;
+    int count;
+    int max_size;
+    std::vector<pthread_t> threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;
+    int next;                   // next file to decode
+    int handed_out;             // files returned by next_decoded_texture
+    bool cancel;
+    std::vector<int> ready;     // decoded, not handed out yet
+    std::vector<Image> images;
+};
+
+static void *
+decode_thread(void *arg)
+{
+    TextureDecodeQueue *q = (TextureDecodeQueue*)arg;
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->cancel && q->next < q->count) {
+        int i = q->next++;
+        pthread_mutex_unlock(&q->lock);
+
+        Image img;
+        decode_image(q->filenames[i], q->max_size, &img);
+
+        pthread_mutex_lock(&q->lock);
+        q->images[i] = img;
+        q->ready.push_back(i);
+        pthread_cond_signal(&q->ready_cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+TextureDecodeQueue *
+start_texture_decoding(const char * const *filenames, int count, int threads, int max_size)
+{
+    TextureDecodeQueue *q = new TextureDecodeQueue;
+    q->filenames = filenames;
+    q->count = count;
+    q->max_size = max_size;
+    q->next = 0;
+    q->handed_out = 0;
+    q->cancel = false;
+    q->images.resize(count);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->ready_cond, NULL);
+
+    if (threads > count)
+        threads = count;
+    for (int t = 0; t < threads; t++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, decode_thread, q) == 0)
+            q->threads.push_back(thread);
+    }
+    return q;
+}
+
+int
+next_decoded_texture(TextureDecodeQueue *q, Image *img)
+{
+    if (q->handed_out >= q->count)
+        return -1;
+
+    // without threads the files are decoded here, one per call
+    if (q->threads.empty()) {
+        int i = q->next++;
+        decode_image(q->filenames[i], q->max_size, img);
+        q->handed_out++;
+        return i;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    while (q->ready.empty())
+        pthread_cond_wait(&q->ready_cond, &q->lock);
+    int i = q->ready.front();
+    q->ready.erase(q->ready.begin());
+    pthread_mutex_unlock(&q->lock);
+
+    *img = q->images[i];
+    q->images[i].data = NULL;
+    q->handed_out++;
+    return i;
+}
+
+void
+finish_texture_decoding(TextureDecodeQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->cancel = true;
+    pthread_mutex_unlock(&q->lock);
+
+    for (size_t t = 0; t < q->threads.size(); t++)
+        pthread_join(q->threads[t], NULL);
+    for (size_t i = 0; i < q->images.size(); i++)
+        free_image(&q->images[i]);
+
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->ready_cond);
+    delete q;
+}
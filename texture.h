@@ -0,0 +1,47 @@
+/*
+ * Thread-safe texture decoding for the renderer
+ *
+ * JPEG files are decoded with libjpeg and PNG files with png++, both of which
+ * keep all of their state per call, so several textures can be decoded at the
+ * same time. Everything else is left to DevIL, whose bound-image state is
+ * global, on the GL thread.
+ */
+
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+// 8 bit RGB pixels, rows top-down as stored in the file
+struct Image {
+    int width;
+    int height;
+    unsigned char *data;
+};
+
+/* decode a JPEG or PNG file, returns false for other formats and for files the
+ * decoders reject, the caller should then try DevIL. Images larger than
+ * max_size in either direction are scaled down to fit while decoding, JPEG
+ * with DCT scaling plus a box filter and PNG with a box filter on every row,
+ * so the full size image is never held in memory; 0 keeps the size. */
+bool decode_image(const char *filename, int max_size, Image *img);
+
+/* box filter an RGB image down to fit max_size, false if it already fits */
+bool downscale_image(const unsigned char *data, int width, int height, int max_size, Image *img);
+
+void free_image(Image *img);
+
+/* Decodes a list of files on a pool of threads. Decoded images are handed out
+ * in the order they finish, so the caller can upload one while the others are
+ * still being decoded. */
+struct TextureDecodeQueue;
+
+TextureDecodeQueue *start_texture_decoding(const char * const *filenames, int count, int threads, int max_size);
+
+/* wait for the next finished file, returns its index in filenames and fills img,
+ * img->data is NULL if the file has to go through DevIL; returns -1 when every
+ * file has been handed out */
+int next_decoded_texture(TextureDecodeQueue *queue, Image *img);
+
+/* join the threads, images that were not handed out yet are freed */
+void finish_texture_decoding(TextureDecodeQueue *queue);
+
+#endif